@@ -3,6 +3,7 @@
 #include <cstring>
 /** 
 * Map a memory range of this buffer. If successful, mapped points to the specified buffer range.
+* @note The memory block is persistently mapped by the allocator, this only points inside it
 * 
 * @param size (Optional) Size of the memory range to map. Pass VK_WHOLE_SIZE to map the complete buffer range.
 * @param offset (Optional) Byte offset from beginning
@@ -10,19 +11,20 @@
 * @return VkResult of the buffer mapping call
 */
 VkResult Buffer::map(VkDeviceSize size, VkDeviceSize offset) {
-	return vkMapMemory(device, memory, offset, size, 0, &mapped);
+	void *blockMapped = getMappedPointer(buffer);
+	if (!blockMapped)
+		return VK_ERROR_MEMORY_MAP_FAILED;
+	mapped = static_cast<char*>(blockMapped) + offset;
+	return VK_SUCCESS;
 }
 
 /**
 * Unmap a mapped memory range
 *
-* @note Does not return a result as vkUnmapMemory can't fail
+* @note The memory block stays mapped until the buffer is destroyed
 */
 void Buffer::unmap() {
-	if (mapped) {
-		vkUnmapMemory(device, memory);
-		mapped = nullptr;
-	}
+	mapped = nullptr;
 }
 
 /** 
@@ -33,7 +35,7 @@ void Buffer::unmap() {
 * @return VkResult of the bindBufferMemory call
 */
 VkResult Buffer::bind(VkDeviceSize offset) {
-	return vkBindBufferMemory(device, buffer, memory, offset);
+	return vkBindBufferMemory(device, buffer, memory, memoryOffset + offset);
 }
 
 /**
@@ -75,8 +77,8 @@ VkResult Buffer::flush(VkDeviceSize size, VkDeviceSize offset) {
 	VkMappedMemoryRange mappedRange = {};
 	mappedRange.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
 	mappedRange.memory = memory;
-	mappedRange.offset = offset;
-	mappedRange.size = size;
+	mappedRange.offset = memoryOffset + offset;
+	mappedRange.size = size == VK_WHOLE_SIZE ? this->size - offset : size;
 	return vkFlushMappedMemoryRanges(device, 1, &mappedRange);
 }
 
@@ -94,8 +96,8 @@ VkResult Buffer::invalidate(VkDeviceSize size, VkDeviceSize offset) {
 	VkMappedMemoryRange mappedRange = {};
 	mappedRange.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
 	mappedRange.memory = memory;
-	mappedRange.offset = offset;
-	mappedRange.size = size;
+	mappedRange.offset = memoryOffset + offset;
+	mappedRange.size = size == VK_WHOLE_SIZE ? this->size - offset : size;
 	return vkInvalidateMappedMemoryRanges(device, 1, &mappedRange);
 }
 
@@ -104,9 +106,7 @@ VkResult Buffer::invalidate(VkDeviceSize size, VkDeviceSize offset) {
 */
 void Buffer::destroy() {
 	if (buffer) {
+		freeBufferMemory(buffer);
 		vkDestroyBuffer(device, buffer, nullptr);
 	}
-	if (memory) {
-		vkFreeMemory(device, memory, nullptr);
-	}
 }
@@ -12,6 +12,8 @@ struct Buffer
 	VkDevice device;
 	VkBuffer buffer = VK_NULL_HANDLE;
 	VkDeviceMemory memory = VK_NULL_HANDLE;
+	/** @brief Offset of the buffer in the (shared) memory block */
+	VkDeviceSize memoryOffset = 0;
 	VkDescriptorBufferInfo descriptor;
 	VkDeviceSize size = 0;
 	VkDeviceSize alignment = 0;
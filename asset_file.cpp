@@ -0,0 +1,102 @@
+#include "asset_file.h"
+
+#include <filesystem>
+#include <stdexcept>
+#include <fmt/core.h>
+
+#include <cmrc/cmrc.hpp>
+CMRC_DECLARE(gltf_rc);
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+static bool existsOnDisk(const std::string &path) {
+	std::error_code ec;
+	return fs::is_regular_file(path, ec);
+}
+
+bool AssetFile::exists(const std::string &path) {
+	return existsOnDisk(path) || cmrc::gltf_rc::get_filesystem().exists(path);
+}
+
+AssetFile::AssetFile(const std::string &path) {
+	if (!existsOnDisk(path)) {
+		auto cmrcFS = cmrc::gltf_rc::get_filesystem();
+		if (!cmrcFS.exists(path))
+			throw std::runtime_error(fmt::format("failed to find asset {}!", path));
+		auto fileRC = cmrcFS.open(path);
+		dataPtr = reinterpret_cast<const unsigned char*>(fileRC.cbegin());
+		dataSize = fileRC.size();
+		return;
+	}
+
+#ifdef _WIN32
+	fileHandle = CreateFileW(fs::path(path).wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (fileHandle == INVALID_HANDLE_VALUE) {
+		fileHandle = nullptr;
+		throw std::runtime_error(fmt::format("failed to open asset {}!", path));
+	}
+	LARGE_INTEGER fileSize;
+	GetFileSizeEx(fileHandle, &fileSize);
+	dataSize = static_cast<size_t>(fileSize.QuadPart);
+	if (dataSize == 0)
+		return;
+
+	mappingHandle = CreateFileMappingW(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mappingHandle)
+		mapping = MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+	if (!mapping) {
+		release();
+		throw std::runtime_error(fmt::format("failed to map asset {}!", path));
+	}
+#else
+	const int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error(fmt::format("failed to open asset {}!", path));
+	struct stat st{};
+	fstat(fd, &st);
+	dataSize = static_cast<size_t>(st.st_size);
+	if (dataSize > 0) {
+		void *view = mmap(nullptr, dataSize, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (view != MAP_FAILED) {
+			mapping = view;
+			// the loaders read the file front to back
+			madvise(mapping, dataSize, MADV_SEQUENTIAL);
+		}
+	}
+	close(fd);
+	if (dataSize > 0 && !mapping)
+		throw std::runtime_error(fmt::format("failed to map asset {}!", path));
+#endif
+	dataPtr = static_cast<const unsigned char*>(mapping);
+}
+
+AssetFile::~AssetFile() {
+	release();
+}
+
+void AssetFile::release() {
+#ifdef _WIN32
+	if (mapping)
+		UnmapViewOfFile(mapping);
+	if (mappingHandle)
+		CloseHandle(mappingHandle);
+	if (fileHandle)
+		CloseHandle(fileHandle);
+	mapping = mappingHandle = fileHandle = nullptr;
+#else
+	if (mapping)
+		munmap(mapping, dataSize);
+	mapping = nullptr;
+#endif
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string>
+
+// Read only view on an asset: memory-mapped from the disk, or the resource embedded in the executable (cmrc) when the file is not on the disk
+// the data stay valid until the AssetFile is destroyed, nothing is copied
+class AssetFile {
+public:
+	explicit AssetFile(const std::string &path);
+	~AssetFile();
+
+	AssetFile(const AssetFile &) = delete;
+	AssetFile &operator=(const AssetFile &) = delete;
+
+	const unsigned char *data() const { return dataPtr; }
+	size_t size() const { return dataSize; }
+	bool isMapped() const { return mapping != nullptr; }
+
+	static bool exists(const std::string &path);
+
+private:
+	void release();
+
+	const unsigned char *dataPtr = nullptr;
+	size_t dataSize = 0;
+	void *mapping = nullptr; // base address of the view, null for embedded resources
+#ifdef _WIN32
+	void *fileHandle = nullptr;
+	void *mappingHandle = nullptr;
+#endif
+};
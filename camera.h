@@ -7,6 +7,9 @@
 
 struct GLFWwindow;
 
+// vertical field of view of the projections, in degrees
+constexpr float CAMERA_FOV = 45.f;
+
 extern glm::vec2 jitterCam;
 extern glm::mat4 camWorld;
 extern float pitch, yaw, roll;
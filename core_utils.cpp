@@ -1,7 +1,13 @@
 #include "core_utils.h"
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstring>
+#include <exception>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
 #include <fmt/core.h>
 
 #include "VulkanBuffer.h"
@@ -26,6 +32,7 @@ VkFormat swapChainImageFormat;
 
 VkPhysicalDeviceAccelerationStructureFeaturesKHR accelerationStructureFeatures{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR};
 VkPhysicalDeviceRayTracingPipelinePropertiesKHR rayTracingPipelineProperties{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_PROPERTIES_KHR};
+VkPhysicalDeviceAccelerationStructurePropertiesKHR accelerationStructureProperties{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR};
 
 VkSampleCountFlagBits msaaSamples = VK_SAMPLE_COUNT_1_BIT;
 
@@ -64,8 +71,13 @@ std::string errorString(VkResult errorCode) {
 }
 
 uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) {
-	VkPhysicalDeviceMemoryProperties memProperties;
-	vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
+	// the memory properties don't change, query them only once
+	static VkPhysicalDeviceMemoryProperties memProperties;
+	static bool memPropertiesQueried = false;
+	if (!memPropertiesQueried) {
+		vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
+		memPropertiesQueried = true;
+	}
 
 	for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
 		if ((typeFilter & (1 << i)) && (memProperties.memoryTypes[i].propertyFlags & properties) == properties) {
@@ -79,7 +91,8 @@ void createBuffer(VkDeviceSize size,
                   VkBufferUsageFlags usage,
                   VkMemoryPropertyFlags properties,
                   VkBuffer &buffer,
-                  VkDeviceMemory &bufferMemory) {
+                  VkDeviceMemory &bufferMemory,
+                  MemoryPoolType poolType) {
 	VkBufferCreateInfo bufferInfo{};
 	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
 	bufferInfo.size = size;
@@ -90,27 +103,9 @@ void createBuffer(VkDeviceSize size,
 		throw std::runtime_error("failed to create buffer!");
 	}
 
-	VkMemoryRequirements memRequirements;
-	vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
-
-	VkMemoryAllocateInfo allocInfo{};
-	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.allocationSize = memRequirements.size;
-	allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
-
-	// If the buffer has VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT set we also need to enable the appropriate flag during allocation
-	VkMemoryAllocateFlagsInfoKHR allocFlagsInfo{};
-	if (usage & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT) {
-		allocFlagsInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO_KHR;
-		allocFlagsInfo.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT_KHR;
-		allocInfo.pNext = &allocFlagsInfo;
-	}
-
-	if (vkAllocateMemory(device, &allocInfo, nullptr, &bufferMemory) != VK_SUCCESS) {
+	if (bindBufferMemory(buffer, properties, bufferMemory, poolType) != VK_SUCCESS) {
 		throw std::runtime_error("failed to allocate buffer memory!");
 	}
-
-	vkBindBufferMemory(device, buffer, bufferMemory, 0);
 }
 
 /**
@@ -133,21 +128,11 @@ VkResult createBuffer(VkBufferUsageFlags usageFlags, VkMemoryPropertyFlags memor
 	bufferCreateInfo.size = size;
 	VK_CHECK_RESULT(vkCreateBuffer(device, &bufferCreateInfo, nullptr, &buffer->buffer));
 
-	// Create the memory backing up the buffer handle
+	// Sub-allocate the memory backing up the buffer handle and attach it to the buffer
 	VkMemoryRequirements memReqs;
-	VkMemoryAllocateInfo memAlloc{VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO};
 	vkGetBufferMemoryRequirements(device, buffer->buffer, &memReqs);
-	memAlloc.allocationSize = memReqs.size;
-	// Find a memory type index that fits the properties of the buffer
-	memAlloc.memoryTypeIndex = findMemoryType(memReqs.memoryTypeBits, memoryPropertyFlags);
-	// If the buffer has VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT set we also need to enable the appropriate flag during allocation
-	VkMemoryAllocateFlagsInfoKHR allocFlagsInfo{};
-	if (usageFlags & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT) {
-		allocFlagsInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO_KHR;
-		allocFlagsInfo.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT_KHR;
-		memAlloc.pNext = &allocFlagsInfo;
-	}
-	VK_CHECK_RESULT(vkAllocateMemory(device, &memAlloc, nullptr, &buffer->memory));
+	VK_CHECK_RESULT(bindBufferMemory(buffer->buffer, memoryPropertyFlags, buffer->memory));
+	buffer->memoryOffset = getMemoryOffset(buffer->buffer);
 
 	buffer->alignment = memReqs.alignment;
 	buffer->size = size;
@@ -167,8 +152,7 @@ VkResult createBuffer(VkBufferUsageFlags usageFlags, VkMemoryPropertyFlags memor
 	// Initialize a default descriptor that covers the whole buffer size
 	buffer->setupDescriptor();
 
-	// Attach the memory to the buffer object
-	return buffer->bind();
+	return VK_SUCCESS;
 }
 
 void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
@@ -265,19 +249,9 @@ void createImage(uint32_t width,
 		throw std::runtime_error("failed to create image!");
 	}
 
-	VkMemoryRequirements memRequirements;
-	vkGetImageMemoryRequirements(device, image, &memRequirements);
-
-	VkMemoryAllocateInfo allocInfo{};
-	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.allocationSize = memRequirements.size;
-	allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
-
-	if (vkAllocateMemory(device, &allocInfo, nullptr, &imageMemory) != VK_SUCCESS) {
+	if (bindImageMemory(image, properties, imageMemory) != VK_SUCCESS) {
 		throw std::runtime_error("failed to allocate image memory!");
 	}
-
-	vkBindImageMemory(device, image, imageMemory, 0);
 }
 
 bool hasStencilComponent(VkFormat format) {
@@ -478,3 +452,86 @@ void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t
 
 	endSingleTimeCommands(commandBuffer);
 }
+
+void parallelFor(uint32_t count, const std::function<void(uint32_t)> &task) {
+	const uint32_t workerCount = std::min(count, std::max(1u, std::thread::hardware_concurrency()));
+	if (workerCount <= 1) {
+		for (uint32_t i = 0; i < count; ++i)
+			task(i);
+		return;
+	}
+
+	std::atomic<uint32_t> next{0};
+	std::exception_ptr error;
+	std::mutex errorMutex;
+	auto worker = [&]() {
+		for (uint32_t i = next++; i < count; i = next++) {
+			try {
+				task(i);
+			} catch (...) {
+				std::lock_guard<std::mutex> lock(errorMutex);
+				if (!error)
+					error = std::current_exception();
+				next = count;
+			}
+		}
+	};
+
+	// the calling thread is one of the workers
+	std::vector<std::thread> threads;
+	for (uint32_t i = 1; i < workerCount; ++i)
+		threads.emplace_back(worker);
+	worker();
+	for (auto &thread : threads)
+		thread.join();
+
+	if (error)
+		std::rethrow_exception(error);
+}
+
+uint64_t hashBytes(const void *data, size_t size, uint64_t seed) {
+	constexpr uint64_t P1 = 11400714785074694791ULL, P2 = 14029467366897019727ULL, P3 = 1609587929392839161ULL, P4 = 9650029242287828579ULL,
+	                   P5 = 2870177450012600261ULL;
+	auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+	auto read64 = [](const uint8_t *p) { uint64_t v; memcpy(&v, p, sizeof(v)); return v; };
+	auto read32 = [](const uint8_t *p) { uint32_t v; memcpy(&v, p, sizeof(v)); return v; };
+	auto round = [&](uint64_t acc, uint64_t input) { return rotl(acc + input * P2, 31) * P1; };
+	auto merge = [&](uint64_t acc, uint64_t val) { return (acc ^ round(0, val)) * P1 + P4; };
+
+	const uint8_t *p = static_cast<const uint8_t*>(data);
+	const uint8_t *end = p + size;
+	uint64_t h;
+	if (size >= 32) {
+		uint64_t v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+		do {
+			v1 = round(v1, read64(p));
+			v2 = round(v2, read64(p + 8));
+			v3 = round(v3, read64(p + 16));
+			v4 = round(v4, read64(p + 24));
+			p += 32;
+		} while (p <= end - 32);
+		h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+		h = merge(h, v1);
+		h = merge(h, v2);
+		h = merge(h, v3);
+		h = merge(h, v4);
+	} else
+		h = seed + P5;
+
+	h += size;
+	for (; p + 8 <= end; p += 8)
+		h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+	if (p + 4 <= end) {
+		h = rotl(h ^ (read32(p) * P1), 23) * P2 + P3;
+		p += 4;
+	}
+	for (; p < end; ++p)
+		h = rotl(h ^ (*p * P5), 11) * P1;
+
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	h ^= h >> 32;
+	return h;
+}
@@ -1,9 +1,12 @@
 #pragma once
 
+#include <functional>
 #include <stdexcept>
 #include <vector>
 #include <vulkan/vulkan.h>
 
+#include "memory_allocator.h"
+
 struct Buffer;
 std::string errorString(VkResult errorCode);
 
@@ -53,6 +56,7 @@ extern VkExtent2D swapChainExtent;
 
 extern VkPhysicalDeviceAccelerationStructureFeaturesKHR accelerationStructureFeatures;
 extern VkPhysicalDeviceRayTracingPipelinePropertiesKHR rayTracingPipelineProperties;
+extern VkPhysicalDeviceAccelerationStructurePropertiesKHR accelerationStructureProperties;
 
 
 uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties);
@@ -61,7 +65,8 @@ void createBuffer(VkDeviceSize size,
                   VkBufferUsageFlags usage,
                   VkMemoryPropertyFlags properties,
                   VkBuffer &buffer,
-                  VkDeviceMemory &bufferMemory);
+                  VkDeviceMemory &bufferMemory,
+                  MemoryPoolType poolType = MemoryPoolType::FreeList);
 VkResult createBuffer(VkBufferUsageFlags usageFlags, VkMemoryPropertyFlags memoryPropertyFlags, Buffer *buffer, VkDeviceSize size, void *data = nullptr);
 void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size);
 
@@ -93,3 +98,10 @@ void setImageLayout(VkCommandBuffer cmdbuffer,
                     VkPipelineStageFlags srcStageMask = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
                     VkPipelineStageFlags dstStageMask = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
 void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height);
+
+// run task(i) for i in [0, count) on all the cores, the first exception thrown by a task is rethrown on the calling thread
+// tasks must not touch Vulkan objects that need external synchronization (queues, command pools)
+void parallelFor(uint32_t count, const std::function<void(uint32_t)> &task);
+
+// 64 bits content hash (xxHash64), used to validate caches and find duplicated data
+uint64_t hashBytes(const void *data, size_t size, uint64_t seed = 0);
@@ -0,0 +1,292 @@
+#include "culling.h"
+
+#include <algorithm>
+#include <array>
+#include <string>
+
+#include "core_utils.h"
+#include "rasterizer.h"
+#include "texture.h"
+
+bool USE_GPU_CULLING = true;
+
+constexpr uint32_t CULL_GROUP_SIZE = 64;
+constexpr uint32_t PYRAMID_GROUP_SIZE = 8;
+
+struct DepthPyramidPushConstants {
+	int32_t srcSize[2];
+	int32_t dstSize[2];
+};
+static_assert(sizeof(DepthPyramidPushConstants) == 16, "DepthPyramidPushConstants must match the push constants of depthPyramid.comp");
+
+struct CullingResources {
+	// R32_SFLOAT, always in GENERAL, the level 0 is half the depth rounded up
+	VkImage pyramid{VK_NULL_HANDLE};
+	VkDeviceMemory pyramidMemory{VK_NULL_HANDLE};
+	VkImageView pyramidView{VK_NULL_HANDLE};
+	std::vector<VkImageView> levelViews;
+	std::vector<VkExtent2D> levelSizes;
+	VkExtent2D extent{};
+	VkSampler sampler{VK_NULL_HANDLE};
+	bool pyramidValid{false};
+
+	std::vector<VkImage> depthImages;
+	VkImageAspectFlags depthAspect{VK_IMAGE_ASPECT_DEPTH_BIT};
+
+	VkDescriptorSetLayout pyramidSetLayout{VK_NULL_HANDLE}, cullSetLayout{VK_NULL_HANDLE};
+	VkPipelineLayout pyramidPipelineLayout{VK_NULL_HANDLE}, cullPipelineLayout{VK_NULL_HANDLE};
+	VkPipeline pyramidPipeline{VK_NULL_HANDLE}, cullInstancesPipeline{VK_NULL_HANDLE}, compactDrawsPipeline{VK_NULL_HANDLE};
+	VkDescriptorPool descriptorPool{VK_NULL_HANDLE};
+	// the level 0 of each frame in flight, then the next levels
+	std::vector<VkDescriptorSet> pyramidSets;
+	VkDescriptorSet cullSet{VK_NULL_HANDLE};
+};
+static CullingResources culling;
+
+static VkPipeline createComputePipeline(const std::string &shaderPath, VkPipelineLayout layout) {
+	VkComputePipelineCreateInfo pipelineInfo{};
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	pipelineInfo.stage = loadShader(shaderPath, VK_SHADER_STAGE_COMPUTE_BIT);
+	pipelineInfo.layout = layout;
+
+	VkPipeline pipeline;
+	VK_CHECK_RESULT(vkCreateComputePipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &pipeline));
+	vkDestroyShaderModule(device, pipelineInfo.stage.module, nullptr);
+	return pipeline;
+}
+
+static void createComputeLayout(const std::vector<VkDescriptorType> &bindingTypes, uint32_t pushConstantSize, VkDescriptorSetLayout &setLayout, VkPipelineLayout &pipelineLayout) {
+	std::vector<VkDescriptorSetLayoutBinding> bindings(bindingTypes.size());
+	for (uint32_t i = 0; i < bindings.size(); ++i)
+		bindings[i] = {i, bindingTypes[i], 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr};
+
+	VkDescriptorSetLayoutCreateInfo layoutInfo{};
+	layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	layoutInfo.bindingCount = static_cast<uint32_t>(bindings.size());
+	layoutInfo.pBindings = bindings.data();
+	VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &setLayout));
+
+	VkPushConstantRange pushConstantRange{VK_SHADER_STAGE_COMPUTE_BIT, 0, pushConstantSize};
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.setLayoutCount = 1;
+	pipelineLayoutInfo.pSetLayouts = &setLayout;
+	pipelineLayoutInfo.pushConstantRangeCount = 1;
+	pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+	VK_CHECK_RESULT(vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout));
+}
+
+static VkDescriptorSet allocateSet(VkDescriptorSetLayout setLayout) {
+	VkDescriptorSetAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.descriptorPool = culling.descriptorPool;
+	allocInfo.descriptorSetCount = 1;
+	allocInfo.pSetLayouts = &setLayout;
+	VkDescriptorSet descriptorSet;
+	VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocInfo, &descriptorSet));
+	return descriptorSet;
+}
+
+// the source sampled with texelFetch, the level written as a storage image
+static VkDescriptorSet createPyramidSet(VkImageView srcView, VkImageLayout srcLayout, VkImageView dstView) {
+	VkDescriptorSet descriptorSet = allocateSet(culling.pyramidSetLayout);
+	VkDescriptorImageInfo srcInfo{culling.sampler, srcView, srcLayout};
+	VkDescriptorImageInfo dstInfo{VK_NULL_HANDLE, dstView, VK_IMAGE_LAYOUT_GENERAL};
+
+	std::array<VkWriteDescriptorSet, 2> descriptorWrites{};
+	descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	descriptorWrites[0].dstSet = descriptorSet;
+	descriptorWrites[0].dstBinding = 0;
+	descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	descriptorWrites[0].descriptorCount = 1;
+	descriptorWrites[0].pImageInfo = &srcInfo;
+	descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	descriptorWrites[1].dstSet = descriptorSet;
+	descriptorWrites[1].dstBinding = 1;
+	descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+	descriptorWrites[1].descriptorCount = 1;
+	descriptorWrites[1].pImageInfo = &dstInfo;
+	vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, nullptr);
+	return descriptorSet;
+}
+
+void createCullingResources(VkExtent2D extent, const std::vector<StorageImage> &depthImages, VkFormat depthFormat) {
+	culling.extent = extent;
+	culling.pyramidValid = false;
+	culling.depthImages.clear();
+	for (const auto &depthImage : depthImages)
+		culling.depthImages.push_back(depthImage.image);
+	// the layout changes cover both aspects of a combined format
+	culling.depthAspect = VK_IMAGE_ASPECT_DEPTH_BIT;
+	if (depthFormat == VK_FORMAT_D32_SFLOAT_S8_UINT || depthFormat == VK_FORMAT_D24_UNORM_S8_UINT)
+		culling.depthAspect |= VK_IMAGE_ASPECT_STENCIL_BIT;
+
+	// depth pyramid
+	culling.levelSizes.clear();
+	VkExtent2D levelSize = {std::max((extent.width + 1) / 2, 1u), std::max((extent.height + 1) / 2, 1u)};
+	culling.levelSizes.push_back(levelSize);
+	while (levelSize.width > 1 || levelSize.height > 1) {
+		levelSize = {(levelSize.width + 1) / 2, (levelSize.height + 1) / 2};
+		culling.levelSizes.push_back(levelSize);
+	}
+	const uint32_t levelCount = static_cast<uint32_t>(culling.levelSizes.size());
+
+	createImage(culling.levelSizes[0].width, culling.levelSizes[0].height, levelCount, VK_SAMPLE_COUNT_1_BIT, VK_FORMAT_R32_SFLOAT, VK_IMAGE_TILING_OPTIMAL,
+	            VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, culling.pyramid, culling.pyramidMemory);
+	transitionImageLayout(culling.pyramid, VK_FORMAT_R32_SFLOAT, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, levelCount);
+	culling.pyramidView = createImageView(culling.pyramid, VK_FORMAT_R32_SFLOAT, VK_IMAGE_ASPECT_COLOR_BIT, levelCount);
+	culling.levelViews.resize(levelCount);
+	for (uint32_t level = 0; level < levelCount; ++level) {
+		VkImageViewCreateInfo viewInfo{};
+		viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+		viewInfo.image = culling.pyramid;
+		viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+		viewInfo.format = VK_FORMAT_R32_SFLOAT;
+		viewInfo.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, level, 1, 0, 1};
+		VK_CHECK_RESULT(vkCreateImageView(device, &viewInfo, nullptr, &culling.levelViews[level]));
+	}
+
+	// only read with texelFetch
+	VkSamplerCreateInfo samplerInfo{};
+	samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+	samplerInfo.magFilter = VK_FILTER_NEAREST;
+	samplerInfo.minFilter = VK_FILTER_NEAREST;
+	samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+	samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.maxLod = VK_LOD_CLAMP_NONE;
+	VK_CHECK_RESULT(vkCreateSampler(device, &samplerInfo, nullptr, &culling.sampler));
+
+	// pipelines
+	createComputeLayout({VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE}, sizeof(DepthPyramidPushConstants), culling.pyramidSetLayout,
+	                    culling.pyramidPipelineLayout);
+	createComputeLayout({VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER}, static_cast<uint32_t>(std::max(sizeof(CullPushConstants), sizeof(CompactPushConstants))),
+	                    culling.cullSetLayout, culling.cullPipelineLayout);
+	culling.pyramidPipeline = createComputePipeline("spv/depthPyramid.comp.spv", culling.pyramidPipelineLayout);
+	culling.cullInstancesPipeline = createComputePipeline("spv/cullInstances.comp.spv", culling.cullPipelineLayout);
+	culling.compactDrawsPipeline = createComputePipeline("spv/compactDraws.comp.spv", culling.cullPipelineLayout);
+
+	// descriptor sets
+	const uint32_t pyramidSetCount = static_cast<uint32_t>(depthImages.size()) + levelCount - 1;
+	std::array<VkDescriptorPoolSize, 2> poolSizes{{{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, pyramidSetCount + 1}, {VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, pyramidSetCount}}};
+	VkDescriptorPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	poolInfo.maxSets = pyramidSetCount + 1;
+	poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
+	poolInfo.pPoolSizes = poolSizes.data();
+	VK_CHECK_RESULT(vkCreateDescriptorPool(device, &poolInfo, nullptr, &culling.descriptorPool));
+
+	culling.pyramidSets.clear();
+	for (const auto &depthImage : depthImages)
+		culling.pyramidSets.push_back(createPyramidSet(depthImage.view, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL, culling.levelViews[0]));
+	for (uint32_t level = 1; level < levelCount; ++level)
+		culling.pyramidSets.push_back(createPyramidSet(culling.levelViews[level - 1], VK_IMAGE_LAYOUT_GENERAL, culling.levelViews[level]));
+
+	culling.cullSet = allocateSet(culling.cullSetLayout);
+	VkDescriptorImageInfo pyramidInfo{culling.sampler, culling.pyramidView, VK_IMAGE_LAYOUT_GENERAL};
+	VkWriteDescriptorSet descriptorWrite{};
+	descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	descriptorWrite.dstSet = culling.cullSet;
+	descriptorWrite.dstBinding = 0;
+	descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	descriptorWrite.descriptorCount = 1;
+	descriptorWrite.pImageInfo = &pyramidInfo;
+	vkUpdateDescriptorSets(device, 1, &descriptorWrite, 0, nullptr);
+}
+
+void destroyCullingResources() {
+	if (culling.pyramid == VK_NULL_HANDLE)
+		return;
+	vkDestroyDescriptorPool(device, culling.descriptorPool, nullptr);
+	vkDestroyPipeline(device, culling.pyramidPipeline, nullptr);
+	vkDestroyPipeline(device, culling.cullInstancesPipeline, nullptr);
+	vkDestroyPipeline(device, culling.compactDrawsPipeline, nullptr);
+	vkDestroyPipelineLayout(device, culling.pyramidPipelineLayout, nullptr);
+	vkDestroyPipelineLayout(device, culling.cullPipelineLayout, nullptr);
+	vkDestroyDescriptorSetLayout(device, culling.pyramidSetLayout, nullptr);
+	vkDestroyDescriptorSetLayout(device, culling.cullSetLayout, nullptr);
+	vkDestroySampler(device, culling.sampler, nullptr);
+	for (auto view : culling.levelViews)
+		vkDestroyImageView(device, view, nullptr);
+	vkDestroyImageView(device, culling.pyramidView, nullptr);
+	freeImageMemory(culling.pyramid);
+	vkDestroyImage(device, culling.pyramid, nullptr);
+	culling = {};
+}
+
+static void computeBarrier(VkCommandBuffer commandBuffer, VkAccessFlags srcAccess, VkPipelineStageFlags dstStage, VkAccessFlags dstAccess) {
+	VkMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	barrier.srcAccessMask = srcAccess;
+	barrier.dstAccessMask = dstAccess;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, dstStage, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void recordCulling(VkCommandBuffer commandBuffer, CullPushConstants cull, const CompactPushConstants &compact) {
+	// the pyramid written by the previous frame
+	computeBarrier(commandBuffer, VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+
+	cull.depthSize[0] = static_cast<float>(culling.extent.width);
+	cull.depthSize[1] = static_cast<float>(culling.extent.height);
+	cull.pyramidLevels = static_cast<uint32_t>(culling.levelSizes.size());
+	cull.flags = CULL_FRUSTUM | (culling.pyramidValid ? CULL_OCCLUSION : 0);
+
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, culling.cullInstancesPipeline);
+	vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, culling.cullPipelineLayout, 0, 1, &culling.cullSet, 0, nullptr);
+	vkCmdPushConstants(commandBuffer, culling.cullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CullPushConstants), &cull);
+	vkCmdDispatch(commandBuffer, (cull.count + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+
+	// the instance counts of the commands
+	computeBarrier(commandBuffer, VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, culling.compactDrawsPipeline);
+	vkCmdPushConstants(commandBuffer, culling.cullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CompactPushConstants), &compact);
+	vkCmdDispatch(commandBuffer, (compact.count + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+
+	computeBarrier(commandBuffer, VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+	               VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT);
+}
+
+static void depthBarrier(VkCommandBuffer commandBuffer, uint32_t currentFrame, VkImageLayout oldLayout, VkImageLayout newLayout, VkPipelineStageFlags srcStage,
+                         VkAccessFlags srcAccess, VkPipelineStageFlags dstStage, VkAccessFlags dstAccess) {
+	VkImageMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.oldLayout = oldLayout;
+	barrier.newLayout = newLayout;
+	barrier.srcAccessMask = srcAccess;
+	barrier.dstAccessMask = dstAccess;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = culling.depthImages[currentFrame];
+	barrier.subresourceRange = {culling.depthAspect, 0, 1, 0, 1};
+	vkCmdPipelineBarrier(commandBuffer, srcStage, dstStage, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+}
+
+void recordDepthPyramid(VkCommandBuffer commandBuffer, uint32_t currentFrame) {
+	// the culling of this frame is done reading the pyramid
+	depthBarrier(commandBuffer, currentFrame, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+	             VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, culling.pyramidPipeline);
+	VkExtent2D srcSize = culling.extent;
+	for (uint32_t level = 0; level < culling.levelSizes.size(); ++level) {
+		const VkExtent2D dstSize = culling.levelSizes[level];
+		const VkDescriptorSet descriptorSet = level == 0 ? culling.pyramidSets[currentFrame] : culling.pyramidSets[culling.depthImages.size() + level - 1];
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, culling.pyramidPipelineLayout, 0, 1, &descriptorSet, 0, nullptr);
+
+		DepthPyramidPushConstants pushConstants{{static_cast<int32_t>(srcSize.width), static_cast<int32_t>(srcSize.height)},
+		                                        {static_cast<int32_t>(dstSize.width), static_cast<int32_t>(dstSize.height)}};
+		vkCmdPushConstants(commandBuffer, culling.pyramidPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pushConstants), &pushConstants);
+		vkCmdDispatch(commandBuffer, (dstSize.width + PYRAMID_GROUP_SIZE - 1) / PYRAMID_GROUP_SIZE, (dstSize.height + PYRAMID_GROUP_SIZE - 1) / PYRAMID_GROUP_SIZE, 1);
+
+		// the level is the source of the next one
+		computeBarrier(commandBuffer, VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+		srcSize = dstSize;
+	}
+	culling.pyramidValid = true;
+
+	depthBarrier(commandBuffer, currentFrame, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_SHADER_READ_BIT);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+#include "vertex_config.h"
+
+struct StorageImage;
+
+// GPU culling of the indirect draws: before the raster pass a compute pass tests the world box of each instance against the frustum
+// and against a depth pyramid (hierarchical z) built from the depth of the previous frame, the visible instances are counted in their
+// command and the commands with instances are compacted in the groups of the indirect buffer, the draw counts are written by the GPU
+
+extern bool USE_GPU_CULLING;
+
+// CullPushConstants::flags, the occlusion is only tested once a pyramid has been built
+constexpr uint32_t CULL_FRUSTUM = 1;
+constexpr uint32_t CULL_OCCLUSION = 2;
+
+// layouts of shaders/culling.glsl
+struct CullInstance {
+	float minBound[3];
+	uint32_t command;
+	float maxBound[3];
+	uint32_t instance;
+};
+
+// shaders/cullInstances.comp, the pyramid fields are set by recordCulling
+struct CullPushConstants {
+	glm::mat4 viewProj; // world to clip space
+	VkDeviceAddress cullInstances;
+	VkDeviceAddress commands;
+	VkDeviceAddress visibleInstances;
+	float depthSize[2];
+	uint32_t pyramidLevels;
+	uint32_t count;
+	uint32_t flags;
+	uint32_t padding; // to the 16 bytes alignment of viewProj
+};
+static_assert(sizeof(CullPushConstants) == 112, "CullPushConstants must match the push constants of cullInstances.comp");
+
+// shaders/compactDraws.comp
+struct CompactPushConstants {
+	VkDeviceAddress commands;
+	VkDeviceAddress drawCommands;
+	VkDeviceAddress drawCounts;
+	uint32_t count;
+	uint32_t groupEnd[4];
+	uint32_t padding; // to the 8 bytes alignment of the addresses
+};
+static_assert(sizeof(CompactPushConstants) == 48, "CompactPushConstants must match the push constants of compactDraws.comp");
+
+// the pyramid covers the extent pixels of the depth images, one per frame in flight (depth aspect views)
+void createCullingResources(VkExtent2D extent, const std::vector<StorageImage> &depthImages, VkFormat depthFormat);
+void destroyCullingResources();
+
+// instances then commands, the buffers are ready for the indirect draws and the vertex shaders after it
+void recordCulling(VkCommandBuffer commandBuffer, CullPushConstants cull, const CompactPushConstants &compact);
+// after the raster pass, the depth image of the frame is read and left in DEPTH_STENCIL_ATTACHMENT_OPTIMAL
+void recordDepthPyramid(VkCommandBuffer commandBuffer, uint32_t currentFrame);
@@ -0,0 +1,134 @@
+#include "geometry_cache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <fmt/core.h>
+#include <spdlog/spdlog.h>
+
+#include "asset_file.h"
+
+static constexpr char GEOMETRY_CACHE_MAGIC[8] = {'V', 'K', 'G', 'E', 'O', 'C', 'H', '\0'};
+static constexpr uint64_t GEOMETRY_CACHE_ALIGNMENT = 16;
+
+static uint64_t alignSection(uint64_t offset) { return (offset + GEOMETRY_CACHE_ALIGNMENT - 1) & ~(GEOMETRY_CACHE_ALIGNMENT - 1); }
+
+GeometryCacheString GeometryCacheContent::addString(const std::string &s) {
+	GeometryCacheString ref{static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(s.size())};
+	strings += s;
+	return ref;
+}
+
+bool writeGeometryCache(const std::string &cachePath, const GeometryCacheContent &content) {
+	GeometryCacheHeader header{};
+	memcpy(header.magic, GEOMETRY_CACHE_MAGIC, sizeof(header.magic));
+	header.version = GEOMETRY_CACHE_VERSION;
+	header.vertexStride = content.vertexStride;
+	header.materialStride = content.materialStride;
+	header.nodeStride = sizeof(GeometryCacheNode);
+	header.sourceHash = content.sourceHash;
+	header.sourceSize = content.sourceSize;
+	header.rootCount = content.rootCount;
+	header.nodeCount = static_cast<uint32_t>(content.nodes.size());
+	header.primCount = static_cast<uint32_t>(content.prims.size());
+	header.materialCount = content.materialCount;
+	header.imageCount = static_cast<uint32_t>(content.images.size());
+	header.dependencyCount = static_cast<uint32_t>(content.dependencies.size());
+
+	// layout the sections
+	struct Section {
+		uint64_t *offset;
+		const void *data;
+		uint64_t size;
+	};
+	header.stringsSize = content.strings.size();
+	header.verticesSize = content.verticesSize;
+	header.indicesSize = content.indicesSize;
+	header.meshletsSize = content.meshletsSize;
+	header.meshletVerticesSize = content.meshletVerticesSize;
+	header.meshletTrianglesSize = content.meshletTrianglesSize;
+	const Section sections[] = {
+		{&header.stringsOffset, content.strings.data(), content.strings.size()},
+		{&header.nodesOffset, content.nodes.data(), content.nodes.size() * sizeof(GeometryCacheNode)},
+		{&header.primsOffset, content.prims.data(), content.prims.size() * sizeof(GeometryCachePrim)},
+		{&header.materialsOffset, content.materials, uint64_t(content.materialCount) * content.materialStride},
+		{&header.imagesOffset, content.images.data(), content.images.size() * sizeof(GeometryCacheImage)},
+		{&header.dependenciesOffset, content.dependencies.data(), content.dependencies.size() * sizeof(GeometryCacheDependency)},
+		{&header.verticesOffset, content.vertices, content.verticesSize},
+		{&header.indicesOffset, content.indices, content.indicesSize},
+		{&header.meshletsOffset, content.meshlets, content.meshletsSize},
+		{&header.meshletVerticesOffset, content.meshletVertices, content.meshletVerticesSize},
+		{&header.meshletTrianglesOffset, content.meshletTriangles, content.meshletTrianglesSize},
+	};
+	uint64_t offset = alignSection(sizeof(GeometryCacheHeader));
+	for (const auto &section : sections) {
+		*section.offset = offset;
+		offset = alignSection(offset + section.size);
+	}
+
+	// write to a temporary file first, a partial cache is never seen by the loader
+	const std::string tmpPath = cachePath + ".tmp";
+	{
+		std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+		if (!file) {
+			spdlog::warn(fmt::format("Can't write the geometry cache {}", cachePath));
+			return false;
+		}
+		static const char padding[GEOMETRY_CACHE_ALIGNMENT] = {};
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		uint64_t written = sizeof(header);
+		for (const auto &section : sections) {
+			file.write(padding, static_cast<std::streamsize>(*section.offset - written));
+			if (section.size)
+				file.write(static_cast<const char*>(section.data), static_cast<std::streamsize>(section.size));
+			written = *section.offset + section.size;
+		}
+		if (!file) {
+			spdlog::warn(fmt::format("Can't write the geometry cache {}", cachePath));
+			return false;
+		}
+	}
+	std::remove(cachePath.c_str());
+	if (std::rename(tmpPath.c_str(), cachePath.c_str()) != 0) {
+		std::remove(tmpPath.c_str());
+		spdlog::warn(fmt::format("Can't write the geometry cache {}", cachePath));
+		return false;
+	}
+	spdlog::info(fmt::format("Geometry cache written to {} ({} bytes)", cachePath, offset));
+	return true;
+}
+
+bool GeometryCache::open(const std::string &cachePath, uint64_t sourceHash, uint64_t sourceSize, uint32_t vertexStride, uint32_t materialStride) {
+	try {
+		file = std::make_shared<AssetFile>(cachePath);
+	} catch (const std::exception &) {
+		return false;
+	}
+	if (!file->isMapped() || file->size() < sizeof(GeometryCacheHeader))
+		return false;
+
+	base = file->data();
+	headerPtr = reinterpret_cast<const GeometryCacheHeader*>(base);
+	const auto &h = *headerPtr;
+	if (memcmp(h.magic, GEOMETRY_CACHE_MAGIC, sizeof(h.magic)) != 0 || h.version != GEOMETRY_CACHE_VERSION || h.vertexStride != vertexStride ||
+	    h.materialStride != materialStride || h.nodeStride != sizeof(GeometryCacheNode))
+		return false;
+	if (h.sourceHash != sourceHash || h.sourceSize != sourceSize)
+		return false;
+
+	// every section must be inside the file
+	const uint64_t fileSize = file->size();
+	auto inside = [fileSize](uint64_t offset, uint64_t size) { return offset <= fileSize && size <= fileSize - offset; };
+	return inside(h.stringsOffset, h.stringsSize) && inside(h.nodesOffset, uint64_t(h.nodeCount) * sizeof(GeometryCacheNode)) &&
+	       inside(h.primsOffset, uint64_t(h.primCount) * sizeof(GeometryCachePrim)) && inside(h.materialsOffset, uint64_t(h.materialCount) * h.materialStride) &&
+	       inside(h.imagesOffset, uint64_t(h.imageCount) * sizeof(GeometryCacheImage)) &&
+	       inside(h.dependenciesOffset, uint64_t(h.dependencyCount) * sizeof(GeometryCacheDependency)) && inside(h.verticesOffset, h.verticesSize) &&
+	       inside(h.indicesOffset, h.indicesSize) && inside(h.meshletsOffset, h.meshletsSize) && inside(h.meshletVerticesOffset, h.meshletVerticesSize) &&
+	       inside(h.meshletTrianglesOffset, h.meshletTrianglesSize);
+}
+
+std::string_view GeometryCache::string(const GeometryCacheString &s) const {
+	if (uint64_t(s.offset) + s.size > headerPtr->stringsSize)
+		return {};
+	return {reinterpret_cast<const char*>(base + headerPtr->stringsOffset + s.offset), s.size};
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class AssetFile;
+
+// Binary cache of a loaded scene, written next to the source asset (<asset>.vkcache)
+// it holds the final GPU vertex/index/meshlet streams, the prims offsets, the materials, the node hierarchy and where to find the images
+// every section is a flat array of POD so the file is used straight from the memory mapping
+// bump the version when the layout or the geometry processing changes
+
+constexpr uint32_t GEOMETRY_CACHE_VERSION = 6;
+constexpr uint32_t GEOMETRY_CACHE_MAX_LODS = 4;
+
+struct GeometryCacheString {
+	uint32_t offset{0}, size{0};
+};
+
+struct GeometryCachePrim {
+	uint32_t key; // primsMeshCache key
+	uint32_t vertexCount, indexCount;
+	uint32_t offsetVertex, offsetIndex;
+	uint32_t indexType;
+	float minBound[3], maxBound[3];
+	uint32_t offsetMeshlet, meshletCount;
+	// index ranges of the levels of detail, lods[0] is offsetIndex/indexCount
+	struct Lod {
+		uint32_t offsetIndex, indexCount;
+		float error;
+	} lods[GEOMETRY_CACHE_MAX_LODS];
+	uint32_t lodCount;
+};
+
+// nodes are stored in pre-order, each node is followed by its children
+enum GeometryCacheNodeFlags : uint32_t { GEOMETRY_CACHE_NODE_CAMERA = 1, GEOMETRY_CACHE_NODE_SUBMESH = 2 };
+struct GeometryCacheNode {
+	float world[16];
+	GeometryCacheString name;
+	uint32_t childCount;
+	uint32_t flags;
+	uint32_t id, primMesh, mat;
+};
+
+// image bytes are a range of the source asset (glb binary chunk) or of a file next to it
+struct GeometryCacheImage {
+	GeometryCacheString uri, name, mimeType;
+	GeometryCacheString file; // empty for the source asset
+	uint64_t dataOffset, dataSize;
+};
+
+// external files the geometry comes from (.gltf buffers), they are part of the validation
+struct GeometryCacheDependency {
+	GeometryCacheString file;
+	uint64_t size, hash;
+};
+
+struct GeometryCacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t vertexStride, materialStride, nodeStride;
+	uint64_t sourceHash, sourceSize;
+	uint32_t rootCount, nodeCount, primCount, materialCount, imageCount, dependencyCount;
+	uint64_t stringsOffset, stringsSize;
+	uint64_t nodesOffset, primsOffset, materialsOffset, imagesOffset, dependenciesOffset;
+	uint64_t verticesOffset, verticesSize, indicesOffset, indicesSize;
+	uint64_t meshletsOffset, meshletsSize, meshletVerticesOffset, meshletVerticesSize, meshletTrianglesOffset, meshletTrianglesSize;
+};
+
+// what is written in the cache, the streams are only referenced
+struct GeometryCacheContent {
+	uint64_t sourceHash{0}, sourceSize{0};
+	uint32_t vertexStride{0}, materialStride{0};
+	uint32_t rootCount{0};
+	std::vector<GeometryCacheNode> nodes;
+	std::vector<GeometryCachePrim> prims;
+	std::vector<GeometryCacheImage> images;
+	std::vector<GeometryCacheDependency> dependencies;
+	std::string strings;
+	const void *materials{nullptr};
+	uint32_t materialCount{0};
+	const void *vertices{nullptr};
+	uint64_t verticesSize{0};
+	const void *indices{nullptr};
+	uint64_t indicesSize{0};
+	const void *meshlets{nullptr};
+	uint64_t meshletsSize{0};
+	const void *meshletVertices{nullptr};
+	uint64_t meshletVerticesSize{0};
+	const void *meshletTriangles{nullptr};
+	uint64_t meshletTrianglesSize{0};
+
+	GeometryCacheString addString(const std::string &s);
+};
+
+bool writeGeometryCache(const std::string &cachePath, const GeometryCacheContent &content);
+
+// read only view on a mapped cache file
+class GeometryCache {
+public:
+	// false if the file is missing, truncated or built from another source/version
+	bool open(const std::string &cachePath, uint64_t sourceHash, uint64_t sourceSize, uint32_t vertexStride, uint32_t materialStride);
+
+	const GeometryCacheHeader &header() const { return *headerPtr; }
+	const GeometryCacheNode *nodes() const { return section<GeometryCacheNode>(headerPtr->nodesOffset); }
+	const GeometryCachePrim *prims() const { return section<GeometryCachePrim>(headerPtr->primsOffset); }
+	const void *materials() const { return section<unsigned char>(headerPtr->materialsOffset); }
+	const GeometryCacheImage *images() const { return section<GeometryCacheImage>(headerPtr->imagesOffset); }
+	const GeometryCacheDependency *dependencies() const { return section<GeometryCacheDependency>(headerPtr->dependenciesOffset); }
+	const void *vertices() const { return section<unsigned char>(headerPtr->verticesOffset); }
+	const void *indices() const { return section<unsigned char>(headerPtr->indicesOffset); }
+	const void *meshlets() const { return section<unsigned char>(headerPtr->meshletsOffset); }
+	const void *meshletVertices() const { return section<unsigned char>(headerPtr->meshletVerticesOffset); }
+	const void *meshletTriangles() const { return section<unsigned char>(headerPtr->meshletTrianglesOffset); }
+	std::string_view string(const GeometryCacheString &s) const;
+
+private:
+	template <typename T>
+	const T *section(uint64_t offset) const { return reinterpret_cast<const T *>(base + offset); }
+
+	std::shared_ptr<AssetFile> file;
+	const unsigned char *base{nullptr};
+	const GeometryCacheHeader *headerPtr{nullptr};
+};
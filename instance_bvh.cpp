@@ -0,0 +1,182 @@
+#include "instance_bvh.h"
+
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <utility>
+
+#include "loaderGltf.h"
+
+bool USE_INSTANCE_BVH = true;
+
+void transformBounds(const glm::vec3 &minBound, const glm::vec3 &maxBound, const glm::mat4 &world, glm::vec3 &worldMin, glm::vec3 &worldMax) {
+	const glm::vec3 center = glm::vec3(world * glm::vec4((minBound + maxBound) * 0.5f, 1.f));
+	const glm::vec3 halfSize = (maxBound - minBound) * 0.5f;
+	const glm::vec3 extent = glm::abs(glm::vec3(world[0])) * halfSize.x + glm::abs(glm::vec3(world[1])) * halfSize.y + glm::abs(glm::vec3(world[2])) * halfSize.z;
+	worldMin = center - extent;
+	worldMax = center + extent;
+}
+
+static void setLane(BvhNode &node, uint32_t lane, uint32_t child, const glm::vec3 &minBound, const glm::vec3 &maxBound) {
+	node.child[lane] = child;
+	node.minX[lane] = minBound.x;
+	node.minY[lane] = minBound.y;
+	node.minZ[lane] = minBound.z;
+	node.maxX[lane] = maxBound.x;
+	node.maxY[lane] = maxBound.y;
+	node.maxZ[lane] = maxBound.z;
+}
+
+// union of the lanes in use
+static void nodeBounds(const BvhNode &node, glm::vec3 &minBound, glm::vec3 &maxBound) {
+	minBound = glm::vec3(std::numeric_limits<float>::max());
+	maxBound = glm::vec3(-std::numeric_limits<float>::max());
+	for (uint32_t lane = 0; lane < 4; ++lane) {
+		if (node.child[lane] == BVH_EMPTY)
+			continue;
+		minBound = glm::min(minBound, glm::vec3(node.minX[lane], node.minY[lane], node.minZ[lane]));
+		maxBound = glm::max(maxBound, glm::vec3(node.maxX[lane], node.maxY[lane], node.maxZ[lane]));
+	}
+}
+
+// order[begin, end) split in up to 4 ranges, a lane each, the ranges of more than one instance get a child node
+static uint32_t buildNode(InstanceBvh &bvh, std::vector<uint32_t> &order, uint32_t begin, uint32_t end) {
+	const uint32_t nodeIndex = static_cast<uint32_t>(bvh.nodes.size());
+	bvh.nodes.emplace_back();
+
+	auto center = [&](uint32_t instance) { return (bvh.instances[instance].minBound + bvh.instances[instance].maxBound) * 0.5f; };
+	std::array<std::pair<uint32_t, uint32_t>, 4> ranges{};
+	ranges[0] = {begin, end};
+	uint32_t rangeCount = 1;
+	while (rangeCount < 4) {
+		// the biggest range is split at the median of its longest axis
+		uint32_t split = 0;
+		for (uint32_t r = 1; r < rangeCount; ++r)
+			if (ranges[r].second - ranges[r].first > ranges[split].second - ranges[split].first)
+				split = r;
+		const auto [first, last] = ranges[split];
+		if (last - first < 2)
+			break;
+
+		glm::vec3 minCenter = center(order[first]), maxCenter = minCenter;
+		for (uint32_t i = first + 1; i < last; ++i) {
+			minCenter = glm::min(minCenter, center(order[i]));
+			maxCenter = glm::max(maxCenter, center(order[i]));
+		}
+		const glm::vec3 size = maxCenter - minCenter;
+		const int axis = size.x >= size.y && size.x >= size.z ? 0 : (size.y >= size.z ? 1 : 2);
+		const uint32_t middle = first + (last - first) / 2;
+		std::nth_element(order.begin() + first, order.begin() + middle, order.begin() + last,
+		                 [&](uint32_t a, uint32_t b) { return center(a)[axis] < center(b)[axis]; });
+		ranges[split] = {first, middle};
+		ranges[rangeCount++] = {middle, last};
+	}
+
+	for (uint32_t lane = 0; lane < 4; ++lane) {
+		glm::vec3 minBound(0.f), maxBound(0.f);
+		if (lane >= rangeCount) {
+			setLane(bvh.nodes[nodeIndex], lane, BVH_EMPTY, minBound, maxBound);
+			continue;
+		}
+		const auto [first, last] = ranges[lane];
+		if (last - first == 1) {
+			const BvhInstance &instance = bvh.instances[order[first]];
+			setLane(bvh.nodes[nodeIndex], lane, order[first] | BVH_LEAF, instance.minBound, instance.maxBound);
+			continue;
+		}
+		// the recursion grows the nodes, no reference is kept across it
+		const uint32_t child = buildNode(bvh, order, first, last);
+		nodeBounds(bvh.nodes[child], minBound, maxBound);
+		setLane(bvh.nodes[nodeIndex], lane, child, minBound, maxBound);
+	}
+	return nodeIndex;
+}
+
+void buildInstanceBvh(InstanceBvh &bvh, std::vector<BvhInstance> instances) {
+	bvh.nodes.clear();
+	bvh.instances = std::move(instances);
+	for (uint32_t i = 0; i < bvh.instances.size(); ++i)
+		bvh.instances[i].obj->idInstanceBvh = i;
+	if (bvh.instances.empty())
+		return;
+
+	std::vector<uint32_t> order(bvh.instances.size());
+	for (uint32_t i = 0; i < order.size(); ++i)
+		order[i] = i;
+	bvh.nodes.reserve(bvh.instances.size() / 2 + 1);
+	buildNode(bvh, order, 0, static_cast<uint32_t>(order.size()));
+}
+
+void refitInstanceBvh(InstanceBvh &bvh) {
+	// the children are after their parent
+	for (size_t n = bvh.nodes.size(); n-- > 0;) {
+		BvhNode &node = bvh.nodes[n];
+		for (uint32_t lane = 0; lane < 4; ++lane) {
+			const uint32_t child = node.child[lane];
+			if (child == BVH_EMPTY)
+				continue;
+			if (child & BVH_LEAF) {
+				const BvhInstance &instance = bvh.instances[child & ~BVH_LEAF];
+				setLane(node, lane, child, instance.minBound, instance.maxBound);
+			} else {
+				glm::vec3 minBound, maxBound;
+				nodeBounds(bvh.nodes[child], minBound, maxBound);
+				setLane(node, lane, child, minBound, maxBound);
+			}
+		}
+	}
+}
+
+// every instance of the subtree, no test
+static void appendSubtree(const InstanceBvh &bvh, uint32_t child, std::vector<uint32_t> &visible) {
+	if (child & BVH_LEAF) {
+		visible.push_back(child & ~BVH_LEAF);
+		return;
+	}
+	for (uint32_t lane = 0; lane < 4; ++lane)
+		if (bvh.nodes[child].child[lane] != BVH_EMPTY)
+			appendSubtree(bvh, bvh.nodes[child].child[lane], visible);
+}
+
+void cullInstanceBvh(const InstanceBvh &bvh, const glm::mat4 &viewProj, std::vector<uint32_t> &visible) {
+	if (bvh.nodes.empty())
+		return;
+
+	// planes of the clip volume (-w <= x, y <= w, 0 <= z <= w), the inside is positive
+	const glm::mat4 rows = glm::transpose(viewProj);
+	const std::array<glm::vec4, 6> planes = {rows[3] + rows[0], rows[3] - rows[0], rows[3] + rows[1], rows[3] - rows[1], rows[2], rows[3] - rows[2]};
+
+	std::vector<uint32_t> stack;
+	stack.push_back(0);
+	while (!stack.empty()) {
+		const BvhNode &node = bvh.nodes[stack.back()];
+		stack.pop_back();
+
+		// per lane, the box is out when its corner the farthest along the plane normal is out, in when the nearest one is in
+		bool outside[4] = {false, false, false, false};
+		bool inside[4] = {true, true, true, true};
+		for (const auto &plane : planes) {
+			const bool px = plane.x > 0.f, py = plane.y > 0.f, pz = plane.z > 0.f;
+			for (uint32_t lane = 0; lane < 4; ++lane) {
+				const float farthest = plane.x * (px ? node.maxX[lane] : node.minX[lane]) + plane.y * (py ? node.maxY[lane] : node.minY[lane]) +
+				                       plane.z * (pz ? node.maxZ[lane] : node.minZ[lane]) + plane.w;
+				const float nearest = plane.x * (px ? node.minX[lane] : node.maxX[lane]) + plane.y * (py ? node.minY[lane] : node.maxY[lane]) +
+				                      plane.z * (pz ? node.minZ[lane] : node.maxZ[lane]) + plane.w;
+				outside[lane] = outside[lane] || farthest < 0.f;
+				inside[lane] = inside[lane] && nearest >= 0.f;
+			}
+		}
+
+		for (uint32_t lane = 0; lane < 4; ++lane) {
+			const uint32_t child = node.child[lane];
+			if (child == BVH_EMPTY || outside[lane])
+				continue;
+			if (child & BVH_LEAF)
+				visible.push_back(child & ~BVH_LEAF);
+			else if (inside[lane])
+				appendSubtree(bvh, child, visible);
+			else
+				stack.push_back(child);
+		}
+	}
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "vertex_config.h"
+
+struct objectGLTF;
+
+// Bounding volume hierarchy over the drawable objects of the scene, the raster draw list is gathered from the instances in the frustum
+// 4 children per node with their bounds stored by axis, a frustum plane is tested against the 4 boxes in one loop the compiler can vectorize
+
+// gather the draw list from the BVH instead of walking the whole scene graph
+extern bool USE_INSTANCE_BVH;
+
+struct BvhInstance {
+	objectGLTF *obj;
+	glm::mat4 world;
+	// world space box of the prim of obj
+	glm::vec3 minBound, maxBound;
+	// last frame the instance was in the frustum, kept by the caller
+	uint64_t visibleFrame{UINT64_MAX};
+};
+
+// BvhNode::child of an unused lane, the leaves have the instance index with BVH_LEAF
+constexpr uint32_t BVH_EMPTY = UINT32_MAX;
+constexpr uint32_t BVH_LEAF = 0x80000000;
+
+struct BvhNode {
+	float minX[4], minY[4], minZ[4];
+	float maxX[4], maxY[4], maxZ[4];
+	uint32_t child[4];
+};
+
+struct InstanceBvh {
+	// the root first, the children after their parent
+	std::vector<BvhNode> nodes;
+	std::vector<BvhInstance> instances;
+};
+
+// box of a prim moved by world, from the extents of the transformed axes
+void transformBounds(const glm::vec3 &minBound, const glm::vec3 &maxBound, const glm::mat4 &world, glm::vec3 &worldMin, glm::vec3 &worldMax);
+
+// median splits on the largest axis of the centers, objectGLTF::idInstanceBvh is the index of its instance
+void buildInstanceBvh(InstanceBvh &bvh, std::vector<BvhInstance> instances);
+// the bounds of the nodes after some instances moved, same tree
+void refitInstanceBvh(InstanceBvh &bvh);
+// indices of the instances whose box is not fully outside one of the planes of viewProj, the subtrees inside the frustum are not tested
+void cullInstanceBvh(const InstanceBvh &bvh, const glm::mat4 &viewProj, std::vector<uint32_t> &visible);
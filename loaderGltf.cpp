@@ -12,16 +12,28 @@
 #define TINYGLTF_NO_INCLUDE_JSON
 #define TINYGLTF_USE_CPP14
 #define TINYGLTF_ENABLE_DRACO
+#include <algorithm>
+#include <chrono>
+#include <limits>
 #include <set>
+#include <type_traits>
+#include <unordered_map>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define DECODE_SSE2
+#endif
 #include <tiny_gltf.h>
 using namespace tinygltf;
 
-#include <cmrc/cmrc.hpp>
-CMRC_DECLARE(gltf_rc);
-auto cmrcFS = cmrc::gltf_rc::get_filesystem();
+#include "asset_file.h"
+#include "geometry_cache.h"
+
+bool KEEP_CPU_GEOMETRY = false;
+bool USE_GEOMETRY_CACHE = true;
 
 #include "camera.h"
 #include "computeMikkTSpace.h"
+#include "mesh_optimizer.h"
 #include "rasterizer.h"
 
 #include <spdlog/spdlog.h>
@@ -38,111 +50,318 @@ namespace fs = std::filesystem;
 
 // callback for filesystem for gltf, using inside block
 bool FileExistsVulkanite(const std::string &abs_filename, void *) {
-	return cmrcFS.exists(abs_filename);
+	return AssetFile::exists(abs_filename);
 }
 
+// tinygltf wants the external buffers/images in a vector, copy them straight from the mapped file
 bool ReadWholeFileVulkanite(std::vector<unsigned char> *out, std::string *err, const std::string &filepath, void *) {
-	auto fileRC = cmrcFS.open(filepath);
-	out->insert(out->begin(), fileRC.begin(), fileRC.end());
+	try {
+		AssetFile file(filepath);
+		out->assign(file.data(), file.data() + file.size());
+	} catch (const std::exception &e) {
+		if (err)
+			*err += e.what();
+		return false;
+	}
 	return true;
 }
 
+// images handed by tinygltf (or the geometry cache), the bytes are copied because tinygltf may free them after the callback
+// they are decoded on all the cores then created on the GPU in one go by createPendingImages
+struct PendingImage {
+	int imageIdx{0};
+	std::string name;
+	bool isKtx2{false};
+	std::vector<unsigned char> bytes;
+	// decoded pixels in format, owned by pixelsOwner (stb, ktx texture or transcoded buffer)
+	std::shared_ptr<void> pixelsOwner;
+	void *pixels{nullptr};
+	int width{0}, height{0};
+	VkDeviceSize size{0};
+	VkFormat format{VK_FORMAT_R8G8B8A8_UNORM};
+	// the mip levels of the block compressed images, ranges of pixels, empty when the mips are generated by blits
+	std::vector<TextureLevel> levels;
+};
+static std::vector<PendingImage> pendingImages;
+
+// the GPU format the Basis/UASTC/ETC1S images are transcoded to, the same in ktx and basisu terms
+struct TranscodeTarget {
+	const char *name;
+	VkFormat format;
+	ktx_transcode_fmt_e ktxFormat;
+	basist::transcoder_texture_format basisFormat;
+};
+// picked by createPendingImages before the decode, [0] for the opaque images, [1] with alpha
+static TranscodeTarget transcodeTargets[2];
+
+// the first block format sampled by the device, in order of quality, RGBA32 when there is none
+static TranscodeTarget pickTranscodeTarget(bool hasAlpha) {
+	static const TranscodeTarget alphaTargets[] = {
+	    {"BC7", VK_FORMAT_BC7_UNORM_BLOCK, KTX_TTF_BC7_RGBA, basist::transcoder_texture_format::cTFBC7_RGBA},
+	    {"ASTC 4x4", VK_FORMAT_ASTC_4x4_UNORM_BLOCK, KTX_TTF_ASTC_4x4_RGBA, basist::transcoder_texture_format::cTFASTC_4x4_RGBA},
+	    {"ETC2", VK_FORMAT_ETC2_R8G8B8A8_UNORM_BLOCK, KTX_TTF_ETC2_RGBA, basist::transcoder_texture_format::cTFETC2_RGBA},
+	    {"BC3", VK_FORMAT_BC3_UNORM_BLOCK, KTX_TTF_BC3_RGBA, basist::transcoder_texture_format::cTFBC3_RGBA},
+	};
+	static const TranscodeTarget opaqueTargets[] = {
+	    {"BC7", VK_FORMAT_BC7_UNORM_BLOCK, KTX_TTF_BC7_RGBA, basist::transcoder_texture_format::cTFBC7_RGBA},
+	    {"ASTC 4x4", VK_FORMAT_ASTC_4x4_UNORM_BLOCK, KTX_TTF_ASTC_4x4_RGBA, basist::transcoder_texture_format::cTFASTC_4x4_RGBA},
+	    {"ETC1", VK_FORMAT_ETC2_R8G8B8_UNORM_BLOCK, KTX_TTF_ETC1_RGB, basist::transcoder_texture_format::cTFETC1_RGB},
+	    {"BC1", VK_FORMAT_BC1_RGB_UNORM_BLOCK, KTX_TTF_BC1_RGB, basist::transcoder_texture_format::cTFBC1_RGB},
+	};
+
+	if (hasAlpha) {
+		for (const auto &target : alphaTargets)
+			if (isTextureFormatSupported(target.format))
+				return target;
+	} else {
+		for (const auto &target : opaqueTargets)
+			if (isTextureFormatSupported(target.format))
+				return target;
+	}
+	return {"RGBA8", VK_FORMAT_R8G8B8A8_UNORM, KTX_TTF_RGBA32, basist::transcoder_texture_format::cTFRGBA32};
+}
+
 bool LoadImageDataEx(Image *image, const int image_idx, std::string *err, std::string *warn, int req_width, int req_height, const unsigned char *bytes, int size, void *user_data) {
 	std::string imageName = image->uri;
 
 	if (image->uri.empty())
 		imageName = image->name.empty() ? fmt::format("{}", image_idx) : image->name;
 
-	const std::shared_ptr<textureGLTF> tex(new textureGLTF);
-	tex->name = imageName;
-	tex->textureImage = nullptr;
+	PendingImage pendingImage;
+	pendingImage.imageIdx = image_idx;
+	pendingImage.name = imageName;
+	pendingImage.isKtx2 = image->mimeType == "image/ktx2" || fs::path(imageName).extension() == ".ktx2";
+	pendingImage.bytes.assign(bytes, bytes + size);
+	pendingImages.push_back(std::move(pendingImage));
+	return true;
+}
 
-	if (image->mimeType == "image/ktx2" || fs::path(imageName).extension() == ".ktx2") {
+// the shaders linearize the colors themselves, the srgb formats are sampled as their unorm twin
+static VkFormat unormFormat(VkFormat format) {
+	switch (format) {
+		case VK_FORMAT_R8_SRGB:
+			return VK_FORMAT_R8_UNORM;
+		case VK_FORMAT_R8G8_SRGB:
+			return VK_FORMAT_R8G8_UNORM;
+		case VK_FORMAT_R8G8B8_SRGB:
+			return VK_FORMAT_R8G8B8_UNORM;
+		case VK_FORMAT_B8G8R8_SRGB:
+			return VK_FORMAT_B8G8R8_UNORM;
+		case VK_FORMAT_R8G8B8A8_SRGB:
+			return VK_FORMAT_R8G8B8A8_UNORM;
+		case VK_FORMAT_B8G8R8A8_SRGB:
+			return VK_FORMAT_B8G8R8A8_UNORM;
+		case VK_FORMAT_A8B8G8R8_SRGB_PACK32:
+			return VK_FORMAT_A8B8G8R8_UNORM_PACK32;
+		case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+			return VK_FORMAT_BC1_RGB_UNORM_BLOCK;
+		case VK_FORMAT_BC1_RGBA_SRGB_BLOCK:
+			return VK_FORMAT_BC1_RGBA_UNORM_BLOCK;
+		case VK_FORMAT_BC2_SRGB_BLOCK:
+			return VK_FORMAT_BC2_UNORM_BLOCK;
+		case VK_FORMAT_BC3_SRGB_BLOCK:
+			return VK_FORMAT_BC3_UNORM_BLOCK;
+		case VK_FORMAT_BC7_SRGB_BLOCK:
+			return VK_FORMAT_BC7_UNORM_BLOCK;
+		case VK_FORMAT_ETC2_R8G8B8_SRGB_BLOCK:
+			return VK_FORMAT_ETC2_R8G8B8_UNORM_BLOCK;
+		case VK_FORMAT_ETC2_R8G8B8A1_SRGB_BLOCK:
+			return VK_FORMAT_ETC2_R8G8B8A1_UNORM_BLOCK;
+		case VK_FORMAT_ETC2_R8G8B8A8_SRGB_BLOCK:
+			return VK_FORMAT_ETC2_R8G8B8A8_UNORM_BLOCK;
+		case VK_FORMAT_ASTC_4x4_SRGB_BLOCK:
+			return VK_FORMAT_ASTC_4x4_UNORM_BLOCK;
+		case VK_FORMAT_ASTC_5x4_SRGB_BLOCK:
+			return VK_FORMAT_ASTC_5x4_UNORM_BLOCK;
+		case VK_FORMAT_ASTC_5x5_SRGB_BLOCK:
+			return VK_FORMAT_ASTC_5x5_UNORM_BLOCK;
+		case VK_FORMAT_ASTC_6x5_SRGB_BLOCK:
+			return VK_FORMAT_ASTC_6x5_UNORM_BLOCK;
+		case VK_FORMAT_ASTC_6x6_SRGB_BLOCK:
+			return VK_FORMAT_ASTC_6x6_UNORM_BLOCK;
+		case VK_FORMAT_ASTC_8x5_SRGB_BLOCK:
+			return VK_FORMAT_ASTC_8x5_UNORM_BLOCK;
+		case VK_FORMAT_ASTC_8x6_SRGB_BLOCK:
+			return VK_FORMAT_ASTC_8x6_UNORM_BLOCK;
+		case VK_FORMAT_ASTC_8x8_SRGB_BLOCK:
+			return VK_FORMAT_ASTC_8x8_UNORM_BLOCK;
+		case VK_FORMAT_ASTC_10x5_SRGB_BLOCK:
+			return VK_FORMAT_ASTC_10x5_UNORM_BLOCK;
+		case VK_FORMAT_ASTC_10x6_SRGB_BLOCK:
+			return VK_FORMAT_ASTC_10x6_UNORM_BLOCK;
+		case VK_FORMAT_ASTC_10x8_SRGB_BLOCK:
+			return VK_FORMAT_ASTC_10x8_UNORM_BLOCK;
+		case VK_FORMAT_ASTC_10x10_SRGB_BLOCK:
+			return VK_FORMAT_ASTC_10x10_UNORM_BLOCK;
+		case VK_FORMAT_ASTC_12x10_SRGB_BLOCK:
+			return VK_FORMAT_ASTC_12x10_UNORM_BLOCK;
+		case VK_FORMAT_ASTC_12x12_SRGB_BLOCK:
+			return VK_FORMAT_ASTC_12x12_UNORM_BLOCK;
+		default:
+			return format;
+	}
+}
+
+// worker thread side, no Vulkan call
+static void decodeImage(PendingImage &image) {
+	const unsigned char *bytes = image.bytes.data();
+	const int size = static_cast<int>(image.bytes.size());
+
+	if (image.isKtx2) {
 		// test load ktx from khronos ktx
 		ktxTexture *texture = nullptr;
 		if (ktxTexture_CreateFromMemory(bytes, size, KTX_TEXTURE_CREATE_LOAD_IMAGE_DATA_BIT, &texture) == KTX_SUCCESS) {
-			// Retrieve information about the texture from fields in the ktxTexture
-			// such as:
-			ktx_uint32_t numLevels = texture->numLevels;
-			ktx_uint32_t baseWidth = texture->baseWidth;
-			ktx_bool_t isArray = texture->isArray;
-
-			// Retrieve a pointer to the image for a specific mip level, array layer
-			// & face or depth slice.
-			ktx_uint32_t level = 0;
-			ktx_uint32_t layer = 0;
-			ktx_uint32_t faceSlice = 0;
-			ktx_size_t offset;
-
-			if (ktxTexture_GetImageOffset(texture, level, layer, faceSlice, &offset) == KTX_SUCCESS) {
-				auto imageSize = ktxTexture_GetImageSize(texture, level);
-				auto yo1 = ktxTexture_GetVkFormat(texture);
-				ktx_uint8_t *imageKTX = ktxTexture_GetData(texture) + offset;
-
-				createTextureImage(imageKTX, texture->baseWidth, texture->baseHeight, imageSize, tex->textureImage, tex->textureImageMemory, tex->mipLevels,
-				                   VK_FORMAT_R8G8B8A8_UNORM);
+			std::shared_ptr<void> owner(texture, [](void *t) { ktxTexture_Destroy(static_cast<ktxTexture *>(t)); });
+
+			// supercompressed content is transcoded to the block format of the device
+			VkFormat format;
+			if (texture->classId == ktxTexture2_c && ktxTexture2_NeedsTranscoding(reinterpret_cast<ktxTexture2 *>(texture))) {
+				ktxTexture2 *texture2 = reinterpret_cast<ktxTexture2 *>(texture);
+				const TranscodeTarget &target = transcodeTargets[ktxTexture2_GetNumComponents(texture2) == 4 ? 1 : 0];
+				if (ktxTexture2_TranscodeBasis(texture2, target.ktxFormat, 0) != KTX_SUCCESS)
+					throw std::runtime_error(fmt::format("failed to transcode texture image {}!", image.name));
+				format = target.format;
+			} else {
+				// the other textures are uploaded in their stored format, as unorm like the png and transcoded ones
+				format = unormFormat(ktxTexture_GetVkFormat(texture));
+				if (format == VK_FORMAT_UNDEFINED)
+					format = VK_FORMAT_R8G8B8A8_UNORM;
+				if (format != VK_FORMAT_R8G8B8A8_UNORM && !isTextureFormatSupported(format)) {
+					spdlog::warn(fmt::format("texture image {} format {} is not supported", image.name, static_cast<int>(format)));
+					return;
+				}
+			}
+
+			// the stored mip chain is uploaded as it is, the smallest levels come first in the ktx2 data
+			for (ktx_uint32_t level = 0; level < texture->numLevels; ++level) {
+				ktx_size_t offset;
+				if (ktxTexture_GetImageOffset(texture, level, 0, 0, &offset) != KTX_SUCCESS)
+					throw std::runtime_error(fmt::format("failed to read level {} of texture image {}!", level, image.name));
+				image.levels.push_back({offset, ktxTexture_GetImageSize(texture, level)});
+			}
+			image.pixelsOwner = owner;
+			image.pixels = ktxTexture_GetData(texture);
+			image.size = ktxTexture_GetDataSize(texture);
+			image.width = static_cast<int>(texture->baseWidth);
+			image.height = static_cast<int>(texture->baseHeight);
+			image.format = format;
+			if (format == VK_FORMAT_R8G8B8A8_UNORM && image.levels.size() == 1) {
+				// without stored mips rgba8 gets the blit ones
+				image.pixels = ktxTexture_GetData(texture) + image.levels[0].offset;
+				image.size = image.levels[0].size;
+				image.levels.clear();
 			}
-			ktxTexture_Destroy(texture);
 		} else {
 			// if not working, try from basisu
-			basist::basisu_transcoder_init();
 			basist::etc1_global_selector_codebook sel_codebook(basist::g_global_selector_cb_size, basist::g_global_selector_cb);
 			basist::basisu_transcoder transcoder(&sel_codebook);
 
-			//transcoder.start_transcoding(bytes, size);
-			//auto total_image = transcoder.get_total_images(bytes, size);
-			//basist::basisu_image_info image_info;
-			//uint32_t image_index = 0;
-			//transcoder.get_image_info(bytes, size, image_info, image_index);
-			//uint32_t level_index = 0;
-			//basist::basisu_image_level_info level_info;
-			//transcoder.get_image_level_info(bytes, size, level_info, image_index, level_index);
-			//transcoder.transcode_image_level();
-
-
 			if (transcoder.validate_header(bytes, size)) {
-				//spdlog::debug(fmt::format("Requested {} bytes for {}x{} image", size, cx, cx));
 				basist::basisu_image_info info;
-				if (transcoder.get_image_info(bytes, size, info, 0)) {
-					uint32_t level = 0;
-					uint32_t descW = 0, descH = 0, blocks;
-					for (uint32_t n = 0; n < info.m_total_levels; n++) {
-						if (transcoder.get_image_level_desc(bytes, size, 0, n, descW, descH, blocks)) {
-							spdlog::debug(fmt::format("mipmap level w: {}, h: {} (blocks: {})", descW, descH, blocks));
-							//	if (cx >= std::max(descW, descH)) {
-							level = n;
-							break;
-							//}
+				if (transcoder.get_image_info(bytes, size, info, 0) && transcoder.start_transcoding(bytes, size)) {
+					const TranscodeTarget &target = transcodeTargets[info.m_alpha_flag ? 1 : 0];
+					const bool uncompressed = basist::basis_transcoder_format_is_uncompressed(target.basisFormat);
+					const uint32_t bytesPerBlock = basist::basis_get_bytes_per_block_or_pixel(target.basisFormat);
+					const uint32_t levelCount = info.m_total_levels;
+
+					// the levels are transcoded one after the other in the same buffer
+					std::vector<uint32_t> levelUnits(levelCount);
+					VkDeviceSize totalSize = 0;
+					for (uint32_t n = 0; n < levelCount; n++) {
+						uint32_t descW = 0, descH = 0, blocks = 0;
+						if (!transcoder.get_image_level_desc(bytes, size, 0, n, descW, descH, blocks))
+							throw std::runtime_error(fmt::format("failed to read level {} of texture image {}!", n, image.name));
+						spdlog::debug(fmt::format("mipmap level w: {}, h: {} (blocks: {})", descW, descH, blocks));
+						if (n == 0) {
+							image.width = static_cast<int>(descW);
+							image.height = static_cast<int>(descH);
 						}
+						// Note: the API expects total pixels here instead of blocks for cTFRGBA32
+						levelUnits[n] = uncompressed ? descW * descH : blocks;
+						image.levels.push_back({totalSize, static_cast<VkDeviceSize>(levelUnits[n]) * bytesPerBlock});
+						totalSize += image.levels.back().size;
 					}
-					basist::basisu_file_info fileInfo;
-					transcoder.get_file_info(bytes, size, fileInfo);
-					if (transcoder.start_transcoding(bytes, size)) {
-						uint32_t sizeUncompressed = basist::basis_get_uncompressed_bytes_per_pixel(basist::transcoder_texture_format::cTFRGBA32) * descW * descH;
-						spdlog::debug(fmt::format("Started transcode ({}x{} @ {} bytes)", descW, descH, sizeUncompressed));
-						if (void *rgbBuf = malloc(sizeUncompressed)) {
-							// Note: the API expects total pixels here instead of blocks for cTFRGBA32
-							if (transcoder.transcode_image_level(bytes, size, 0, level, rgbBuf, descW * descH, basist::transcoder_texture_format::cTFRGBA32)) {
-								spdlog::debug("Decoded!!!!");
-								//		*phbmp = rgbToBitmap(static_cast<uint32_t*>(rgbBuf), descW, descH, fileInfo.m_y_flipped);
-							}
-							delete rgbBuf;
-						}
+
+					spdlog::debug(fmt::format("Started transcode ({}x{} @ {} bytes)", image.width, image.height, totalSize));
+					std::shared_ptr<void> transcoded(malloc(totalSize), free);
+					if (!transcoded)
+						throw std::runtime_error(fmt::format("failed to allocate texture image {}!", image.name));
+					for (uint32_t n = 0; n < levelCount; n++) {
+						unsigned char *dst = static_cast<unsigned char *>(transcoded.get()) + image.levels[n].offset;
+						if (!transcoder.transcode_image_level(bytes, size, 0, n, dst, levelUnits[n], target.basisFormat))
+							throw std::runtime_error(fmt::format("failed to transcode level {} of texture image {}!", n, image.name));
 					}
+
+					image.pixelsOwner = transcoded;
+					image.pixels = transcoded.get();
+					image.size = totalSize;
+					image.format = target.format;
+					// without stored mips rgba8 gets the blit ones
+					if (uncompressed && levelCount == 1)
+						image.levels.clear();
 				}
 			}
 		}
-	} else
-		createTextureImage(bytes, size, tex->textureImage, tex->textureImageMemory, tex->mipLevels);
+	} else {
+		int texWidth, texHeight, texChannels;
+		stbi_uc *pixels = stbi_load_from_memory(bytes, size, &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
+		if (!pixels)
+			throw std::runtime_error(fmt::format("failed to load texture image {}!", image.name));
+		image.pixelsOwner = std::shared_ptr<void>(pixels, stbi_image_free);
+		image.pixels = pixels;
+		image.size = static_cast<VkDeviceSize>(texWidth) * texHeight * 4;
+		image.width = texWidth;
+		image.height = texHeight;
+	}
+
+	// the encoded bytes are not needed anymore
+	std::vector<unsigned char>().swap(image.bytes);
+}
 
-	if (tex->textureImage != nullptr) {
-		tex->textureImageView = createTextureImageView(tex->textureImage, tex->mipLevels, VK_FORMAT_R8G8B8A8_UNORM);
+// decode the images queued by LoadImageDataEx in parallel, then create and upload them on this thread
+// srgbImages are the color images (base color, emissive), their generated mips are averaged in linear
+static void createPendingImages(const std::set<int> &srgbImages) {
+	if (pendingImages.empty())
+		return;
+
+	const auto startTime = std::chrono::high_resolution_clock::now();
+	// the transcoder tables are global, they are initialized before the workers use them
+	basist::basisu_transcoder_init();
+	transcodeTargets[0] = pickTranscodeTarget(false);
+	transcodeTargets[1] = pickTranscodeTarget(true);
+	spdlog::info(fmt::format("Textures: Basis images transcoded to {} (opaque), {} (alpha)", transcodeTargets[0].name, transcodeTargets[1].name));
+	parallelFor(static_cast<uint32_t>(pendingImages.size()), [&](uint32_t i) { decodeImage(pendingImages[i]); });
+	const auto decodeTime = std::chrono::high_resolution_clock::now();
+
+	beginTextureUploads();
+	for (auto &image : pendingImages) {
+		if (!image.pixels)
+			continue;
+
+		const std::shared_ptr<textureGLTF> tex(new textureGLTF);
+		tex->name = image.name;
+		if (image.levels.empty())
+			createTextureImage(image.pixels, image.width, image.height, image.size, tex->textureImage, tex->textureImageMemory, tex->mipLevels, image.format,
+			                   srgbImages.contains(image.imageIdx));
+		else {
+			// block compressed levels are uploaded as stored, the GPU can't generate the missing ones
+			if (image.levels.size() == 1 && std::max(image.width, image.height) > 1)
+				spdlog::warn(fmt::format("texture image {} ({}x{}) has only the level 0, no mips", image.name, image.width, image.height));
+			createTextureImage(image.pixels, image.levels, image.width, image.height, tex->textureImage, tex->textureImageMemory, tex->mipLevels, image.format);
+		}
+		tex->textureImageView = createTextureImageView(tex->textureImage, tex->mipLevels, image.format);
 		createTextureSampler(tex->textureSampler, tex->mipLevels);
 
-		sceneGLTF.textureCache[image_idx + 1] = tex;
+		sceneGLTF.textureCache[image.imageIdx + 1] = tex;
+		image.pixelsOwner.reset();
 	}
+	endTextureUploads();
 
-	return true;
+	const auto uploadTime = std::chrono::high_resolution_clock::now();
+	spdlog::info(fmt::format("Textures: {} images decoded in {:.1f} ms, uploaded in {:.1f} ms", pendingImages.size(),
+	                         std::chrono::duration<float, std::chrono::milliseconds::period>(decodeTime - startTime).count(),
+	                         std::chrono::duration<float, std::chrono::milliseconds::period>(uploadTime - decodeTime).count()));
+	pendingImages.clear();
 }
 
 std::map<std::string, int> geoPathOcurrence;
@@ -498,18 +717,33 @@ struct m44fArray {
 //	}
 //}
 
-//
-static int ImportTexture(const Model &model, const int &textureIndex) {
+// image of a texture, or its KHR_texture_basisu one
+static int TextureSourceIndex(const Model &model, const int &textureIndex) {
 	if (textureIndex < 0)
 		return -1;
 
 	const auto &texture = model.textures[textureIndex];
-	auto textureSourceIndex = texture.source;
-	if (textureSourceIndex < 0) {
-		if (texture.extensions.find("KHR_texture_basisu") == texture.extensions.end())
-			return -1;
-		textureSourceIndex = texture.extensions.at("KHR_texture_basisu").GetNumberAsInt();
+	if (texture.source >= 0)
+		return texture.source;
+	if (texture.extensions.find("KHR_texture_basisu") == texture.extensions.end())
+		return -1;
+	return texture.extensions.at("KHR_texture_basisu").GetNumberAsInt();
+}
+
+static std::set<int> SrgbImages(const Model &model) {
+	std::set<int> images;
+	for (const auto &material : model.materials) {
+		images.insert(TextureSourceIndex(model, material.pbrMetallicRoughness.baseColorTexture.index));
+		images.insert(TextureSourceIndex(model, material.emissiveTexture.index));
 	}
+	return images;
+}
+
+//
+static int ImportTexture(const Model &model, const int &textureIndex) {
+	const auto textureSourceIndex = TextureSourceIndex(model, textureIndex);
+	if (textureSourceIndex < 0)
+		return -1;
 	const auto &image = model.images[textureSourceIndex];
 
 	std::string imageName = image.uri;
@@ -634,14 +868,172 @@ static matGLTF ImportMaterial(const Model &model, const Material &gltf_mat) {
 #define __PolIndex (pol_index[p] + v)
 #define __PolRemapIndex (pol_index[p] + (geo.pol[p].vtx_count - 1 - v))
 
-static void ImportGeometry(const Model &model, const Primitive &meshPrimitive, primMeshGLTF &prim) {
-	// TODO detect instancing (using SHA1 on model)
+// Bulk accessor decoding: one loop specialized per component type, component count and normalization, instead of a call per element.
+// The destination is strided (usually a Vertex field), the source can be interleaved
+
+#ifdef DECODE_SSE2
+/// Widen the 4 components of a 8 or 16 bits element to int32 lanes
+template <typename T>
+static __m128i loadWidened(const T *s) {
+	if constexpr (sizeof(T) == 1) {
+		int32_t bytes;
+		memcpy(&bytes, s, sizeof(bytes));
+		const __m128i x = _mm_cvtsi32_si128(bytes);
+		if constexpr (std::is_signed_v<T>) {
+			const __m128i y = _mm_unpacklo_epi8(x, x);
+			return _mm_srai_epi32(_mm_unpacklo_epi16(y, y), 24);
+		} else {
+			return _mm_unpacklo_epi16(_mm_unpacklo_epi8(x, _mm_setzero_si128()), _mm_setzero_si128());
+		}
+	} else {
+		const __m128i x = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(s));
+		if constexpr (std::is_signed_v<T>)
+			return _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+		else
+			return _mm_unpacklo_epi16(x, _mm_setzero_si128());
+	}
+}
+#endif
 
+/// Decode count elements of N components of T to floats, normalized integers follow the glTF rules
+template <typename T, uint32_t N, bool Normalized>
+static void decodeAttribute(const unsigned char *src, size_t count, size_t srcStride, unsigned char *dst, size_t dstStride) {
+	constexpr float scale = Normalized ? 1.f / static_cast<float>(std::numeric_limits<T>::max()) : 1.f;
+#ifdef DECODE_SSE2
+	// the 4 components of the 8 and 16 bits elements (colors, tangents, weights) are converted in one SSE2 register
+	if constexpr (N == 4 && sizeof(T) <= 2) {
+		const __m128 scales = _mm_set1_ps(scale);
+		for (size_t i = 0; i < count; ++i) {
+			__m128 d = _mm_mul_ps(_mm_cvtepi32_ps(loadWidened(reinterpret_cast<const T *>(src + i * srcStride))), scales);
+			if constexpr (Normalized && std::is_signed_v<T>)
+				d = _mm_max_ps(d, _mm_set1_ps(-1.f));
+			_mm_storeu_ps(reinterpret_cast<float *>(dst + i * dstStride), d);
+		}
+		return;
+	}
+#endif
+	for (size_t i = 0; i < count; ++i) {
+		const T *s = reinterpret_cast<const T *>(src + i * srcStride);
+		float *d = reinterpret_cast<float *>(dst + i * dstStride);
+		for (uint32_t c = 0; c < N; ++c) {
+			if constexpr (Normalized && std::is_signed_v<T>)
+				d[c] = std::max(static_cast<float>(s[c]) * scale, -1.f);
+			else
+				d[c] = static_cast<float>(s[c]) * scale;
+		}
+	}
+}
+
+template <typename T, bool Normalized>
+static void decodeAttribute(uint32_t components, const unsigned char *src, size_t count, size_t srcStride, unsigned char *dst, size_t dstStride) {
+	switch (components) {
+		case 1:
+			decodeAttribute<T, 1, Normalized>(src, count, srcStride, dst, dstStride);
+			break;
+		case 2:
+			decodeAttribute<T, 2, Normalized>(src, count, srcStride, dst, dstStride);
+			break;
+		case 3:
+			decodeAttribute<T, 3, Normalized>(src, count, srcStride, dst, dstStride);
+			break;
+		case 4:
+			decodeAttribute<T, 4, Normalized>(src, count, srcStride, dst, dstStride);
+			break;
+		default:
+			break;
+	}
+}
+
+template <typename T>
+static void decodeAttribute(bool normalized, uint32_t components, const unsigned char *src, size_t count, size_t srcStride, unsigned char *dst, size_t dstStride) {
+	if (normalized)
+		decodeAttribute<T, true>(components, src, count, srcStride, dst, dstStride);
+	else
+		decodeAttribute<T, false>(components, src, count, srcStride, dst, dstStride);
+}
+
+/// Decode an accessor in dst, at most maxComponents per element and at most maxCount elements
+static void decodeAccessor(const Model &model, const Accessor &accessor, uint32_t maxComponents, size_t maxCount, unsigned char *dst, size_t dstStride) {
+	if (accessor.bufferView < 0)
+		return;
+	const auto &bufferView = model.bufferViews[accessor.bufferView];
+	const auto &buffer = model.buffers[bufferView.buffer];
+	const auto src = buffer.data.data() + bufferView.byteOffset + accessor.byteOffset;
+	const size_t srcStride = accessor.ByteStride(bufferView);
+	const size_t count = std::min(accessor.count, maxCount);
+	const uint32_t components = std::min(maxComponents, static_cast<uint32_t>(GetNumComponentsInType(accessor.type)));
+
+	switch (accessor.componentType) {
+		case TINYGLTF_COMPONENT_TYPE_FLOAT:
+			decodeAttribute<float, false>(components, src, count, srcStride, dst, dstStride);
+			break;
+		case TINYGLTF_COMPONENT_TYPE_DOUBLE:
+			decodeAttribute<double, false>(components, src, count, srcStride, dst, dstStride);
+			break;
+		case TINYGLTF_COMPONENT_TYPE_BYTE:
+			decodeAttribute<int8_t>(accessor.normalized, components, src, count, srcStride, dst, dstStride);
+			break;
+		case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+			decodeAttribute<uint8_t>(accessor.normalized, components, src, count, srcStride, dst, dstStride);
+			break;
+		case TINYGLTF_COMPONENT_TYPE_SHORT:
+			decodeAttribute<int16_t>(accessor.normalized, components, src, count, srcStride, dst, dstStride);
+			break;
+		case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+			decodeAttribute<uint16_t>(accessor.normalized, components, src, count, srcStride, dst, dstStride);
+			break;
+		case TINYGLTF_COMPONENT_TYPE_INT:
+			decodeAttribute<int32_t>(accessor.normalized, components, src, count, srcStride, dst, dstStride);
+			break;
+		case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
+			decodeAttribute<uint32_t>(accessor.normalized, components, src, count, srcStride, dst, dstStride);
+			break;
+		default:
+			assert(!"Not supported component type (yet)");
+	}
+}
+
+/// Widen the indices to uint32, tightly packed uint32 indices are a straight copy
+template <typename T>
+static void decodeIndices(const unsigned char *src, size_t count, size_t srcStride, uint32_t *dst) {
+	if (srcStride == sizeof(T)) {
+		if constexpr (sizeof(T) == sizeof(uint32_t)) {
+			memcpy(dst, src, count * sizeof(uint32_t));
+		} else {
+			const T *s = reinterpret_cast<const T *>(src);
+			for (size_t i = 0; i < count; ++i)
+				dst[i] = s[i];
+		}
+		return;
+	}
+	for (size_t i = 0; i < count; ++i)
+		dst[i] = *reinterpret_cast<const T *>(src + i * srcStride);
+}
+
+// hash of the GPU streams, PackedVertex has no padding unlike Vertex
+static uint64_t hashPrimGeometry(const primMeshGLTF &prim) {
+	std::vector<PackedVertex> packedVertices(prim.vertices.size());
+	for (size_t i = 0; i < prim.vertices.size(); ++i)
+		packedVertices[i] = PackedVertex::pack(prim.vertices[i]);
+	const uint64_t verticesHash = hashBytes(packedVertices.data(), packedVertices.size() * sizeof(PackedVertex));
+	return hashBytes(prim.indices.data(), prim.indices.size() * sizeof(uint32_t), verticesHash);
+}
+
+static bool isSameGeometry(const primMeshGLTF &a, const primMeshGLTF &b) { return a.indices == b.indices && a.vertices == b.vertices; }
+
+// prims with the same geometry share one primMeshGLTF, so one BLAS and one instanced draw
+// key of a duplicate -> key of the prim kept in the cache
+static std::map<uint32_t, uint32_t> primAliases;
+
+static uint32_t getPrimKey(int indicesAccessor) {
+	const auto alias = primAliases.find(static_cast<uint32_t>(indicesAccessor));
+	return alias != primAliases.end() ? alias->second : static_cast<uint32_t>(indicesAccessor);
+}
+
+static void ImportGeometry(const Model &model, const Primitive &meshPrimitive, primMeshGLTF &prim) {
 	// Boolean used to check if we have converted the vertex buffer format
 	bool convertedToTriangleList = false;
 	bool hasTangent = false;
-	// This permit to get a type agnostic way of reading the index buffer
-	std::unique_ptr<intArrayBase> indicesArrayPtr = nullptr;
 
 	if (meshPrimitive.indices == -1) {
 		spdlog::debug("ERROR: Can't load geometry without triangles indices");
@@ -656,44 +1048,28 @@ static void ImportGeometry(const Model &model, const Primitive &meshPrimitive, p
 		const auto byteStride = indicesAccessor.ByteStride(bufferView);
 		const auto count = indicesAccessor.count;
 
-		// Allocate the index array in the pointer-to-base declared in the
-		// parent scope
+		prim.indices.resize(count);
 		switch (indicesAccessor.componentType) {
 			case TINYGLTF_COMPONENT_TYPE_BYTE:
-				indicesArrayPtr = std::unique_ptr<intArray<char>>(new intArray<char>(arrayAdapter<char>(dataAddress, count, byteStride)));
-				break;
-
 			case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
-				indicesArrayPtr = std::unique_ptr<intArray<unsigned char>>(new intArray<unsigned char>(arrayAdapter<unsigned char>(dataAddress, count, byteStride)));
+				decodeIndices<uint8_t>(dataAddress, count, byteStride, prim.indices.data());
 				break;
 
 			case TINYGLTF_COMPONENT_TYPE_SHORT:
-				indicesArrayPtr = std::unique_ptr<intArray<short>>(new intArray<short>(arrayAdapter<short>(dataAddress, count, byteStride)));
-				break;
-
 			case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
-				indicesArrayPtr = std::unique_ptr<intArray<unsigned short>>(new intArray<unsigned short>(arrayAdapter<unsigned short>(dataAddress, count, byteStride)));
+				decodeIndices<uint16_t>(dataAddress, count, byteStride, prim.indices.data());
 				break;
 
 			case TINYGLTF_COMPONENT_TYPE_INT:
-				indicesArrayPtr = std::unique_ptr<intArray<int>>(new intArray<int>(arrayAdapter<int>(dataAddress, count, byteStride)));
-				break;
-
 			case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
-				indicesArrayPtr = std::unique_ptr<intArray<unsigned int>>(new intArray<unsigned int>(arrayAdapter<unsigned int>(dataAddress, count, byteStride)));
+				decodeIndices<uint32_t>(dataAddress, count, byteStride, prim.indices.data());
 				break;
 			default:
+				prim.indices.clear();
 				break;
 		}
 	}
 
-	if (indicesArrayPtr) {
-		const auto &indices = *indicesArrayPtr;
-
-		for (auto i = 0; i < indices.size(); ++i)
-			prim.indices.push_back(indices[i]);
-	}
-
 	switch (meshPrimitive.mode) {
 		// We re-arrange the indices so that it describe a simple list of
 		// triangles
@@ -733,281 +1109,47 @@ static void ImportGeometry(const Model &model, const Primitive &meshPrimitive, p
 			// this is the simpliest case to handle
 			spdlog::debug("TRIANGLES");
 
-			using AttribWritter = std::function<void(float *w, uint32_t p)>;
-			AttribWritter w_position = [](float *w, uint32_t p) {
-			};
-			AttribWritter w_normal = [](float *w, uint32_t p) {
-			};
-			AttribWritter w_texcoord0 = [](float *w, uint32_t p) {
-			};
-			AttribWritter w_texcoord1 = [](float *w, uint32_t p) {
-			};
-			AttribWritter w_color0 = [](float *w, uint32_t p) {
-			};
-			AttribWritter w_tangent = [](float *w, uint32_t p) {
-			};
-			AttribWritter w_joints0 = [](float *w, uint32_t p) {
-			};
-			AttribWritter w_weights0 = [](float *w, uint32_t p) {
-			};
-
-			// get the accessor
+			// the vertex count comes from the position
+			const auto position = meshPrimitive.attributes.find("POSITION");
+			if (position == meshPrimitive.attributes.end() || model.accessors[position->second].count == 0) {
+				spdlog::debug("ERROR: Can't load geometry without position");
+				break;
+			}
+			prim.vertices.resize(model.accessors[position->second].count);
+
+			// decode each attribute straight in its Vertex field
 			for (const auto &attribute : meshPrimitive.attributes) {
-				const auto attribAccessor = model.accessors[attribute.second];
-				const auto &bufferView = model.bufferViews[attribAccessor.bufferView];
-				const auto &buffer = model.buffers[bufferView.buffer];
-				const auto dataPtr = buffer.data.data() + bufferView.byteOffset + attribAccessor.byteOffset;
-				const auto byte_stride = attribAccessor.ByteStride(bufferView);
-				const bool normalized = attribAccessor.normalized;
-
-				AttribWritter *writter = nullptr;
-				unsigned int max_components = 0;
+				spdlog::debug(fmt::format("attribute string is : {}", attribute.first));
+
+				unsigned char *dst = nullptr;
+				uint32_t maxComponents = 0;
 				if (attribute.first == "POSITION") {
-					writter = &w_position;
-					max_components = 3;
+					dst = reinterpret_cast<unsigned char *>(&prim.vertices[0].pos);
+					maxComponents = 3;
 				} else if (attribute.first == "NORMAL") {
-					writter = &w_normal;
-					max_components = 3;
+					dst = reinterpret_cast<unsigned char *>(&prim.vertices[0].norm);
+					maxComponents = 3;
 				} else if (attribute.first == "TEXCOORD_0") {
-					writter = &w_texcoord0;
-					max_components = 2;
+					dst = reinterpret_cast<unsigned char *>(&prim.vertices[0].texCoord0);
+					maxComponents = 2;
 				} else if (attribute.first == "TEXCOORD_1") {
-					writter = &w_texcoord1;
-					max_components = 2;
+					dst = reinterpret_cast<unsigned char *>(&prim.vertices[0].texCoord1);
+					maxComponents = 2;
 				} else if (attribute.first == "COLOR_0") {
-					writter = &w_color0;
-					max_components = 4;
+					// alpha is dropped
+					dst = reinterpret_cast<unsigned char *>(&prim.vertices[0].color);
+					maxComponents = 3;
 				} else if (attribute.first == "TANGENT") {
-					writter = &w_tangent;
-					max_components = 4;
-				} else if (attribute.first == "JOINTS_0") {
-					writter = &w_joints0;
-					max_components = 4;
-				} else if (attribute.first == "WEIGHTS_0") {
-					writter = &w_weights0;
-					max_components = 4;
+					dst = reinterpret_cast<unsigned char *>(&prim.vertices[0].tangent);
+					maxComponents = 4;
+					hasTangent = true;
 				}
+				// JOINTS_0 and WEIGHTS_0 are not used (yet)
 
-				if (!writter)
+				if (!dst)
 					continue;
 
-				switch (attribAccessor.type) {
-					case TINYGLTF_TYPE_SCALAR:
-						max_components = std::min(max_components, 1u);
-						break;
-					case TINYGLTF_TYPE_VEC2:
-						max_components = std::min(max_components, 2u);
-						break;
-					case TINYGLTF_TYPE_VEC3:
-						max_components = std::min(max_components, 3u);
-						break;
-					case TINYGLTF_TYPE_VEC4:
-						max_components = std::min(max_components, 4u);
-						break;
-				}
-
-				switch (attribAccessor.componentType) {
-					case TINYGLTF_COMPONENT_TYPE_FLOAT:
-						*writter = [dataPtr, byte_stride, max_components](float *w, uint32_t p) {
-							const float *f = (const float*)(dataPtr + p * byte_stride);
-							for (unsigned int i = 0; i < max_components; ++i) {
-								w[i] = f[i];
-							}
-						};
-						break;
-					case TINYGLTF_COMPONENT_TYPE_DOUBLE:
-						*writter = [dataPtr, byte_stride, max_components](float *w, uint32_t p) {
-							const double *f = (const double*)(dataPtr + p * byte_stride);
-							for (unsigned int i = 0; i < max_components; ++i) {
-								w[i] = static_cast<float>(f[i]);
-							}
-						};
-						break;
-					case TINYGLTF_COMPONENT_TYPE_BYTE:
-						*writter = [dataPtr, byte_stride, max_components, normalized](float *w, uint32_t p) {
-							const int8_t *f = (const int8_t*)(dataPtr + p * byte_stride);
-							for (unsigned int i = 0; i < max_components; ++i) {
-								w[i] = normalized ? f[i] / (float)128 : f[i];
-							}
-						};
-						break;
-					case TINYGLTF_COMPONENT_TYPE_SHORT:
-						*writter = [dataPtr, byte_stride, max_components, normalized](float *w, uint32_t p) {
-							const int16_t *f = (const int16_t*)(dataPtr + p * byte_stride);
-							for (unsigned int i = 0; i < max_components; ++i) {
-								w[i] = normalized ? f[i] / (float)32768 : f[i];
-							}
-						};
-						break;
-					case TINYGLTF_COMPONENT_TYPE_INT:
-						*writter = [dataPtr, byte_stride, max_components, normalized](float *w, uint32_t p) {
-							const int32_t *f = (const int32_t*)(dataPtr + p * byte_stride);
-							for (unsigned int i = 0; i < max_components; ++i) {
-								w[i] = normalized ? f[i] / (float)2147483648 : f[i];
-							}
-						};
-						break;
-					case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
-						*writter = [dataPtr, byte_stride, max_components, normalized](float *w, uint32_t p) {
-							const uint8_t *f = (const uint8_t*)(dataPtr + p * byte_stride);
-							for (unsigned int i = 0; i < max_components; ++i) {
-								w[i] = normalized ? f[i] / (float)255 : f[i];
-							}
-						};
-						break;
-					case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
-						*writter = [dataPtr, byte_stride, max_components, normalized](float *w, uint32_t p) {
-							const uint16_t *f = (const uint16_t*)(dataPtr + p * byte_stride);
-							for (unsigned int i = 0; i < max_components; ++i) {
-								w[i] = normalized ? f[i] / (float)65535 : f[i];
-							}
-						};
-						break;
-					case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
-						*writter = [dataPtr, byte_stride, max_components, normalized](float *w, uint32_t p) {
-							const uint32_t *f = (const uint32_t*)(dataPtr + p * byte_stride);
-							for (unsigned int i = 0; i < max_components; ++i) {
-								w[i] = normalized ? f[i] / (float)4294967295 : f[i];
-							}
-						};
-						break;
-					default:
-						assert(!"Not supported component type (yet)");
-				}
-			}
-
-			// set the vertex first (to have the count) TODO maybe not needed
-			for (const auto &attribute : meshPrimitive.attributes) {
-				const auto attribAccessor = model.accessors[attribute.second];
-				const auto count = attribAccessor.count;
-
-				// spdlog::debug(fmt::format("current attribute has count {} and stride {} bytes", count, byte_stride).c_str());
-				spdlog::debug(fmt::format("attribute string is : {}", attribute.first));
-				if (attribute.first == "POSITION") {
-					spdlog::debug("found position attribute");
-
-					if (prim.vertices.empty())
-						prim.vertices.resize(count);
-
-
-					// get the position min/max for computing the boundingbox
-					/*		pMin.x = attribAccessor.minValues[0];
-					pMin.y = attribAccessor.minValues[1];
-					pMin.z = attribAccessor.minValues[2];
-					pMax.x = attribAccessor.maxValues[0];
-					pMax.y = attribAccessor.maxValues[1];
-					pMax.z = attribAccessor.maxValues[2];
-					*/
-					// 3D vector of float
-					glm::vec3 v;
-					for (uint32_t i{0}; i < count; ++i) {
-						w_position(&v.x, i);
-						prim.vertices[i].pos = v;
-					}
-					break;
-				}
-			}
-
-			// set the values
-			for (const auto &attribute : meshPrimitive.attributes) {
-				const auto attribAccessor = model.accessors[attribute.second];
-				const auto count = attribAccessor.count;
-
-				if (attribute.first == "NORMAL") {
-					spdlog::debug("found normal attribute");
-
-					glm::vec3 n;
-					for (uint32_t i{0}; i < count; ++i) {
-						w_normal(&n.x, i);
-						prim.vertices[i].norm = n;
-					}
-				}
-
-				// Face varying comment on the normals is also true for the UVs
-				if (attribute.first == "TEXCOORD_0") {
-					spdlog::debug("Found texture coordinates 0");
-
-					glm::vec2 uv;
-					for (uint32_t i{0}; i < count; ++i) {
-						w_texcoord0(&uv.x, i);
-						prim.vertices[i].texCoord0 = uv;
-					}
-				}
-				// Face varying comment on the normals is also true for the UVs
-				if (attribute.first == "TEXCOORD_1") {
-					spdlog::debug("Found texture coordinates 1");
-
-					glm::vec2 uv;
-					for (uint32_t i{0}; i < count; ++i) {
-						w_texcoord1(&uv.x, i);
-						prim.vertices[i].texCoord1 = uv;
-					}
-				}
-
-				// Vertex Color
-				if (attribute.first == "COLOR_0") {
-					spdlog::debug("Found vertex color 0");
-
-					glm::vec4 c0{0, 0, 0, 1};
-					for (uint32_t i{0}; i < count; ++i) {
-						w_color0(&c0.x, i);
-						prim.vertices[i].color = c0;
-					}
-				}
-
-				//// JOINTS_0
-				//if (attribute.first == "JOINTS_0") {
-				//	spdlog::debug("found JOINTS_0 attribute");
-
-				//	if (geo.skin.size() < count + start_id_vtx)
-				//		geo.skin.resize(count + start_id_vtx);
-
-				//	glm::vec4 joints;
-				//	for (size_t i{0}; i < count; ++i) {
-				//		w_joints0(&joints.x, i);
-				//		geo.skin[i + start_id_vtx].index[0] = hg::numeric_cast<uint16_t>((int)(joints.x));
-				//		geo.skin[i + start_id_vtx].index[1] = hg::numeric_cast<uint16_t>((int)(joints.y));
-				//		geo.skin[i + start_id_vtx].index[2] = hg::numeric_cast<uint16_t>((int)(joints.z));
-				//		geo.skin[i + start_id_vtx].index[3] = hg::numeric_cast<uint16_t>((int)(joints.w));
-				//	}
-				//}
-
-				//// WEIGHTS_0
-				//if (attribute.first == "WEIGHTS_0") {
-				//	spdlog::debug("found WEIGHTS_0 attribute");
-
-				//	if (geo.skin.size() < count + start_id_vtx)
-				//		geo.skin.resize(count + start_id_vtx);
-
-				//	glm::vec4 weights;
-				//	for (size_t i{0}; i < count; ++i) {
-				//		w_weights0(&weights.x, i);
-				//		geo.skin[i + start_id_vtx].weight[0] = hg::pack_float<uint8_t>(weights.x);
-				//		geo.skin[i + start_id_vtx].weight[1] = hg::pack_float<uint8_t>(weights.y);
-				//		geo.skin[i + start_id_vtx].weight[2] = hg::pack_float<uint8_t>(weights.z);
-				//		geo.skin[i + start_id_vtx].weight[3] = hg::pack_float<uint8_t>(weights.w);
-				//	}
-				//}
-			}
-
-			// special for the tangent, because it need the normal to compute the bitangent
-			for (const auto &attribute : meshPrimitive.attributes) {
-				const auto attribAccessor = model.accessors[attribute.second];
-				const auto count = attribAccessor.count;
-
-				// spdlog::debug(fmt::format("current attribute has count {} and stride {} bytes", count, byte_stride).c_str());
-
-				spdlog::debug(fmt::format("attribute string is : {}", attribute.first).c_str());
-				if (attribute.first == "TANGENT") {
-					spdlog::debug("found tangent attribute");
-					hasTangent = true;
-
-					glm::vec4 t;
-					for (uint32_t i{0}; i < count; ++i) {
-						w_normal(&t.x, i);
-						prim.vertices[i].tangent = t;
-					}
-				}
+				decodeAccessor(model, model.accessors[attribute.second], maxComponents, prim.vertices.size(), dst, sizeof(Vertex));
 			}
 			break;
 		}
@@ -1032,6 +1174,20 @@ static void ImportGeometry(const Model &model, const Primitive &meshPrimitive, p
 }
 
 //
+// create VULKAN needs of a sub mesh
+static void createObjectResources(objectGLTF &subMesh) {
+#ifdef DRAW_RASTERIZE
+	createDescriptorPool(subMesh.descriptorPool);
+	createUniformBuffers(subMesh.uniformBuffers, subMesh.uniformBuffersMemory, subMesh.uniformBuffersMapped, sizeof(UniformBufferObject));
+	createDescriptorSets(subMesh.descriptorSets, subMesh.uniformBuffers, sizeof(UniformBufferObject), sceneGLTF.descriptorSetLayout, subMesh.descriptorPool, sceneGLTF.uniformParamsBuffers, sizeof(UBOParams));
+#else
+	// motion vector
+	createDescriptorPoolMotionVector(subMesh.descriptorPool);
+	createUniformBuffers(subMesh.uniformBuffers, subMesh.uniformBuffersMemory, subMesh.uniformBuffersMapped, sizeof(UniformBufferObjectMotionVector));
+	createDescriptorSetsMotionVector(subMesh.descriptorSets, subMesh.uniformBuffers, sizeof(UniformBufferObjectMotionVector), sceneGLTF.descriptorSetLayout, subMesh.descriptorPool);
+#endif
+}
+
 static void ImportObject(const Model &model, const Node &gltf_node, objectGLTF &node, const int &gltf_id_node) {
 	// if there is no mesh or no skin, nothing inside objectGLTF
 	if (gltf_node.mesh < 0 && gltf_node.skin < 0)
@@ -1045,7 +1201,7 @@ static void ImportObject(const Model &model, const Node &gltf_node, objectGLTF &
 
 		for (auto meshPrimitive : gltf_mesh.primitives) {
 			objectGLTF subMesh{};
-			subMesh.id = meshPrimitive.indices;
+			subMesh.id = getPrimKey(meshPrimitive.indices);
 
 			// get the prim mesh from the cache
 			if (sceneGLTF.primsMeshCache.contains(subMesh.id))
@@ -1066,17 +1222,7 @@ static void ImportObject(const Model &model, const Node &gltf_node, objectGLTF &
 				subMesh.mat = 0;
 			}
 
-			// create VULKAN needs
-#ifdef DRAW_RASTERIZE
-			createDescriptorPool(subMesh.descriptorPool);
-			createUniformBuffers(subMesh.uniformBuffers, subMesh.uniformBuffersMemory, subMesh.uniformBuffersMapped, sizeof(UniformBufferObject));
-			createDescriptorSets(subMesh.descriptorSets, subMesh.uniformBuffers, sizeof(UniformBufferObject), sceneGLTF.descriptorSetLayout, subMesh.descriptorPool, sceneGLTF.uniformParamsBuffers, sizeof(UBOParams));
-#else
-			// motion vector
-			createDescriptorPoolMotionVector(subMesh.descriptorPool);
-			createUniformBuffers(subMesh.uniformBuffers, subMesh.uniformBuffersMemory, subMesh.uniformBuffersMapped, sizeof(UniformBufferObjectMotionVector));
-			createDescriptorSetsMotionVector(subMesh.descriptorSets, subMesh.uniformBuffers, sizeof(UniformBufferObjectMotionVector), sceneGLTF.descriptorSetLayout, subMesh.descriptorPool);
-#endif
+			createObjectResources(subMesh);
 			node.children.push_back(std::move(subMesh));
 		}
 
@@ -1189,6 +1335,7 @@ static void ImportCamera(const Model &model, const Node &gltf_node, objectGLTF &
 	//}
 	//node.SetCamera(camera);
 
+	node.isCamera = true;
 	updateCamWorld(node.world);
 }
 
@@ -1279,14 +1426,280 @@ static objectGLTF ImportNode(const Model &model, const int &gltf_id_node) {
 	return std::move(node);
 }
 
+// one per prim, read by the closest hit shader
+struct offsetPrim {
+	uint32_t offsetVertex, offsetIndex, index16;
+};
+
+static void createDefaultTexture() {
+	std::string imageName("WhiteTex");
+
+	const std::shared_ptr<textureGLTF> tex(new textureGLTF);
+	tex->name = imageName;
+	AssetFile texFile("textures/WhiteTex.png");
+	createTextureImage(texFile.data(), static_cast<int>(texFile.size()), tex->textureImage, tex->textureImageMemory, tex->mipLevels);
+	tex->textureImageView = createTextureImageView(tex->textureImage, tex->mipLevels, VK_FORMAT_R8G8B8A8_UNORM);
+	createTextureSampler(tex->textureSampler, tex->mipLevels);
+	sceneGLTF.textureCache[0] = tex;
+}
+
+static void createScenePipelines() {
+	createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
+	             VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &sceneGLTF.materialsCacheBuffer, sizeof(matGLTF) * sceneGLTF.materialsCache.size(),
+	             sceneGLTF.materialsCache.data());
+
+#ifdef DRAW_RASTERIZE
+	// create the graphic pipeline with the right amount of textures
+	createDescriptorSetLayout(sceneGLTF.descriptorSetLayout);
+	createGraphicsPipeline("spv/shader.vert.spv", "spv/shader.frag.spv", sceneGLTF.pipelineLayout, sceneGLTF.graphicsPipeline, sceneGLTF.renderPass, msaaSamples, sceneGLTF.descriptorSetLayout, false);
+	createGraphicsPipeline("spv/shader.vert.spv", "spv/shader.frag.spv", sceneGLTF.pipelineLayoutAlpha, sceneGLTF.graphicsPipelineAlpha, sceneGLTF.renderPass, msaaSamples, sceneGLTF.descriptorSetLayout, true);
+	if (USE_INDIRECT_DRAW) {
+		createIndirectGraphicsPipeline("spv/shaderIndirect.vert.spv", "spv/shader.frag.spv", sceneGLTF.indirectPipelineLayout, sceneGLTF.indirectPipeline, sceneGLTF.renderPass,
+		                               msaaSamples, sceneGLTF.descriptorSetLayout, false);
+		createIndirectGraphicsPipeline("spv/shaderIndirect.vert.spv", "spv/shader.frag.spv", sceneGLTF.indirectPipelineLayoutAlpha, sceneGLTF.indirectPipelineAlpha,
+		                               sceneGLTF.renderPass, msaaSamples, sceneGLTF.descriptorSetLayout, true);
+	}
+#endif
+}
+
+// store the scene streams in vkBuffer
+static void uploadSceneGeometry(const void *vertices, size_t verticesSize, const void *indices, size_t indicesSize, const std::vector<offsetPrim> &offsetPrims) {
+	createVertexBuffer(vertices, verticesSize, sceneGLTF.allVerticesBuffer, sceneGLTF.allVerticesBufferMemory);
+	createIndexBuffer(indices, indicesSize, sceneGLTF.allIndicesBuffer, sceneGLTF.allIndicesBufferMemory);
+	createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
+	             VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &sceneGLTF.offsetPrimsBuffer, sizeof(offsetPrim) * offsetPrims.size(),
+	             const_cast<offsetPrim*>(offsetPrims.data()));
+}
+
+// meshlet streams of the mesh shader path, not uploaded without it
+static void uploadSceneMeshlets(const void *meshlets, size_t meshletsSize, const void *meshletVertices, size_t meshletVerticesSize, const void *meshletTriangles,
+                                size_t meshletTrianglesSize) {
+	if (!USE_MESH_SHADER || !meshletsSize)
+		return;
+	const VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+	const VkMemoryPropertyFlags properties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+	createBuffer(usage, properties, &sceneGLTF.meshletsBuffer, meshletsSize, const_cast<void *>(meshlets));
+	createBuffer(usage, properties, &sceneGLTF.meshletVerticesBuffer, meshletVerticesSize, const_cast<void *>(meshletVertices));
+	createBuffer(usage, properties, &sceneGLTF.meshletTrianglesBuffer, meshletTrianglesSize, const_cast<void *>(meshletTriangles));
+}
+
+// offset of the binary chunk data in a .glb, 0 if there is none
+static uint64_t getGlbBinChunkOffset(const unsigned char *data, size_t size) {
+	if (size < 20 || memcmp(data, "glTF", 4) != 0)
+		return 0;
+	uint32_t jsonLength, binType;
+	memcpy(&jsonLength, data + 12, sizeof(uint32_t));
+	const uint64_t binHeader = 20 + uint64_t(jsonLength);
+	if (binHeader + 8 > size)
+		return 0;
+	memcpy(&binType, data + binHeader + 4, sizeof(uint32_t));
+	return binType == 0x004E4942 ? binHeader + 8 : 0; // "BIN"
+}
+
+static bool isDataUri(const std::string &uri) { return uri.rfind("data:", 0) == 0; }
+
+// where the image bytes are, false if the scene can't be cached (embedded base64 data)
+static bool fillGeometryCacheImages(const Model &model, uint64_t glbBinOffset, GeometryCacheContent &content) {
+	for (const auto &image : model.images) {
+		GeometryCacheImage cacheImage{};
+		cacheImage.uri = content.addString(image.uri);
+		cacheImage.name = content.addString(image.name);
+		cacheImage.mimeType = content.addString(image.mimeType);
+		if (image.bufferView >= 0) {
+			const auto &bufferView = model.bufferViews[image.bufferView];
+			const auto &buffer = model.buffers[bufferView.buffer];
+			if (buffer.uri.empty()) {
+				if (!glbBinOffset || bufferView.buffer != 0)
+					return false;
+				cacheImage.dataOffset = glbBinOffset + bufferView.byteOffset;
+			} else {
+				if (isDataUri(buffer.uri))
+					return false;
+				cacheImage.file = content.addString(buffer.uri);
+				cacheImage.dataOffset = bufferView.byteOffset;
+			}
+			cacheImage.dataSize = bufferView.byteLength;
+		} else {
+			if (image.uri.empty() || isDataUri(image.uri))
+				return false;
+			// whole file
+			cacheImage.file = cacheImage.uri;
+		}
+		content.images.push_back(cacheImage);
+	}
+	return true;
+}
+
+static bool fillGeometryCacheDependencies(const Model &model, const fs::path &sceneDir, GeometryCacheContent &content) {
+	for (const auto &buffer : model.buffers) {
+		if (buffer.uri.empty())
+			continue;
+		if (isDataUri(buffer.uri))
+			return false;
+		AssetFile file((sceneDir / buffer.uri).string());
+		content.dependencies.push_back({content.addString(buffer.uri), file.size(), hashBytes(file.data(), file.size())});
+	}
+	return true;
+}
+
+static void flattenNodes(const objectGLTF &node, GeometryCacheContent &content) {
+	GeometryCacheNode cacheNode{};
+	memcpy(cacheNode.world, glm::value_ptr(node.world), sizeof(cacheNode.world));
+	cacheNode.name = content.addString(node.name);
+	cacheNode.childCount = static_cast<uint32_t>(node.children.size());
+	cacheNode.flags = (node.isCamera ? GEOMETRY_CACHE_NODE_CAMERA : 0) | (!node.uniformBuffers.empty() ? GEOMETRY_CACHE_NODE_SUBMESH : 0);
+	cacheNode.id = node.id;
+	cacheNode.primMesh = node.primMesh;
+	cacheNode.mat = node.mat;
+	content.nodes.push_back(cacheNode);
+	for (const auto &child : node.children)
+		flattenNodes(child, content);
+}
+
+static objectGLTF readCachedNode(const GeometryCache &cache, uint32_t &nodeIndex) {
+	const GeometryCacheNode &cacheNode = cache.nodes()[nodeIndex++];
+	objectGLTF node{};
+	node.world = glm::make_mat4x4(cacheNode.world);
+	node.name = std::string(cache.string(cacheNode.name));
+	node.id = cacheNode.id;
+	node.primMesh = cacheNode.primMesh;
+	node.mat = cacheNode.mat;
+	if (cacheNode.flags & GEOMETRY_CACHE_NODE_CAMERA) {
+		node.isCamera = true;
+		updateCamWorld(node.world);
+	}
+	if (cacheNode.flags & GEOMETRY_CACHE_NODE_SUBMESH)
+		createObjectResources(node);
+	for (uint32_t i = 0; i < cacheNode.childCount; ++i)
+		node.children.push_back(readCachedNode(cache, nodeIndex));
+	return node;
+}
+
+// everything is validated before creating any Vulkan object, on failure the scene is loaded from the glTF
+static bool loadSceneFromCache(const GeometryCache &cache, const AssetFile &gltfFile, const fs::path &sceneDir, std::vector<objectGLTF> &scene) {
+	const auto &header = cache.header();
+
+	for (uint32_t i = 0; i < header.dependencyCount; ++i) {
+		const auto &dependency = cache.dependencies()[i];
+		const auto path = sceneDir / std::string(cache.string(dependency.file));
+		if (!AssetFile::exists(path.string()))
+			return false;
+		AssetFile file(path.string());
+		if (file.size() != dependency.size || hashBytes(file.data(), file.size()) != dependency.hash)
+			return false;
+	}
+
+	// resolve the image bytes, external files stay mapped until the textures are created
+	struct ImageBytes {
+		const unsigned char *data;
+		size_t size;
+	};
+	std::vector<ImageBytes> imageBytes;
+	std::map<std::string, std::shared_ptr<AssetFile>> externalFiles;
+	for (uint32_t i = 0; i < header.imageCount; ++i) {
+		const auto &image = cache.images()[i];
+		const AssetFile *file = &gltfFile;
+		if (image.file.size) {
+			const std::string path = (sceneDir / std::string(cache.string(image.file))).string();
+			if (!externalFiles.contains(path)) {
+				if (!AssetFile::exists(path))
+					return false;
+				externalFiles[path] = std::make_shared<AssetFile>(path);
+			}
+			file = externalFiles[path].get();
+		}
+		const uint64_t size = image.dataSize ? image.dataSize : file->size();
+		if (image.dataOffset > file->size() || size > file->size() - image.dataOffset)
+			return false;
+		imageBytes.push_back({file->data() + image.dataOffset, static_cast<size_t>(size)});
+	}
+
+	for (uint32_t i = 0; i < header.imageCount; ++i) {
+		const auto &cacheImage = cache.images()[i];
+		Image image;
+		image.uri = cache.string(cacheImage.uri);
+		image.name = cache.string(cacheImage.name);
+		image.mimeType = cache.string(cacheImage.mimeType);
+		std::string err, warn;
+		LoadImageDataEx(&image, static_cast<int>(i), &err, &warn, 0, 0, imageBytes[i].data, static_cast<int>(imageBytes[i].size), nullptr);
+	}
+	const auto *materials = static_cast<const matGLTF*>(cache.materials());
+	std::set<int> srgbImages;
+	for (uint32_t i = 0; i < header.materialCount; ++i) {
+		srgbImages.insert(static_cast<int>(materials[i].albedoTex) - 1);
+		srgbImages.insert(static_cast<int>(materials[i].emissiveTex) - 1);
+	}
+	createPendingImages(srgbImages);
+	createDefaultTexture();
+
+	sceneGLTF.materialsCache.assign(materials, materials + header.materialCount);
+	createScenePipelines();
+
+	std::vector<offsetPrim> offsetPrims;
+	for (uint32_t i = 0; i < header.primCount; ++i) {
+		const auto &cachePrim = cache.prims()[i];
+		auto prim = std::make_shared<primMeshGLTF>();
+		prim->vertexCount = cachePrim.vertexCount;
+		prim->indexCount = cachePrim.indexCount;
+		prim->offsetVertex = cachePrim.offsetVertex;
+		prim->offsetIndex = cachePrim.offsetIndex;
+		prim->indexType = static_cast<VkIndexType>(cachePrim.indexType);
+		prim->minBound = glm::make_vec3(cachePrim.minBound);
+		prim->maxBound = glm::make_vec3(cachePrim.maxBound);
+		prim->offsetMeshlet = cachePrim.offsetMeshlet;
+		prim->meshletCount = cachePrim.meshletCount;
+		// without the levels of detail the coarser index ranges stay in the cache, they get no offset prim and no BLAS
+		prim->lodCount = USE_LOD ? std::clamp(cachePrim.lodCount, 1u, MAX_PRIM_LODS) : 1u;
+		for (uint32_t l = 0; l < prim->lodCount; ++l) {
+			prim->lods[l] = {cachePrim.lods[l].offsetIndex, cachePrim.lods[l].indexCount, cachePrim.lods[l].error, static_cast<uint32_t>(offsetPrims.size())};
+			offsetPrims.push_back({prim->offsetVertex, prim->lods[l].offsetIndex, prim->indexType == VK_INDEX_TYPE_UINT16 ? 1u : 0u});
+		}
+		prim->id = prim->lods[0].id;
+		sceneGLTF.primsMeshCache[cachePrim.key] = prim;
+	}
+	uploadSceneGeometry(cache.vertices(), header.verticesSize, cache.indices(), header.indicesSize, offsetPrims);
+	uploadSceneMeshlets(cache.meshlets(), header.meshletsSize, cache.meshletVertices(), header.meshletVerticesSize, cache.meshletTriangles(), header.meshletTrianglesSize);
+
+	uint32_t nodeIndex = 0;
+	for (uint32_t i = 0; i < header.rootCount; ++i)
+		scene.push_back(readCachedNode(cache, nodeIndex));
+
+	spdlog::info(fmt::format("Scene geometry from the cache: {} prims, {} bytes of vertices, {} bytes of indices", header.primCount, header.verticesSize, header.indicesSize));
+	return true;
+}
+
 std::vector<objectGLTF> loadSceneGltf(const std::string &scenePath) {
+	const auto startTime = std::chrono::high_resolution_clock::now();
+	auto logLoadTime = [&](const char *source) {
+		const auto duration = std::chrono::duration<float, std::chrono::milliseconds::period>(std::chrono::high_resolution_clock::now() - startTime).count();
+		spdlog::info(fmt::format("Scene loaded in {:.1f} ms ({})", duration, source));
+	};
+
 	//
 	Model model;
 	TinyGLTF loader;
 	std::string err;
 	std::string warn;
 
-	auto gltfRC = cmrcFS.open(scenePath);
+	// mapped, only the pages read by tinygltf are loaded
+	AssetFile gltfFile(scenePath);
+	spdlog::info(fmt::format("Loading {} ({} bytes, {})", scenePath, gltfFile.size(), gltfFile.isMapped() ? "memory-mapped" : "embedded"));
+
+	// the cache is keyed by the content of the asset and by the mesh shader path, the meshlets are only built for it
+	const fs::path sceneDir = fs::path(scenePath).parent_path();
+	const std::string cachePath = scenePath + ".vkcache";
+	const bool useCache = USE_GEOMETRY_CACHE && gltfFile.isMapped();
+	const uint64_t sourceHash = useCache ? hashBytes(gltfFile.data(), gltfFile.size(), USE_MESH_SHADER ? 1 : 0) : 0;
+	// the cache has no CPU geometry
+	if (useCache && !KEEP_CPU_GEOMETRY) {
+		GeometryCache cache;
+		std::vector<objectGLTF> scene;
+		if (cache.open(cachePath, sourceHash, gltfFile.size(), sizeof(PackedVertex), sizeof(matGLTF)) && loadSceneFromCache(cache, gltfFile, sceneDir, scene)) {
+			logLoadTime("geometry cache");
+			return scene;
+		}
+		spdlog::info(fmt::format("No valid geometry cache for {}", scenePath));
+	}
 
 	// set our own save picture
 	loader.SetImageLoader(LoadImageDataEx, nullptr);
@@ -1295,14 +1708,18 @@ std::vector<objectGLTF> loadSceneGltf(const std::string &scenePath) {
 	bool ret;
 	if (fs::path(scenePath).extension() == ".gltf")
 		//	ret = loader.LoadASCIIFromFile(&model, &err, &warn, scenePath);
-		ret = loader.LoadASCIIFromString(&model, &err, &warn, gltfRC.cbegin(), gltfRC.size(), fs::path(scenePath).parent_path().string());
+		ret = loader.LoadASCIIFromString(&model, &err, &warn, reinterpret_cast<const char*>(gltfFile.data()), static_cast<unsigned int>(gltfFile.size()),
+		                                 sceneDir.string());
 	else
 		//	ret = loader.LoadBinaryFromFile(&model, &err, &warn, scenePath); // for binary glTF(.glb)
-		ret = loader.LoadBinaryFromMemory(&model, &err, &warn, reinterpret_cast<const unsigned char*>(gltfRC.cbegin()), gltfRC.size());
+		ret = loader.LoadBinaryFromMemory(&model, &err, &warn, gltfFile.data(), static_cast<unsigned int>(gltfFile.size()));
 	if (!ret) {
+		pendingImages.clear();
 		spdlog::error(fmt::format("failed to load {}: {}", scenePath, err));
 		return {};
 	}
+	// the images were only queued by LoadImageDataEx
+	createPendingImages(SrgbImages(model));
 
 	if (!warn.empty()) {
 		spdlog::info(fmt::format("warning {}: {}", scenePath, warn));
@@ -1325,17 +1742,7 @@ std::vector<objectGLTF> loadSceneGltf(const std::string &scenePath) {
 	spdlog::info(fmt::format("{} lights", model.lights.size()));
 
 	// create white texture
-	{
-		std::string imageName("WhiteTex");
-
-		const std::shared_ptr<textureGLTF> tex(new textureGLTF);
-		tex->name = imageName;
-		auto texRC = cmrcFS.open("textures/WhiteTex.png");
-		createTextureImage(reinterpret_cast<const unsigned char*>(texRC.cbegin()), texRC.size(), tex->textureImage, tex->textureImageMemory, tex->mipLevels);
-		tex->textureImageView = createTextureImageView(tex->textureImage, tex->mipLevels, VK_FORMAT_R8G8B8A8_UNORM);
-		createTextureSampler(tex->textureSampler, tex->mipLevels);
-		sceneGLTF.textureCache[0] = tex;
-	}
+	createDefaultTexture();
 
 	// load all materials
 	sceneGLTF.materialsCache.resize(model.materials.size() + 1);
@@ -1344,54 +1751,176 @@ std::vector<objectGLTF> loadSceneGltf(const std::string &scenePath) {
 	int counter = 1;
 	for (const auto &mat : model.materials)
 		sceneGLTF.materialsCache[counter++] = ImportMaterial(model, mat);
-	createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
-	             VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &sceneGLTF.materialsCacheBuffer, sizeof(matGLTF) * sceneGLTF.materialsCache.size(),
-	             sceneGLTF.materialsCache.data());
+	createScenePipelines();
 
-#ifdef DRAW_RASTERIZE
-	// create the graphic pipeline with the right amount of textures
-	createDescriptorSetLayout(sceneGLTF.descriptorSetLayout);
-	createGraphicsPipeline("spv/shader.vert.spv", "spv/shader.frag.spv", sceneGLTF.pipelineLayout, sceneGLTF.graphicsPipeline, sceneGLTF.renderPass, msaaSamples, sceneGLTF.descriptorSetLayout, false);
-	createGraphicsPipeline("spv/shader.vert.spv", "spv/shader.frag.spv", sceneGLTF.pipelineLayoutAlpha, sceneGLTF.graphicsPipelineAlpha, sceneGLTF.renderPass, msaaSamples, sceneGLTF.descriptorSetLayout, true);
-#endif
-
-	// load all prims
+	// load all prims, the decoding and the tangent generation of each prim are independent so they run on all the cores
+	std::vector<std::pair<const Primitive *, primMeshGLTF *>> primsToImport;
+	std::vector<uint32_t> primsToImportKeys;
 	for (const auto &mesh : model.meshes) {
 		for (const auto &meshPrimitive : mesh.primitives) {
 			if (sceneGLTF.primsMeshCache.contains(meshPrimitive.indices))
 				continue;
 
 			auto primMesh = std::make_shared<primMeshGLTF>();
-			ImportGeometry(model, meshPrimitive, *primMesh);
-			createVertexBuffer(primMesh->vertices, primMesh->vertexBuffer, primMesh->vertexBufferMemory);
-			createIndexBuffer(primMesh->indices, primMesh->indexBuffer, primMesh->indexBufferMemory);
-
+			primsToImport.push_back({&meshPrimitive, primMesh.get()});
+			primsToImportKeys.push_back(meshPrimitive.indices);
 			sceneGLTF.primsMeshCache[meshPrimitive.indices] = primMesh;
 		}
 	}
-	// make the big vertex cache and compute the offset for each prims
-	std::vector<Vertex> allVertices;
-	std::vector<uint32_t> allIndices;
-	struct offsetPrim {
-		uint32_t offsetVertex, offsetIndex;
-	};
+	std::vector<uint64_t> primsHash(primsToImport.size());
+	std::vector<MeshOptimizerStats> primsStats(primsToImport.size());
+	parallelFor(static_cast<uint32_t>(primsToImport.size()), [&](uint32_t i) {
+		ImportGeometry(model, *primsToImport[i].first, *primsToImport[i].second);
+		primsStats[i] = optimizePrimGeometry(*primsToImport[i].second);
+		if (USE_MESH_SHADER)
+			buildMeshlets(*primsToImport[i].second);
+		primsHash[i] = hashPrimGeometry(*primsToImport[i].second);
+	});
+
+	// ACMR weighted by the triangle count of each prim
+	{
+		size_t verticesBefore = 0, verticesAfter = 0, triangles = 0;
+		double missesBefore = 0, missesAfter = 0;
+		for (const auto &stats : primsStats) {
+			verticesBefore += stats.verticesBefore;
+			verticesAfter += stats.verticesAfter;
+			triangles += stats.triangleCount;
+			missesBefore += static_cast<double>(stats.acmrBefore) * stats.triangleCount;
+			missesAfter += static_cast<double>(stats.acmrAfter) * stats.triangleCount;
+		}
+		if (triangles)
+			spdlog::info(fmt::format("Mesh optimization: {} -> {} vertices, ACMR {:.3f} -> {:.3f}", verticesBefore, verticesAfter, missesBefore / triangles, missesAfter / triangles));
+	}
+
+	// detect instancing, the same geometry exported in different accessors is kept once
+	primAliases.clear();
+	std::unordered_map<uint64_t, std::vector<uint32_t>> primsByHash;
+	for (uint32_t i = 0; i < primsToImport.size(); ++i) {
+		auto &sameHash = primsByHash[primsHash[i]];
+		const auto original = std::find_if(sameHash.begin(), sameHash.end(), [&](uint32_t key) { return isSameGeometry(*sceneGLTF.primsMeshCache[key], *primsToImport[i].second); });
+		if (original != sameHash.end()) {
+			primAliases[primsToImportKeys[i]] = *original;
+			sceneGLTF.primsMeshCache.erase(primsToImportKeys[i]);
+		} else {
+			sameHash.push_back(primsToImportKeys[i]);
+		}
+	}
+	spdlog::info(fmt::format("Prims: {} imported, {} unique", primsToImport.size(), sceneGLTF.primsMeshCache.size()));
+
+	// the levels of detail of the unique prims
+	if (USE_LOD) {
+		std::vector<primMeshGLTF *> uniquePrims;
+		for (auto &prim : sceneGLTF.primsMeshCache)
+			uniquePrims.push_back(prim.second.get());
+		parallelFor(static_cast<uint32_t>(uniquePrims.size()), [&](uint32_t i) { buildPrimLods(*uniquePrims[i]); });
+
+		size_t lodPrims = 0, lodTriangles = 0;
+		for (const auto *prim : uniquePrims) {
+			lodPrims += prim->lodCount > 1;
+			for (uint32_t l = 1; l < prim->lodCount; ++l)
+				lodTriangles += prim->lods[l].indexCount / 3;
+		}
+		spdlog::info(fmt::format("LOD: {} prims simplified, {} triangles in the coarser levels", lodPrims, lodTriangles));
+	}
+
+	// make the big vertex cache and compute the offset for each prims, this is the only copy of the geometry on the GPU
+	// GPU vertices are packed, indices are a byte stream of 16 and 32 bits ranges, each one starting on 4 bytes
 	std::vector<offsetPrim> offsetPrims;
-	uint32_t counterPrim = 0;
+	std::vector<primMeshGLTF *> prims;
+	std::vector<uint32_t> meshletVerticesOffsets, meshletTrianglesOffsets;
+	size_t totalVertices = 0, totalIndices = 0, totalIndicesSize = 0;
+	size_t totalMeshlets = 0, totalMeshletVertices = 0, totalMeshletTriangles = 0;
 	for (auto &prim : sceneGLTF.primsMeshCache) {
-		prim.second->id = counterPrim;
-		offsetPrims.push_back({static_cast<uint32_t>(allVertices.size()), static_cast<uint32_t>(allIndices.size())});
-		allVertices.insert(allVertices.end(), prim.second->vertices.begin(), prim.second->vertices.end());
-		allIndices.insert(allIndices.end(), prim.second->indices.begin(), prim.second->indices.end());
-		++counterPrim;
+		prim.second->vertexCount = static_cast<uint32_t>(prim.second->vertices.size());
+		prim.second->indexCount = static_cast<uint32_t>(prim.second->indices.size());
+		prim.second->indexType = prim.second->vertexCount < 65536 ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
+		const size_t indexSize = prim.second->indexType == VK_INDEX_TYPE_UINT16 ? sizeof(uint16_t) : sizeof(uint32_t);
+
+		prim.second->offsetVertex = static_cast<uint32_t>(totalVertices);
+		// every level of detail is an index range with its own offset prim
+		prim.second->lods[0].indexCount = prim.second->indexCount;
+		for (uint32_t l = 0; l < prim.second->lodCount; ++l) {
+			auto &lod = prim.second->lods[l];
+			totalIndicesSize = (totalIndicesSize + 3) & ~size_t(3);
+			lod.offsetIndex = static_cast<uint32_t>(totalIndicesSize / indexSize);
+			lod.id = static_cast<uint32_t>(offsetPrims.size());
+			offsetPrims.push_back({prim.second->offsetVertex, lod.offsetIndex, prim.second->indexType == VK_INDEX_TYPE_UINT16 ? 1u : 0u});
+			totalIndices += lod.indexCount;
+			totalIndicesSize += lod.indexCount * indexSize;
+		}
+		prim.second->id = prim.second->lods[0].id;
+		prim.second->offsetIndex = prim.second->lods[0].offsetIndex;
+		prims.push_back(prim.second.get());
+
+		prim.second->meshletCount = static_cast<uint32_t>(prim.second->meshlets.size());
+		prim.second->offsetMeshlet = static_cast<uint32_t>(totalMeshlets);
+		meshletVerticesOffsets.push_back(static_cast<uint32_t>(totalMeshletVertices));
+		meshletTrianglesOffsets.push_back(static_cast<uint32_t>(totalMeshletTriangles));
+
+		totalVertices += prim.second->vertexCount;
+		totalMeshlets += prim.second->meshletCount;
+		totalMeshletVertices += prim.second->meshletVertices.size();
+		totalMeshletTriangles += prim.second->meshletTriangles.size();
 	}
-	// store these buffer in vkBuffer
-	VkDeviceMemory allVerticesBufferMemory;
-	VkDeviceMemory allIndicesBufferMemory;
-	createVertexBuffer(allVertices, sceneGLTF.allVerticesBuffer, allVerticesBufferMemory);
-	createIndexBuffer(allIndices, sceneGLTF.allIndicesBuffer, allIndicesBufferMemory);
-	createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
-	             VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &sceneGLTF.offsetPrimsBuffer, sizeof(offsetPrim) * offsetPrims.size(),
-	             offsetPrims.data());
+	// the shaders read the indices as uint
+	totalIndicesSize = (totalIndicesSize + 3) & ~size_t(3);
+
+	// every prim writes its own range
+	std::vector<PackedVertex> allVertices(totalVertices);
+	std::vector<uint8_t> allIndices(totalIndicesSize, 0);
+	std::vector<meshletGLTF> allMeshlets(totalMeshlets);
+	std::vector<uint32_t> allMeshletVertices(totalMeshletVertices), allMeshletTriangles(totalMeshletTriangles);
+	parallelFor(static_cast<uint32_t>(prims.size()), [&](uint32_t i) {
+		primMeshGLTF &prim = *prims[i];
+		for (uint32_t v = 0; v < prim.vertexCount; ++v)
+			allVertices[prim.offsetVertex + v] = PackedVertex::pack(prim.vertices[v]);
+
+		for (uint32_t l = 0; l < prim.lodCount; ++l) {
+			const auto &indices = l == 0 ? prim.indices : prim.lodIndices[l - 1];
+			if (prim.indexType == VK_INDEX_TYPE_UINT16) {
+				auto *dst = reinterpret_cast<uint16_t *>(allIndices.data()) + prim.lods[l].offsetIndex;
+				for (uint32_t index : indices)
+					*dst++ = static_cast<uint16_t>(index);
+			} else {
+				memcpy(reinterpret_cast<uint32_t *>(allIndices.data()) + prim.lods[l].offsetIndex, indices.data(), indices.size() * sizeof(uint32_t));
+			}
+		}
+
+		// the meshlets point in the scene meshlet streams, their vertices stay relative to the prim
+		for (uint32_t m = 0; m < prim.meshletCount; ++m) {
+			meshletGLTF meshlet = prim.meshlets[m];
+			meshlet.vertexOffset += meshletVerticesOffsets[i];
+			meshlet.triangleOffset += meshletTrianglesOffsets[i];
+			allMeshlets[prim.offsetMeshlet + m] = meshlet;
+		}
+		std::copy(prim.meshletVertices.begin(), prim.meshletVertices.end(), allMeshletVertices.begin() + meshletVerticesOffsets[i]);
+		std::copy(prim.meshletTriangles.begin(), prim.meshletTriangles.end(), allMeshletTriangles.begin() + meshletTrianglesOffsets[i]);
+
+		// keep what is needed after the upload
+		if (!prim.vertices.empty()) {
+			prim.minBound = prim.maxBound = prim.vertices[0].pos;
+			for (const auto &v : prim.vertices) {
+				prim.minBound = glm::min(prim.minBound, v.pos);
+				prim.maxBound = glm::max(prim.maxBound, v.pos);
+			}
+		}
+		if (!KEEP_CPU_GEOMETRY) {
+			std::vector<Vertex>().swap(prim.vertices);
+			std::vector<uint32_t>().swap(prim.indices);
+			std::vector<meshletGLTF>().swap(prim.meshlets);
+			std::vector<uint32_t>().swap(prim.meshletVertices);
+			std::vector<uint32_t>().swap(prim.meshletTriangles);
+			std::vector<std::vector<uint32_t>>().swap(prim.lodIndices);
+		}
+	});
+	spdlog::info(fmt::format("Scene geometry: {} vertices ({} bytes), {} indices ({} bytes)", allVertices.size(), allVertices.size() * sizeof(PackedVertex), totalIndices,
+	                         allIndices.size()));
+	uploadSceneGeometry(allVertices.data(), allVertices.size() * sizeof(PackedVertex), allIndices.data(), allIndices.size(), offsetPrims);
+	if (USE_MESH_SHADER)
+		spdlog::info(fmt::format("Scene meshlets: {} meshlets, {} meshlet vertices, {} meshlet triangles", allMeshlets.size(), allMeshletVertices.size(),
+		                         allMeshletTriangles.size()));
+	uploadSceneMeshlets(allMeshlets.data(), allMeshlets.size() * sizeof(meshletGLTF), allMeshletVertices.data(), allMeshletVertices.size() * sizeof(uint32_t),
+	                    allMeshletTriangles.data(), allMeshletTriangles.size() * sizeof(uint32_t));
 
 	// Handle only one big scene
 	std::vector<objectGLTF> scene;
@@ -1405,5 +1934,45 @@ std::vector<objectGLTF> loadSceneGltf(const std::string &scenePath) {
 		//ImportSkins(model, gltf_scene, scene, config);		
 	}
 
+	// a cache without the levels of detail would disable them for the next runs
+	if (useCache && USE_LOD) {
+		GeometryCacheContent content;
+		content.sourceHash = sourceHash;
+		content.sourceSize = gltfFile.size();
+		content.vertexStride = sizeof(PackedVertex);
+		content.materialStride = sizeof(matGLTF);
+		content.materials = sceneGLTF.materialsCache.data();
+		content.materialCount = static_cast<uint32_t>(sceneGLTF.materialsCache.size());
+		content.vertices = allVertices.data();
+		content.verticesSize = allVertices.size() * sizeof(PackedVertex);
+		content.indices = allIndices.data();
+		content.indicesSize = allIndices.size();
+		content.meshlets = allMeshlets.data();
+		content.meshletsSize = allMeshlets.size() * sizeof(meshletGLTF);
+		content.meshletVertices = allMeshletVertices.data();
+		content.meshletVerticesSize = allMeshletVertices.size() * sizeof(uint32_t);
+		content.meshletTriangles = allMeshletTriangles.data();
+		content.meshletTrianglesSize = allMeshletTriangles.size() * sizeof(uint32_t);
+		static_assert(MAX_PRIM_LODS == GEOMETRY_CACHE_MAX_LODS);
+		for (const auto &prim : sceneGLTF.primsMeshCache) {
+			GeometryCachePrim cachePrim{prim.first, prim.second->vertexCount, prim.second->indexCount, prim.second->offsetVertex, prim.second->offsetIndex,
+			                            static_cast<uint32_t>(prim.second->indexType), {prim.second->minBound.x, prim.second->minBound.y, prim.second->minBound.z},
+			                            {prim.second->maxBound.x, prim.second->maxBound.y, prim.second->maxBound.z}, prim.second->offsetMeshlet, prim.second->meshletCount};
+			cachePrim.lodCount = prim.second->lodCount;
+			for (uint32_t l = 0; l < prim.second->lodCount; ++l)
+				cachePrim.lods[l] = {prim.second->lods[l].offsetIndex, prim.second->lods[l].indexCount, prim.second->lods[l].error};
+			content.prims.push_back(cachePrim);
+		}
+		content.rootCount = static_cast<uint32_t>(scene.size());
+		for (const auto &node : scene)
+			flattenNodes(node, content);
+
+		if (fillGeometryCacheImages(model, getGlbBinChunkOffset(gltfFile.data(), gltfFile.size()), content) && fillGeometryCacheDependencies(model, sceneDir, content))
+			writeGeometryCache(cachePath, content);
+		else
+			spdlog::info(fmt::format("{} has embedded data uris, no geometry cache", scenePath));
+	}
+
+	logLoadTime("glTF");
 	return std::move(scene);
 }
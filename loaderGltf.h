@@ -7,6 +7,7 @@
 #define GLM_FORCE_DEPTH_ZERO_TO_ONE
 #define GLM_FORCE_DEFAULT_ALIGNED_GENTYPES
 #include <memory>
+#include <array>
 #include <glm/glm.hpp>
 
 #include "core_utils.h"
@@ -56,21 +57,65 @@ struct matGLTF {
 	glm::vec3 emissiveFactor{0, 0, 0};
 };
 
+// cluster of the mesh shader path, std430 layout of shaders/meshlet.glsl
+// at most MESHLET_MAX_VERTICES vertices and MESHLET_MAX_TRIANGLES triangles
+constexpr uint32_t MESHLET_MAX_VERTICES = 64;
+constexpr uint32_t MESHLET_MAX_TRIANGLES = 124;
+struct meshletGLTF {
+	uint32_t vertexOffset{0}, triangleOffset{0}; // in the meshlet vertices/triangles streams
+	uint32_t vertexCount{0}, triangleCount{0};
+	glm::vec4 sphere{0}; // bounding sphere, xyz center, w radius
+	glm::vec4 cone{0, 0, 0, 1}; // normal cone, xyz axis, w cutoff, a cutoff of 1 never culls
+};
+static_assert(sizeof(meshletGLTF) == 48, "meshletGLTF must match the Meshlet struct of meshlet.glsl");
+
+// levels of detail, the level 0 is the prim itself, the others only have their own index range in the scene index buffer
+constexpr uint32_t MAX_PRIM_LODS = 4;
+// prims under this triangle count are not simplified
+constexpr uint32_t LOD_MIN_TRIANGLES = 128;
+// simplification error bound, relative to the prim extent
+constexpr float LOD_MAX_ERROR = 0.05f;
+struct primLodGLTF {
+	uint32_t offsetIndex{0};
+	uint32_t indexCount{0};
+	float error{0}; // relative to the prim extent
+	uint32_t id{0}; // entry in the scene offset prims buffer, read by the closest hit shader
+};
+
 struct primMeshGLTF {
 	uint32_t id{0};
-	// Vulkan
+	// CPU geometry, released after the upload unless KEEP_CPU_GEOMETRY is set
 	std::vector<Vertex> vertices;
-	VkBuffer vertexBuffer;
-	VkDeviceMemory vertexBufferMemory;
 	std::vector<uint32_t> indices;
-	VkBuffer indexBuffer;
-	VkDeviceMemory indexBufferMemory;
+	// meshlets, vertices are prim vertex indices, triangles are 3 meshlet vertex indices packed in 8 bits each
+	std::vector<meshletGLTF> meshlets;
+	std::vector<uint32_t> meshletVertices;
+	std::vector<uint32_t> meshletTriangles;
+	// indices of the levels of detail 1 and up
+	std::vector<std::vector<uint32_t>> lodIndices;
+	// always valid
+	uint32_t vertexCount{0};
+	uint32_t indexCount{0};
+	glm::vec3 minBound{0}, maxBound{0};
+	// Vulkan, offsets in the scene vertex/index buffers (allVerticesBuffer/allIndicesBuffer)
+	// prims under 65536 vertices have 16 bits indices, offsetIndex is counted in elements of indexType
+	uint32_t offsetVertex{0};
+	uint32_t offsetIndex{0};
+	VkIndexType indexType{VK_INDEX_TYPE_UINT32};
+	// in the scene meshlets buffer (meshletsBuffer)
+	uint32_t offsetMeshlet{0};
+	uint32_t meshletCount{0};
+	// lods[0] is offsetIndex/indexCount, the meshlets are only built for it
+	uint32_t lodCount{1};
+	std::array<primLodGLTF, MAX_PRIM_LODS> lods;
 };
 
 struct objectGLTF {
 	std::vector<objectGLTF> children;
-	uint32_t id{0}, idInstanceRaytrace{0};
+	uint32_t id{0}, idInstanceRaytrace{0}, idInstanceBvh{0};
+	uint32_t lodRaytrace{0}; // level of detail of the raytrace instance
 	std::string name;
+	bool isCamera{false};
 	glm::mat4 world{1};
 	glm::mat4 PrevModelViewProjectionMat{1};
 
@@ -87,4 +132,9 @@ struct objectGLTF {
 	std::vector<void*> uniformBuffersMapped;
 };
 
+// keep the prims vertices/indices on the CPU after the upload (for CPU side features)
+extern bool KEEP_CPU_GEOMETRY;
+// read/write the binary geometry cache next to the asset (<asset>.vkcache), only for assets on the disk
+extern bool USE_GEOMETRY_CACHE;
+
 std::vector<objectGLTF> loadSceneGltf(const std::string &scenePath);
@@ -19,13 +19,17 @@
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 
+#include <fmt/core.h>
 #include <spdlog/spdlog.h>
 
 #include "camera.h"
+#include "culling.h"
 #include "dlss.h"
 #include "rasterizer.h"
 #include "raytrace.h"
 #include "scene.h"
+#include "texture.h"
+#include "upload_engine.h"
 
 const std::vector<const char*> validationLayers = {"VK_LAYER_KHRONOS_validation"};
 std::vector<const char*> deviceExtensions = {
@@ -41,6 +45,8 @@ std::vector<const char*> deviceExtensions = {
 struct QueueFamilyIndices {
 	std::optional<uint32_t> graphicsFamily;
 	std::optional<uint32_t> presentFamily;
+	// dedicated to the copies (DMA engine), optional
+	std::optional<uint32_t> transferFamily;
 	bool isComplete() { return graphicsFamily.has_value() && presentFamily.has_value(); }
 };
 
@@ -146,8 +152,8 @@ private:
 
 	void cleanupSwapChain() {
 		vkDestroyImageView(device, colorImageView, nullptr);
+		freeImageMemory(colorImage);
 		vkDestroyImage(device, colorImage, nullptr);
-		vkFreeMemory(device, colorImageMemory, nullptr);
 
 		for (auto imageView : swapChainImageViews) {
 			vkDestroyImageView(device, imageView, nullptr);
@@ -169,6 +175,10 @@ private:
 
 		vkDestroyCommandPool(device, commandPool, nullptr);
 
+		destroyUploadEngine();
+		destroyMipmapPipelines();
+		destroyCullingResources();
+		destroyMemoryAllocator();
 		vkDestroyDevice(device, nullptr);
 
 		if (enableValidationLayers) {
@@ -403,14 +413,55 @@ private:
 			i++;
 		}
 
+		for (uint32_t family = 0; family < queueFamilyCount; family++) {
+			const VkQueueFlags flags = queueFamilies[family].queueFlags;
+			if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+				indices.transferFamily = family;
+				break;
+			}
+		}
+
 		return indices;
 	}
 
+	bool isDeviceExtensionSupported(VkPhysicalDevice device, const char *extensionName) {
+		uint32_t extensionCount;
+		vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, nullptr);
+		std::vector<VkExtensionProperties> availableExtensions(extensionCount);
+		vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, availableExtensions.data());
+		return std::any_of(availableExtensions.begin(), availableExtensions.end(),
+		                   [extensionName](const VkExtensionProperties &extension) { return std::strcmp(extension.extensionName, extensionName) == 0; });
+	}
+
+	bool isMeshShaderSupported(VkPhysicalDevice device) {
+		if (!isDeviceExtensionSupported(device, VK_EXT_MESH_SHADER_EXTENSION_NAME))
+			return false;
+
+		VkPhysicalDeviceMeshShaderFeaturesEXT meshShaderFeatures{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MESH_SHADER_FEATURES_EXT};
+		VkPhysicalDeviceFeatures2 deviceFeatures2{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2};
+		deviceFeatures2.pNext = &meshShaderFeatures;
+		vkGetPhysicalDeviceFeatures2(device, &deviceFeatures2);
+		return meshShaderFeatures.taskShader && meshShaderFeatures.meshShader;
+	}
+
+	// several commands per indirect draw, with a first instance and a count read from a buffer
+	bool isIndirectDrawSupported(VkPhysicalDevice device) {
+		if (!isDeviceExtensionSupported(device, VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME))
+			return false;
+		VkPhysicalDeviceFeatures supportedFeatures;
+		vkGetPhysicalDeviceFeatures(device, &supportedFeatures);
+		return supportedFeatures.multiDrawIndirect && supportedFeatures.drawIndirectFirstInstance;
+	}
+
 	void createLogicalDevice() {
 		QueueFamilyIndices indices = findQueueFamilies(physicalDevice);
 
 		std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
 		std::set<uint32_t> uniqueQueueFamilies = {indices.graphicsFamily.value(), indices.presentFamily.value()};
+		if (!USE_TRANSFER_QUEUE)
+			indices.transferFamily.reset();
+		if (indices.transferFamily)
+			uniqueQueueFamilies.insert(indices.transferFamily.value());
 
 		float queuePriority = 1.0f;
 		for (uint32_t queueFamily : uniqueQueueFamilies) {
@@ -425,6 +476,14 @@ private:
 		VkPhysicalDeviceFeatures deviceFeatures{};
 		deviceFeatures.samplerAnisotropy = VK_TRUE;
 		deviceFeatures.sampleRateShading = VK_TRUE; // enable sample shading feature for the device
+		if (USE_INDIRECT_DRAW && !isIndirectDrawSupported(physicalDevice))
+			USE_INDIRECT_DRAW = false;
+		if (USE_INDIRECT_DRAW) {
+			deviceFeatures.multiDrawIndirect = VK_TRUE;
+			deviceFeatures.drawIndirectFirstInstance = VK_TRUE;
+			deviceExtensions.push_back(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+		}
+		spdlog::info(fmt::format("Indirect draw: {}", USE_INDIRECT_DRAW ? "on" : "off"));
 
 		VkDeviceCreateInfo createInfo{};
 		createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
@@ -435,6 +494,11 @@ private:
 		VkPhysicalDeviceDescriptorIndexingFeatures enableDescriptorIndexingFeatures{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES};
 		enableDescriptorIndexingFeatures.runtimeDescriptorArray = true;
 
+		// the upload engine synchronizes the transfer and graphics submits with a timeline semaphore
+		VkPhysicalDeviceTimelineSemaphoreFeatures enabledTimelineSemaphoreFeatures{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES};
+		enabledTimelineSemaphoreFeatures.timelineSemaphore = VK_TRUE;
+		enableDescriptorIndexingFeatures.pNext = &enabledTimelineSemaphoreFeatures;
+
 		// Enable features required for ray tracing using feature chaining via pNext
 		VkPhysicalDeviceBufferDeviceAddressFeatures enabledBufferDeviceAddresFeatures{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES};
 		enabledBufferDeviceAddresFeatures.bufferDeviceAddress = VK_TRUE;
@@ -448,9 +512,21 @@ private:
 		enabledAccelerationStructureFeatures.accelerationStructure = VK_TRUE;
 		enabledAccelerationStructureFeatures.pNext = &enabledRayTracingPipelineFeatures;
 		
+		// task/mesh shaders for the motion vector pass, the vertex pipeline is used without them
+		VkPhysicalDeviceMeshShaderFeaturesEXT enabledMeshShaderFeatures{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MESH_SHADER_FEATURES_EXT};
+		enabledMeshShaderFeatures.pNext = &enabledAccelerationStructureFeatures;
+		if (USE_MESH_SHADER && !isMeshShaderSupported(physicalDevice))
+			USE_MESH_SHADER = false;
+		if (USE_MESH_SHADER) {
+			enabledMeshShaderFeatures.taskShader = VK_TRUE;
+			enabledMeshShaderFeatures.meshShader = VK_TRUE;
+			deviceExtensions.push_back(VK_EXT_MESH_SHADER_EXTENSION_NAME);
+		}
+		spdlog::info(fmt::format("Mesh shader: {}", USE_MESH_SHADER ? "on" : "off"));
+
 		VkPhysicalDeviceFeatures2 physicalDeviceFeatures2{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2};
 		physicalDeviceFeatures2.features = deviceFeatures;
-		physicalDeviceFeatures2.pNext = &enabledAccelerationStructureFeatures;
+		physicalDeviceFeatures2.pNext = USE_MESH_SHADER ? static_cast<void *>(&enabledMeshShaderFeatures) : &enabledAccelerationStructureFeatures;
 		createInfo.pEnabledFeatures = nullptr;
 		createInfo.pNext = &physicalDeviceFeatures2;
 
@@ -469,10 +545,15 @@ private:
 		}
 		vkGetDeviceQueue(device, indices.graphicsFamily.value(), 0, &graphicsQueue);
 		vkGetDeviceQueue(device, indices.presentFamily.value(), 0, &presentQueue);
+		VkQueue transferQueue = VK_NULL_HANDLE;
+		if (indices.transferFamily)
+			vkGetDeviceQueue(device, indices.transferFamily.value(), 0, &transferQueue);
+		createUploadEngine(indices.graphicsFamily.value(), graphicsQueue, indices.transferFamily.value_or(indices.graphicsFamily.value()), transferQueue);
 				
 		// raytrace
 		VkPhysicalDeviceProperties2 deviceProperties2{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2};
 		deviceProperties2.pNext = &rayTracingPipelineProperties;
+		rayTracingPipelineProperties.pNext = &accelerationStructureProperties;
 		vkGetPhysicalDeviceProperties2(physicalDevice, &deviceProperties2);
 		VkPhysicalDeviceFeatures2 deviceFeatures2{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2};
 		deviceFeatures2.pNext = &accelerationStructureFeatures;
@@ -767,7 +848,7 @@ private:
 	}
 };
 
-int main() {
+int main(int argc, char *argv[]) {
 #ifdef DEBUG
 	spdlog::set_level(spdlog::level::debug);
 #else
@@ -775,6 +856,36 @@ int main() {
 #endif
 	spdlog::info("Welcome to Vulkanite!");
 
+	// Vulkanite [model.glb|model.gltf] [--envmap envmap.hdr] [--no-cache] [--no-mesh-shader] [--no-lod] [--no-compute-mipmaps] [--no-transfer-queue] [--no-indirect-draw] [--no-gpu-culling] [--no-instance-bvh]
+	for (int i = 1; i < argc; ++i) {
+		const std::string arg = argv[i];
+		if (arg == "--envmap" && i + 1 < argc)
+			ENVMAP_PATH = argv[++i];
+		else if (arg == "--model" && i + 1 < argc)
+			MODEL_PATH = argv[++i];
+		else if (arg == "--no-cache")
+			USE_GEOMETRY_CACHE = false;
+		else if (arg == "--no-mesh-shader")
+			USE_MESH_SHADER = false;
+		else if (arg == "--no-lod")
+			USE_LOD = false;
+		else if (arg == "--no-compute-mipmaps")
+			USE_COMPUTE_MIPMAPS = false;
+		else if (arg == "--no-transfer-queue")
+			USE_TRANSFER_QUEUE = false;
+		else if (arg == "--no-indirect-draw")
+			USE_INDIRECT_DRAW = false;
+		else if (arg == "--no-gpu-culling")
+			USE_GPU_CULLING = false;
+		else if (arg == "--no-instance-bvh")
+			USE_INSTANCE_BVH = false;
+		else if (arg.rfind("--", 0) != 0)
+			MODEL_PATH = arg;
+		else
+			spdlog::warn(fmt::format("unknown argument {}", arg));
+	}
+	spdlog::info(fmt::format("Model: {}, envmap: {}", MODEL_PATH, ENVMAP_PATH));
+
 	VulkaniteApplication app;
 
 	try {
@@ -0,0 +1,285 @@
+#include "memory_allocator.h"
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <fmt/core.h>
+#include <spdlog/spdlog.h>
+
+#include "core_utils.h"
+
+// default size of a device memory block, host visible memory is often a small heap so use smaller blocks there
+constexpr VkDeviceSize DEVICE_BLOCK_SIZE = 64 * 1024 * 1024;
+constexpr VkDeviceSize HOST_BLOCK_SIZE = 16 * 1024 * 1024;
+
+struct MemoryBlock {
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkDeviceSize size = 0;
+	void *mapped = nullptr;
+	std::map<VkDeviceSize, VkDeviceSize> freeRanges; // offset, size (FreeList pool)
+	VkDeviceSize head = 0; // Linear pool
+	uint32_t allocationCount = 0;
+	bool dedicated = false;
+};
+
+// buffers and images never share a pool, so we don't have to care about bufferImageGranularity
+struct MemoryPool {
+	uint32_t memoryTypeIndex;
+	bool isImage;
+	MemoryPoolType type;
+	std::vector<MemoryBlock> blocks;
+};
+
+static std::vector<MemoryPool> pools;
+static std::unordered_map<VkBuffer, MemoryAllocation> bufferAllocations;
+static std::unordered_map<VkImage, MemoryAllocation> imageAllocations;
+static std::mutex allocatorMutex;
+
+static VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment) { return (value + alignment - 1) / alignment * alignment; }
+
+static uint32_t getPoolIndex(uint32_t memoryTypeIndex, bool isImage, MemoryPoolType type) {
+	for (uint32_t i = 0; i < pools.size(); ++i)
+		if (pools[i].memoryTypeIndex == memoryTypeIndex && pools[i].isImage == isImage && pools[i].type == type)
+			return i;
+	pools.push_back({memoryTypeIndex, isImage, type, {}});
+	return static_cast<uint32_t>(pools.size() - 1);
+}
+
+static MemoryBlock createBlock(const MemoryPool &pool, VkDeviceSize size, VkMemoryPropertyFlags properties) {
+	MemoryBlock block;
+	block.size = size;
+
+	VkMemoryAllocateInfo allocInfo{VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO};
+	allocInfo.allocationSize = size;
+	allocInfo.memoryTypeIndex = pool.memoryTypeIndex;
+
+	// any buffer in the block may need its device address (acceleration structures, scratch, vertex pulling)
+	VkMemoryAllocateFlagsInfo allocFlagsInfo{VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO};
+	if (!pool.isImage) {
+		allocFlagsInfo.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT;
+		allocInfo.pNext = &allocFlagsInfo;
+	}
+	VK_CHECK_RESULT(vkAllocateMemory(device, &allocInfo, nullptr, &block.memory));
+
+	if (properties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+		VK_CHECK_RESULT(vkMapMemory(device, block.memory, 0, VK_WHOLE_SIZE, 0, &block.mapped));
+
+	if (pool.type == MemoryPoolType::FreeList)
+		block.freeRanges[0] = size;
+	return block;
+}
+
+static bool allocateInBlock(MemoryBlock &block, MemoryPoolType type, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize &offset) {
+	if (type == MemoryPoolType::Linear) {
+		const VkDeviceSize alignedOffset = alignUp(block.head, alignment);
+		if (alignedOffset + size > block.size)
+			return false;
+		offset = alignedOffset;
+		block.head = alignedOffset + size;
+		return true;
+	}
+
+	// first fit
+	for (auto it = block.freeRanges.begin(); it != block.freeRanges.end(); ++it) {
+		const VkDeviceSize rangeOffset = it->first, rangeSize = it->second;
+		const VkDeviceSize alignedOffset = alignUp(rangeOffset, alignment);
+		if (alignedOffset + size > rangeOffset + rangeSize)
+			continue;
+
+		block.freeRanges.erase(it);
+		if (alignedOffset > rangeOffset)
+			block.freeRanges[rangeOffset] = alignedOffset - rangeOffset;
+		if (alignedOffset + size < rangeOffset + rangeSize)
+			block.freeRanges[alignedOffset + size] = rangeOffset + rangeSize - (alignedOffset + size);
+		offset = alignedOffset;
+		return true;
+	}
+	return false;
+}
+
+static void releaseInBlock(MemoryBlock &block, MemoryPoolType type, VkDeviceSize offset, VkDeviceSize size) {
+	if (type == MemoryPoolType::Linear) {
+		if (block.allocationCount == 0)
+			block.head = 0;
+		return;
+	}
+
+	// insert and merge with the neighbors
+	auto it = block.freeRanges.emplace(offset, size).first;
+	auto next = std::next(it);
+	if (next != block.freeRanges.end() && it->first + it->second == next->first) {
+		it->second += next->second;
+		block.freeRanges.erase(next);
+	}
+	if (it != block.freeRanges.begin()) {
+		auto prev = std::prev(it);
+		if (prev->first + prev->second == it->first) {
+			prev->second += it->second;
+			block.freeRanges.erase(it);
+		}
+	}
+}
+
+MemoryAllocation allocateMemory(const VkMemoryRequirements &memoryRequirements, VkMemoryPropertyFlags properties, bool isImage, MemoryPoolType poolType) {
+	std::lock_guard<std::mutex> lock(allocatorMutex);
+
+	MemoryAllocation allocation;
+	allocation.size = memoryRequirements.size;
+	allocation.poolIndex = getPoolIndex(findMemoryType(memoryRequirements.memoryTypeBits, properties), isImage, poolType);
+	MemoryPool &pool = pools[allocation.poolIndex];
+
+	const VkDeviceSize blockSize = properties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT ? HOST_BLOCK_SIZE : DEVICE_BLOCK_SIZE;
+	const VkDeviceSize alignment = std::max<VkDeviceSize>(memoryRequirements.alignment, 1);
+
+	// big resources get their own block
+	if (memoryRequirements.size > blockSize / 2) {
+		MemoryBlock block = createBlock(pool, memoryRequirements.size, properties);
+		block.dedicated = true;
+		block.freeRanges.clear();
+		block.head = memoryRequirements.size;
+		block.allocationCount = 1;
+		allocation.memory = block.memory;
+		allocation.mapped = block.mapped;
+		// reuse the slot of a released dedicated block
+		auto freeSlot = std::find_if(pool.blocks.begin(), pool.blocks.end(), [](const MemoryBlock &b) { return b.memory == VK_NULL_HANDLE; });
+		allocation.blockIndex = static_cast<uint32_t>(std::distance(pool.blocks.begin(), freeSlot));
+		if (freeSlot == pool.blocks.end())
+			pool.blocks.push_back(block);
+		else
+			*freeSlot = block;
+		return allocation;
+	}
+
+	VkDeviceSize offset = 0;
+	uint32_t blockIndex = 0;
+	for (; blockIndex < pool.blocks.size(); ++blockIndex) {
+		auto &block = pool.blocks[blockIndex];
+		if (block.memory != VK_NULL_HANDLE && !block.dedicated && allocateInBlock(block, poolType, memoryRequirements.size, alignment, offset))
+			break;
+	}
+	if (blockIndex == pool.blocks.size()) {
+		pool.blocks.push_back(createBlock(pool, blockSize, properties));
+		allocateInBlock(pool.blocks.back(), poolType, memoryRequirements.size, alignment, offset);
+	}
+
+	auto &block = pool.blocks[blockIndex];
+	block.allocationCount++;
+	allocation.memory = block.memory;
+	allocation.offset = offset;
+	allocation.blockIndex = blockIndex;
+	if (block.mapped)
+		allocation.mapped = static_cast<char*>(block.mapped) + offset;
+	return allocation;
+}
+
+void freeMemory(const MemoryAllocation &allocation) {
+	if (allocation.memory == VK_NULL_HANDLE)
+		return;
+
+	std::lock_guard<std::mutex> lock(allocatorMutex);
+
+	MemoryPool &pool = pools[allocation.poolIndex];
+	MemoryBlock &block = pool.blocks[allocation.blockIndex];
+	block.allocationCount--;
+
+	if (block.dedicated) {
+		// keep the slot so the block indices of the other allocations stay valid
+		vkFreeMemory(device, block.memory, nullptr);
+		block = MemoryBlock{};
+		return;
+	}
+	releaseInBlock(block, pool.type, allocation.offset, allocation.size);
+}
+
+VkResult bindBufferMemory(VkBuffer buffer, VkMemoryPropertyFlags properties, VkDeviceMemory &memory, MemoryPoolType poolType) {
+	VkMemoryRequirements memRequirements;
+	vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
+
+	MemoryAllocation allocation = allocateMemory(memRequirements, properties, false, poolType);
+	memory = allocation.memory;
+	{
+		std::lock_guard<std::mutex> lock(allocatorMutex);
+		bufferAllocations[buffer] = allocation;
+	}
+	return vkBindBufferMemory(device, buffer, allocation.memory, allocation.offset);
+}
+
+VkResult bindImageMemory(VkImage image, VkMemoryPropertyFlags properties, VkDeviceMemory &memory) {
+	VkMemoryRequirements memRequirements;
+	vkGetImageMemoryRequirements(device, image, &memRequirements);
+
+	MemoryAllocation allocation = allocateMemory(memRequirements, properties, true);
+	memory = allocation.memory;
+	{
+		std::lock_guard<std::mutex> lock(allocatorMutex);
+		imageAllocations[image] = allocation;
+	}
+	return vkBindImageMemory(device, image, allocation.memory, allocation.offset);
+}
+
+void freeBufferMemory(VkBuffer buffer) {
+	MemoryAllocation allocation;
+	{
+		std::lock_guard<std::mutex> lock(allocatorMutex);
+		auto it = bufferAllocations.find(buffer);
+		if (it == bufferAllocations.end())
+			return;
+		allocation = it->second;
+		bufferAllocations.erase(it);
+	}
+	freeMemory(allocation);
+}
+
+void freeImageMemory(VkImage image) {
+	MemoryAllocation allocation;
+	{
+		std::lock_guard<std::mutex> lock(allocatorMutex);
+		auto it = imageAllocations.find(image);
+		if (it == imageAllocations.end())
+			return;
+		allocation = it->second;
+		imageAllocations.erase(it);
+	}
+	freeMemory(allocation);
+}
+
+void *getMappedPointer(VkBuffer buffer) {
+	std::lock_guard<std::mutex> lock(allocatorMutex);
+	auto it = bufferAllocations.find(buffer);
+	return it != bufferAllocations.end() ? it->second.mapped : nullptr;
+}
+
+VkDeviceSize getMemoryOffset(VkBuffer buffer) {
+	std::lock_guard<std::mutex> lock(allocatorMutex);
+	auto it = bufferAllocations.find(buffer);
+	return it != bufferAllocations.end() ? it->second.offset : 0;
+}
+
+void logMemoryAllocatorStats() {
+	std::lock_guard<std::mutex> lock(allocatorMutex);
+	uint32_t blockCount = 0;
+	VkDeviceSize allocatedSize = 0;
+	for (const auto &pool : pools)
+		for (const auto &block : pool.blocks)
+			if (block.memory != VK_NULL_HANDLE) {
+				blockCount++;
+				allocatedSize += block.size;
+			}
+	spdlog::info(fmt::format("Memory allocator: {} device memory allocations ({} bytes) for {} buffers and {} images", blockCount, allocatedSize, bufferAllocations.size(),
+	                         imageAllocations.size()));
+}
+
+void destroyMemoryAllocator() {
+	std::lock_guard<std::mutex> lock(allocatorMutex);
+	for (auto &pool : pools)
+		for (auto &block : pool.blocks)
+			if (block.memory != VK_NULL_HANDLE)
+				vkFreeMemory(device, block.memory, nullptr);
+	pools.clear();
+	bufferAllocations.clear();
+	imageAllocations.clear();
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+// Device memory is allocated in big blocks per memory type, resources are sub-allocated inside
+// FreeList pools are for long lived resources, Linear pools for transient ones (staging, scratch): bump allocation, reset when the block is empty
+enum class MemoryPoolType { FreeList, Linear };
+
+struct MemoryAllocation {
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkDeviceSize offset = 0;
+	VkDeviceSize size = 0;
+	void *mapped = nullptr; // already offset, null if the memory is not host visible
+	uint32_t poolIndex = 0;
+	uint32_t blockIndex = 0;
+};
+
+MemoryAllocation allocateMemory(const VkMemoryRequirements &memoryRequirements, VkMemoryPropertyFlags properties, bool isImage, MemoryPoolType poolType = MemoryPoolType::FreeList);
+void freeMemory(const MemoryAllocation &allocation);
+
+// allocate and bind, the allocation is tracked by the resource handle
+VkResult bindBufferMemory(VkBuffer buffer, VkMemoryPropertyFlags properties, VkDeviceMemory &memory, MemoryPoolType poolType = MemoryPoolType::FreeList);
+VkResult bindImageMemory(VkImage image, VkMemoryPropertyFlags properties, VkDeviceMemory &memory);
+void freeBufferMemory(VkBuffer buffer);
+void freeImageMemory(VkImage image);
+
+// host visible blocks are persistently mapped, don't call vkMapMemory on sub-allocated memory
+void *getMappedPointer(VkBuffer buffer);
+VkDeviceSize getMemoryOffset(VkBuffer buffer);
+
+void logMemoryAllocatorStats();
+void destroyMemoryAllocator();
@@ -0,0 +1,614 @@
+#include "mesh_optimizer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <unordered_map>
+
+#include "loaderGltf.h"
+#include "vertex_config.h"
+
+float computeACMR(const std::vector<uint32_t> &indices, uint32_t vertexCount, uint32_t cacheSize) {
+	if (indices.size() < 3)
+		return 0.f;
+
+	// a vertex is in the cache if less than cacheSize vertices were loaded since its own load
+	std::vector<uint32_t> timestamps(vertexCount, 0);
+	uint32_t time = cacheSize + 1;
+	uint32_t misses = 0;
+	for (uint32_t index : indices) {
+		if (time - timestamps[index] > cacheSize) {
+			timestamps[index] = time++;
+			++misses;
+		}
+	}
+	return static_cast<float>(misses) / static_cast<float>(indices.size() / 3);
+}
+
+void weldVertices(primMeshGLTF &prim) {
+	std::unordered_map<Vertex, uint32_t> uniqueVertices;
+	uniqueVertices.reserve(prim.vertices.size());
+
+	std::vector<uint32_t> remap(prim.vertices.size());
+	std::vector<Vertex> weldedVertices;
+	weldedVertices.reserve(prim.vertices.size());
+	for (size_t i = 0; i < prim.vertices.size(); ++i) {
+		const auto [it, inserted] = uniqueVertices.try_emplace(prim.vertices[i], static_cast<uint32_t>(weldedVertices.size()));
+		if (inserted)
+			weldedVertices.push_back(prim.vertices[i]);
+		remap[i] = it->second;
+	}
+
+	for (auto &index : prim.indices)
+		index = remap[index];
+	prim.vertices.swap(weldedVertices);
+}
+
+// Forsyth scoring, the 3 vertices of the last triangle have a fixed score so the next triangle doesn't always reuse 2 of them
+static constexpr uint32_t VERTEX_CACHE_SIZE = 32;
+static constexpr float CACHE_DECAY_POWER = 1.5f;
+static constexpr float LAST_TRIANGLE_SCORE = 0.75f;
+static constexpr float VALENCE_BOOST_SCALE = 2.f;
+static constexpr float VALENCE_BOOST_POWER = 0.5f;
+
+static float vertexCacheScore(int cachePosition, uint32_t remainingTriangles) {
+	if (remainingTriangles == 0)
+		return -1.f;
+
+	float score = 0.f;
+	if (cachePosition >= 0) {
+		if (cachePosition < 3)
+			score = LAST_TRIANGLE_SCORE;
+		else
+			score = std::pow(1.f - static_cast<float>(cachePosition - 3) / static_cast<float>(VERTEX_CACHE_SIZE - 3), CACHE_DECAY_POWER);
+	}
+	// vertices with few triangles left are used first, so they don't stay alone at the end
+	return score + VALENCE_BOOST_SCALE * std::pow(static_cast<float>(remainingTriangles), -VALENCE_BOOST_POWER);
+}
+
+void optimizeVertexCache(std::vector<uint32_t> &indices, uint32_t vertexCount) {
+	const uint32_t triangleCount = static_cast<uint32_t>(indices.size() / 3);
+	if (triangleCount == 0)
+		return;
+
+	// triangles of each vertex, the emitted ones are swapped out of the range
+	std::vector<uint32_t> remainingTriangles(vertexCount, 0);
+	for (uint32_t index : indices)
+		++remainingTriangles[index];
+	std::vector<uint32_t> triangleOffsets(vertexCount + 1, 0);
+	for (uint32_t v = 0; v < vertexCount; ++v)
+		triangleOffsets[v + 1] = triangleOffsets[v] + remainingTriangles[v];
+	std::vector<uint32_t> vertexTriangles(indices.size());
+	{
+		std::vector<uint32_t> cursor(triangleOffsets.begin(), triangleOffsets.end() - 1);
+		for (uint32_t i = 0; i < indices.size(); ++i)
+			vertexTriangles[cursor[indices[i]]++] = i / 3;
+	}
+
+	std::vector<int> cachePositions(vertexCount, -1);
+	std::vector<float> vertexScores(vertexCount);
+	for (uint32_t v = 0; v < vertexCount; ++v)
+		vertexScores[v] = vertexCacheScore(-1, remainingTriangles[v]);
+
+	std::vector<float> triangleScores(triangleCount);
+	for (uint32_t t = 0; t < triangleCount; ++t)
+		triangleScores[t] = vertexScores[indices[t * 3]] + vertexScores[indices[t * 3 + 1]] + vertexScores[indices[t * 3 + 2]];
+
+	std::vector<bool> emitted(triangleCount, false);
+	std::vector<uint32_t> optimizedIndices;
+	optimizedIndices.reserve(indices.size());
+	std::vector<uint32_t> cache, newCache;
+	cache.reserve(VERTEX_CACHE_SIZE + 3);
+	newCache.reserve(VERTEX_CACHE_SIZE + 3);
+
+	uint32_t inputCursor = 0;
+	int64_t bestTriangle = std::max_element(triangleScores.begin(), triangleScores.end()) - triangleScores.begin();
+	while (bestTriangle >= 0) {
+		emitted[bestTriangle] = true;
+
+		newCache.clear();
+		for (uint32_t k = 0; k < 3; ++k) {
+			const uint32_t v = indices[bestTriangle * 3 + k];
+			optimizedIndices.push_back(v);
+
+			auto *begin = vertexTriangles.data() + triangleOffsets[v];
+			auto *end = begin + remainingTriangles[v];
+			auto *it = std::find(begin, end, static_cast<uint32_t>(bestTriangle));
+			if (it != end) {
+				std::swap(*it, *(end - 1));
+				--remainingTriangles[v];
+			}
+			if (std::find(newCache.begin(), newCache.end(), v) == newCache.end())
+				newCache.push_back(v);
+		}
+		for (uint32_t v : cache)
+			if (std::find(newCache.begin(), newCache.end(), v) == newCache.end())
+				newCache.push_back(v);
+
+		// new positions and scores, the vertices pushed out of the cache lose their cache score
+		for (uint32_t i = 0; i < newCache.size(); ++i) {
+			const uint32_t v = newCache[i];
+			cachePositions[v] = i < VERTEX_CACHE_SIZE ? static_cast<int>(i) : -1;
+			vertexScores[v] = vertexCacheScore(cachePositions[v], remainingTriangles[v]);
+		}
+		for (uint32_t v : newCache) {
+			for (uint32_t j = 0; j < remainingTriangles[v]; ++j) {
+				const uint32_t t = vertexTriangles[triangleOffsets[v] + j];
+				triangleScores[t] = vertexScores[indices[t * 3]] + vertexScores[indices[t * 3 + 1]] + vertexScores[indices[t * 3 + 2]];
+			}
+		}
+		newCache.resize(std::min<size_t>(newCache.size(), VERTEX_CACHE_SIZE));
+		cache.swap(newCache);
+
+		// the next triangle is the best one using a vertex of the cache
+		bestTriangle = -1;
+		float bestScore = -1.f;
+		for (uint32_t v : cache) {
+			for (uint32_t j = 0; j < remainingTriangles[v]; ++j) {
+				const uint32_t t = vertexTriangles[triangleOffsets[v] + j];
+				if (triangleScores[t] > bestScore) {
+					bestScore = triangleScores[t];
+					bestTriangle = t;
+				}
+			}
+		}
+		// or the next one in the input order when the cache has nothing left
+		if (bestTriangle < 0) {
+			while (inputCursor < triangleCount && emitted[inputCursor])
+				++inputCursor;
+			if (inputCursor < triangleCount)
+				bestTriangle = inputCursor;
+		}
+	}
+
+	indices.swap(optimizedIndices);
+}
+
+// triangles where the FIFO cache restarts, all 3 vertices missed
+static std::vector<uint32_t> clusterHardBoundaries(const std::vector<uint32_t> &indices, uint32_t vertexCount, uint32_t cacheSize) {
+	std::vector<uint32_t> timestamps(vertexCount, 0);
+	uint32_t time = cacheSize + 1;
+	std::vector<uint32_t> boundaries;
+	for (uint32_t t = 0; t < indices.size() / 3; ++t) {
+		uint32_t misses = 0;
+		for (uint32_t k = 0; k < 3; ++k) {
+			const uint32_t index = indices[t * 3 + k];
+			if (time - timestamps[index] > cacheSize) {
+				timestamps[index] = time++;
+				++misses;
+			}
+		}
+		if (t == 0 || misses == 3)
+			boundaries.push_back(t);
+	}
+	return boundaries;
+}
+
+void optimizeOverdraw(primMeshGLTF &prim, float threshold) {
+	const uint32_t triangleCount = static_cast<uint32_t>(prim.indices.size() / 3);
+	const uint32_t vertexCount = static_cast<uint32_t>(prim.vertices.size());
+	if (triangleCount == 0)
+		return;
+	constexpr uint32_t cacheSize = 16;
+
+	// split the hard clusters where their running ACMR stays under the threshold, smaller clusters sort better
+	std::vector<uint32_t> hardBoundaries = clusterHardBoundaries(prim.indices, vertexCount, cacheSize);
+	hardBoundaries.push_back(triangleCount);
+	std::vector<uint32_t> clusters;
+	std::vector<uint32_t> timestamps(vertexCount, 0);
+	uint32_t time = cacheSize + 1;
+	auto triangleMisses = [&](uint32_t t) {
+		uint32_t misses = 0;
+		for (uint32_t k = 0; k < 3; ++k) {
+			const uint32_t index = prim.indices[t * 3 + k];
+			if (time - timestamps[index] > cacheSize) {
+				timestamps[index] = time++;
+				++misses;
+			}
+		}
+		return misses;
+	};
+	for (size_t c = 0; c + 1 < hardBoundaries.size(); ++c) {
+		const uint32_t start = hardBoundaries[c], end = hardBoundaries[c + 1];
+
+		time += cacheSize + 1;
+		uint32_t clusterMisses = 0;
+		for (uint32_t t = start; t < end; ++t)
+			clusterMisses += triangleMisses(t);
+		const float clusterThreshold = threshold * static_cast<float>(clusterMisses) / static_cast<float>(end - start);
+
+		clusters.push_back(start);
+		time += cacheSize + 1;
+		uint32_t misses = 0, size = 0;
+		for (uint32_t t = start; t < end; ++t) {
+			misses += triangleMisses(t);
+			++size;
+			if (t + 1 < end && static_cast<float>(misses) / static_cast<float>(size) <= clusterThreshold) {
+				clusters.push_back(t + 1);
+				time += cacheSize + 1;
+				misses = size = 0;
+			}
+		}
+	}
+	clusters.push_back(triangleCount);
+
+	// area weighted centroid and normal of each cluster
+	const size_t clusterCount = clusters.size() - 1;
+	std::vector<glm::vec3> clusterCentroids(clusterCount, glm::vec3(0)), clusterNormals(clusterCount, glm::vec3(0));
+	glm::vec3 meshCentroid(0);
+	float meshArea = 0.f;
+	for (size_t c = 0; c < clusterCount; ++c) {
+		float clusterArea = 0.f;
+		for (uint32_t t = clusters[c]; t < clusters[c + 1]; ++t) {
+			const glm::vec3 &p0 = prim.vertices[prim.indices[t * 3]].pos;
+			const glm::vec3 &p1 = prim.vertices[prim.indices[t * 3 + 1]].pos;
+			const glm::vec3 &p2 = prim.vertices[prim.indices[t * 3 + 2]].pos;
+			const glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+			const float area = glm::length(normal);
+
+			clusterCentroids[c] += (p0 + p1 + p2) * (area / 3.f);
+			clusterNormals[c] += normal;
+			clusterArea += area;
+		}
+		meshCentroid += clusterCentroids[c];
+		meshArea += clusterArea;
+		clusterCentroids[c] = clusterArea > 0.f ? clusterCentroids[c] / clusterArea : glm::vec3(0);
+		const float normalLength = glm::length(clusterNormals[c]);
+		clusterNormals[c] = normalLength > 0.f ? clusterNormals[c] / normalLength : glm::vec3(0);
+	}
+	meshCentroid = meshArea > 0.f ? meshCentroid / meshArea : glm::vec3(0);
+
+	// clusters facing away from the center occlude the others, draw them first
+	std::vector<float> sortKeys(clusterCount);
+	for (size_t c = 0; c < clusterCount; ++c)
+		sortKeys[c] = glm::dot(clusterCentroids[c] - meshCentroid, clusterNormals[c]);
+	std::vector<uint32_t> order(clusterCount);
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return sortKeys[a] > sortKeys[b]; });
+
+	std::vector<uint32_t> sortedIndices;
+	sortedIndices.reserve(prim.indices.size());
+	for (uint32_t c : order)
+		sortedIndices.insert(sortedIndices.end(), prim.indices.begin() + clusters[c] * 3, prim.indices.begin() + clusters[c + 1] * 3);
+	prim.indices.swap(sortedIndices);
+}
+
+void optimizeVertexFetch(primMeshGLTF &prim) {
+	std::vector<uint32_t> remap(prim.vertices.size(), ~0u);
+	uint32_t nextVertex = 0;
+	for (auto &index : prim.indices) {
+		if (remap[index] == ~0u)
+			remap[index] = nextVertex++;
+		index = remap[index];
+	}
+
+	std::vector<Vertex> orderedVertices(nextVertex);
+	for (size_t v = 0; v < prim.vertices.size(); ++v)
+		if (remap[v] != ~0u)
+			orderedVertices[remap[v]] = prim.vertices[v];
+	prim.vertices.swap(orderedVertices);
+}
+
+// the cone axis is the average triangle normal, the cutoff comes from the normal the farthest from it
+// the culling test is dot(center - camera, axis) >= cutoff * length(center - camera) + radius (all the triangles are back facing)
+static void computeMeshletBounds(const primMeshGLTF &prim, meshletGLTF &meshlet) {
+	auto position = [&](uint32_t localIndex) -> const glm::vec3 & { return prim.vertices[prim.meshletVertices[meshlet.vertexOffset + localIndex]].pos; };
+
+	glm::vec3 minBound = position(0), maxBound = position(0);
+	for (uint32_t i = 1; i < meshlet.vertexCount; ++i) {
+		minBound = glm::min(minBound, position(i));
+		maxBound = glm::max(maxBound, position(i));
+	}
+	const glm::vec3 center = (minBound + maxBound) * 0.5f;
+	float radius = 0.f;
+	for (uint32_t i = 0; i < meshlet.vertexCount; ++i)
+		radius = std::max(radius, glm::length(position(i) - center));
+	meshlet.sphere = glm::vec4(center, radius);
+
+	glm::vec3 normals[MESHLET_MAX_TRIANGLES];
+	uint32_t normalCount = 0;
+	glm::vec3 axis(0);
+	for (uint32_t t = 0; t < meshlet.triangleCount; ++t) {
+		const uint32_t triangle = prim.meshletTriangles[meshlet.triangleOffset + t];
+		const glm::vec3 &p0 = position(triangle & 0xff), &p1 = position((triangle >> 8) & 0xff), &p2 = position((triangle >> 16) & 0xff);
+		const glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+		const float length = glm::length(normal);
+		// degenerated triangles are never rasterized
+		if (length == 0.f)
+			continue;
+		normals[normalCount++] = normal / length;
+		axis += normal / length;
+	}
+
+	meshlet.cone = glm::vec4(0, 0, 0, 1);
+	const float axisLength = glm::length(axis);
+	if (axisLength == 0.f)
+		return;
+	axis /= axisLength;
+	float minDot = 1.f;
+	for (uint32_t i = 0; i < normalCount; ++i)
+		minDot = std::min(minDot, glm::dot(normals[i], axis));
+	// wider than a half space (with some margin), never culled
+	if (minDot <= 0.1f) {
+		meshlet.cone = glm::vec4(axis, 1);
+		return;
+	}
+	meshlet.cone = glm::vec4(axis, std::sqrt(1.f - minDot * minDot));
+}
+
+void buildMeshlets(primMeshGLTF &prim) {
+	prim.meshlets.clear();
+	prim.meshletVertices.clear();
+	prim.meshletTriangles.clear();
+
+	// meshlet vertex index of the prim vertices in the current meshlet, 0xff if not in it
+	std::vector<uint8_t> localIndices(prim.vertices.size(), 0xff);
+	meshletGLTF meshlet{};
+	auto finishMeshlet = [&]() {
+		if (meshlet.triangleCount == 0)
+			return;
+		for (uint32_t i = 0; i < meshlet.vertexCount; ++i)
+			localIndices[prim.meshletVertices[meshlet.vertexOffset + i]] = 0xff;
+		computeMeshletBounds(prim, meshlet);
+		prim.meshlets.push_back(meshlet);
+
+		meshlet = {};
+		meshlet.vertexOffset = static_cast<uint32_t>(prim.meshletVertices.size());
+		meshlet.triangleOffset = static_cast<uint32_t>(prim.meshletTriangles.size());
+	};
+	auto addVertex = [&](uint32_t v) {
+		if (localIndices[v] == 0xff) {
+			localIndices[v] = static_cast<uint8_t>(meshlet.vertexCount++);
+			prim.meshletVertices.push_back(v);
+		}
+		return static_cast<uint32_t>(localIndices[v]);
+	};
+
+	for (size_t t = 0; t + 2 < prim.indices.size(); t += 3) {
+		const uint32_t a = prim.indices[t], b = prim.indices[t + 1], c = prim.indices[t + 2];
+		const uint32_t newVertices = (localIndices[a] == 0xff) + (b != a && localIndices[b] == 0xff) + (c != a && c != b && localIndices[c] == 0xff);
+		if (meshlet.vertexCount + newVertices > MESHLET_MAX_VERTICES || meshlet.triangleCount == MESHLET_MAX_TRIANGLES)
+			finishMeshlet();
+
+		const uint32_t la = addVertex(a), lb = addVertex(b), lc = addVertex(c);
+		prim.meshletTriangles.push_back(la | lb << 8 | lc << 16);
+		++meshlet.triangleCount;
+	}
+	finishMeshlet();
+}
+
+// squared distance to a set of planes weighted by the triangle areas, A is symmetric so only 6 coefficients are kept
+// error(p) = (p.A.p + 2 b.p + c) / weight
+struct Quadric {
+	float a00{0}, a11{0}, a22{0}, a01{0}, a12{0}, a02{0};
+	float b0{0}, b1{0}, b2{0};
+	float c{0};
+	float weight{0};
+
+	void addPlane(const glm::vec3 &n, float d, float w) {
+		a00 += w * n.x * n.x;
+		a11 += w * n.y * n.y;
+		a22 += w * n.z * n.z;
+		a01 += w * n.x * n.y;
+		a12 += w * n.y * n.z;
+		a02 += w * n.x * n.z;
+		b0 += w * n.x * d;
+		b1 += w * n.y * d;
+		b2 += w * n.z * d;
+		c += w * d * d;
+		weight += w;
+	}
+	void add(const Quadric &q) {
+		a00 += q.a00, a11 += q.a11, a22 += q.a22, a01 += q.a01, a12 += q.a12, a02 += q.a02;
+		b0 += q.b0, b1 += q.b1, b2 += q.b2;
+		c += q.c;
+		weight += q.weight;
+	}
+	float error(const glm::vec3 &p) const {
+		const float rx = a00 * p.x + a01 * p.y + a02 * p.z + b0;
+		const float ry = a01 * p.x + a11 * p.y + a12 * p.z + b1;
+		const float rz = a02 * p.x + a12 * p.y + a22 * p.z + b2;
+		const float e = rx * p.x + ry * p.y + rz * p.z + b0 * p.x + b1 * p.y + b2 * p.z + c;
+		return weight > 0.f ? std::max(e, 0.f) / weight : 0.f;
+	}
+};
+
+std::vector<uint32_t> simplifyIndices(const primMeshGLTF &prim, size_t targetIndexCount, float targetError, float &resultError) {
+	resultError = 0.f;
+	std::vector<uint32_t> indices = prim.indices;
+	const uint32_t vertexCount = static_cast<uint32_t>(prim.vertices.size());
+	if (indices.size() <= targetIndexCount || vertexCount == 0)
+		return indices;
+
+	// the error is relative to the prim extent
+	glm::vec3 minBound = prim.vertices[0].pos, maxBound = prim.vertices[0].pos;
+	for (const auto &v : prim.vertices) {
+		minBound = glm::min(minBound, v.pos);
+		maxBound = glm::max(maxBound, v.pos);
+	}
+	const float extent = std::max(std::max(maxBound.x - minBound.x, maxBound.y - minBound.y), maxBound.z - minBound.z);
+	if (extent <= 0.f)
+		return indices;
+	std::vector<glm::vec3> positions(vertexCount);
+	for (uint32_t v = 0; v < vertexCount; ++v)
+		positions[v] = (prim.vertices[v].pos - minBound) / extent;
+
+	// vertices at the same position with different attributes are on a seam (uv, normal), they are locked with the borders
+	std::unordered_map<glm::vec3, uint32_t> firstAtPosition;
+	firstAtPosition.reserve(vertexCount);
+	std::vector<uint32_t> positionIds(vertexCount);
+	std::vector<uint32_t> verticesAtPosition(vertexCount, 0);
+	for (uint32_t v = 0; v < vertexCount; ++v) {
+		positionIds[v] = firstAtPosition.try_emplace(prim.vertices[v].pos, v).first->second;
+		++verticesAtPosition[positionIds[v]];
+	}
+	std::unordered_map<uint64_t, uint32_t> edgeTriangles;
+	edgeTriangles.reserve(indices.size());
+	auto edgeKey = [&](uint32_t a, uint32_t b) {
+		const uint32_t pa = positionIds[a], pb = positionIds[b];
+		return pa < pb ? uint64_t(pa) << 32 | pb : uint64_t(pb) << 32 | pa;
+	};
+	for (size_t t = 0; t < indices.size(); t += 3)
+		for (int e = 0; e < 3; ++e)
+			++edgeTriangles[edgeKey(indices[t + e], indices[t + (e + 1) % 3])];
+	std::vector<uint8_t> lockedPositions(vertexCount, 0);
+	for (uint32_t v = 0; v < vertexCount; ++v)
+		if (verticesAtPosition[positionIds[v]] > 1)
+			lockedPositions[positionIds[v]] = 1;
+	// open or non manifold edges
+	for (const auto &[key, count] : edgeTriangles)
+		if (count != 2)
+			lockedPositions[key >> 32] = lockedPositions[key & 0xffffffff] = 1;
+	auto isLocked = [&](uint32_t v) { return lockedPositions[positionIds[v]] != 0; };
+
+	std::vector<Quadric> quadrics(vertexCount);
+	for (size_t t = 0; t < indices.size(); t += 3) {
+		const glm::vec3 &p0 = positions[indices[t]], &p1 = positions[indices[t + 1]], &p2 = positions[indices[t + 2]];
+		const glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+		const float area = glm::length(normal);
+		if (area == 0.f)
+			continue;
+		const glm::vec3 n = normal / area;
+		for (int i = 0; i < 3; ++i)
+			quadrics[indices[t + i]].addPlane(n, -glm::dot(n, p0), area);
+	}
+
+	struct Collapse {
+		uint32_t from, to;
+		float error;
+	};
+	std::vector<Collapse> collapses;
+	std::vector<uint32_t> remap(vertexCount);
+	std::vector<uint8_t> touched(vertexCount);
+	std::vector<uint32_t> vertexTriangleOffsets(vertexCount + 1), vertexTriangles;
+	const float maxError = targetError * targetError;
+	float collapsedError = 0.f;
+
+	// passes of independent collapses, the cheapest first, until the target or the error bound
+	while (indices.size() > targetIndexCount) {
+		collapses.clear();
+		for (size_t t = 0; t < indices.size(); t += 3)
+			for (int e = 0; e < 3; ++e) {
+				const uint32_t a = indices[t + e], b = indices[t + (e + 1) % 3];
+				if (!isLocked(a))
+					collapses.push_back({a, b, quadrics[a].error(positions[b])});
+				if (!isLocked(b))
+					collapses.push_back({b, a, quadrics[b].error(positions[a])});
+			}
+		std::sort(collapses.begin(), collapses.end(), [](const Collapse &a, const Collapse &b) { return a.error < b.error; });
+
+		std::fill(vertexTriangleOffsets.begin(), vertexTriangleOffsets.end(), 0);
+		for (uint32_t index : indices)
+			++vertexTriangleOffsets[index + 1];
+		for (uint32_t v = 0; v < vertexCount; ++v)
+			vertexTriangleOffsets[v + 1] += vertexTriangleOffsets[v];
+		vertexTriangles.resize(indices.size());
+		{
+			std::vector<uint32_t> fill(vertexTriangleOffsets.begin(), vertexTriangleOffsets.end() - 1);
+			for (size_t i = 0; i < indices.size(); ++i)
+				vertexTriangles[fill[indices[i]]++] = static_cast<uint32_t>(i / 3);
+		}
+
+		std::iota(remap.begin(), remap.end(), 0);
+		std::fill(touched.begin(), touched.end(), 0);
+		size_t indexCount = indices.size();
+		bool collapsed = false;
+		for (const auto &collapse : collapses) {
+			if (collapse.error > maxError || indexCount <= targetIndexCount)
+				break;
+			const uint32_t u = collapse.from, v = collapse.to;
+			if (touched[u] || touched[v])
+				continue;
+
+			// the triangles around u must not flip once u is moved on v
+			bool flips = false;
+			uint32_t removedTriangles = 0;
+			for (uint32_t i = vertexTriangleOffsets[u]; i < vertexTriangleOffsets[u + 1] && !flips; ++i) {
+				const uint32_t *triangle = &indices[vertexTriangles[i] * 3];
+				if (triangle[0] == v || triangle[1] == v || triangle[2] == v) {
+					++removedTriangles;
+					continue;
+				}
+				glm::vec3 p[3] = {positions[triangle[0]], positions[triangle[1]], positions[triangle[2]]};
+				const glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+				for (int k = 0; k < 3; ++k)
+					if (triangle[k] == u)
+						p[k] = positions[v];
+				const glm::vec3 after = glm::cross(p[1] - p[0], p[2] - p[0]);
+				flips = glm::dot(before, after) <= 0.f;
+			}
+			if (flips)
+				continue;
+
+			// the neighbourhood of u changes, it waits for the next pass
+			for (uint32_t i = vertexTriangleOffsets[u]; i < vertexTriangleOffsets[u + 1]; ++i)
+				for (int k = 0; k < 3; ++k)
+					touched[indices[vertexTriangles[i] * 3 + k]] = 1;
+			remap[u] = v;
+			quadrics[v].add(quadrics[u]);
+			indexCount -= removedTriangles * 3;
+			collapsedError = std::max(collapsedError, collapse.error);
+			collapsed = true;
+		}
+		if (!collapsed)
+			break;
+
+		size_t write = 0;
+		for (size_t t = 0; t < indices.size(); t += 3) {
+			const uint32_t a = remap[indices[t]], b = remap[indices[t + 1]], c = remap[indices[t + 2]];
+			if (a == b || b == c || a == c)
+				continue;
+			indices[write++] = a;
+			indices[write++] = b;
+			indices[write++] = c;
+		}
+		indices.resize(write);
+	}
+
+	resultError = std::sqrt(collapsedError);
+	return indices;
+}
+
+void buildPrimLods(primMeshGLTF &prim) {
+	prim.lodIndices.clear();
+	prim.lodCount = 1;
+	prim.lods[0].indexCount = static_cast<uint32_t>(prim.indices.size());
+	prim.lods[0].error = 0.f;
+
+	// each level halves the triangles of the previous one, the chain stops when the simplification is blocked
+	size_t previousIndexCount = prim.indices.size();
+	while (prim.lodCount < MAX_PRIM_LODS && previousIndexCount / 2 >= LOD_MIN_TRIANGLES * 3) {
+		const size_t targetIndexCount = previousIndexCount / 2 / 3 * 3;
+		float error = 0.f;
+		auto indices = simplifyIndices(prim, targetIndexCount, LOD_MAX_ERROR, error);
+		if (indices.empty() || indices.size() > previousIndexCount * 9 / 10)
+			break;
+		optimizeVertexCache(indices, static_cast<uint32_t>(prim.vertices.size()));
+
+		auto &lod = prim.lods[prim.lodCount++];
+		lod.indexCount = static_cast<uint32_t>(indices.size());
+		lod.error = error;
+		previousIndexCount = indices.size();
+		prim.lodIndices.push_back(std::move(indices));
+	}
+}
+
+MeshOptimizerStats optimizePrimGeometry(primMeshGLTF &prim) {
+	MeshOptimizerStats stats{};
+	stats.verticesBefore = stats.verticesAfter = static_cast<uint32_t>(prim.vertices.size());
+	stats.triangleCount = static_cast<uint32_t>(prim.indices.size() / 3);
+	// leave broken prims as they are
+	if (stats.triangleCount == 0 || prim.indices.size() % 3 ||
+	    std::any_of(prim.indices.begin(), prim.indices.end(), [&](uint32_t index) { return index >= stats.verticesBefore; }))
+		return stats;
+	stats.acmrBefore = computeACMR(prim.indices, stats.verticesBefore);
+
+	weldVertices(prim);
+	optimizeVertexCache(prim.indices, static_cast<uint32_t>(prim.vertices.size()));
+	optimizeOverdraw(prim);
+	optimizeVertexFetch(prim);
+
+	stats.verticesAfter = static_cast<uint32_t>(prim.vertices.size());
+	stats.acmrAfter = computeACMR(prim.indices, stats.verticesAfter);
+	return stats;
+}
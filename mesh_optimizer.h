@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct primMeshGLTF;
+
+// Import time processing of the prims geometry, everything is done in place on primMeshGLTF::vertices/indices
+// the index order is tuned for the post transform vertex cache, then for the overdraw, the vertex order for the fetch
+
+// average cache miss per triangle for a FIFO cache, 0.5 is the best case for a regular grid, 3 the worst
+float computeACMR(const std::vector<uint32_t> &indices, uint32_t vertexCount, uint32_t cacheSize = 16);
+
+// merge the vertices with the same attributes, the unused ones are dropped
+void weldVertices(primMeshGLTF &prim);
+// reorder the triangles to reuse the vertices still in the cache (Forsyth, linear speed vertex cache optimisation)
+void optimizeVertexCache(std::vector<uint32_t> &indices, uint32_t vertexCount);
+// split the cache optimized triangles in clusters and draw the clusters facing outside first
+// threshold is the ACMR degradation allowed to make smaller clusters (1.05 is 5%)
+void optimizeOverdraw(primMeshGLTF &prim, float threshold = 1.05f);
+// renumber the vertices in the order of their first use by the indices
+void optimizeVertexFetch(primMeshGLTF &prim);
+// split the triangles in meshlets in their current order, with the bounding sphere and the normal cone of each meshlet
+void buildMeshlets(primMeshGLTF &prim);
+
+// edge collapse simplification driven by quadric errors, the seam and border vertices never move so the uv charts keep their outline
+// stops at targetIndexCount or when the next collapse would exceed targetError (relative to the prim extent), resultError is the error reached
+std::vector<uint32_t> simplifyIndices(const primMeshGLTF &prim, size_t targetIndexCount, float targetError, float &resultError);
+// levels of detail in primMeshGLTF::lodIndices, about half the triangles of the previous level each, sharing the prim vertices
+void buildPrimLods(primMeshGLTF &prim);
+
+struct MeshOptimizerStats {
+	uint32_t verticesBefore{0}, verticesAfter{0};
+	uint32_t triangleCount{0};
+	float acmrBefore{0}, acmrAfter{0};
+};
+
+// all the above, in order
+MeshOptimizerStats optimizePrimGeometry(primMeshGLTF &prim);
@@ -10,6 +10,7 @@
 #include "core_utils.h"
 #include "vertex_config.h"
 #include "texture.h"
+#include "upload_engine.h"
 #include "VulkanBuffer.h"
 
 #define GLM_FORCE_RADIANS
@@ -49,56 +50,23 @@ static std::vector<char> readFile(const std::string &filename) {
 	//return buffer;
 }
 
-void createVertexBuffer(const std::vector<Vertex> &vertices, VkBuffer &vertexBuffer, VkDeviceMemory &vertexBufferMemory) {
-	const VkDeviceSize bufferSize = sizeof(vertices[0]) * vertices.size();
-
-	VkBuffer stagingBuffer;
-	VkDeviceMemory stagingBufferMemory;
-	createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-	             VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer,
-	             stagingBufferMemory);
-
-
-	// fill the vertex buffer
-	void *data;
-	vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-	memcpy(data, vertices.data(), (size_t)bufferSize);
-	vkUnmapMemory(device, stagingBufferMemory);
-
+void createVertexBuffer(const void *vertices, VkDeviceSize bufferSize, VkBuffer &vertexBuffer, VkDeviceMemory &vertexBufferMemory) {
 	createBuffer(bufferSize,
 	             VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR |
 	             VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
 	             vertexBuffer, vertexBufferMemory);
 
-	copyBuffer(stagingBuffer, vertexBuffer, bufferSize);
-
-	vkDestroyBuffer(device, stagingBuffer, nullptr);
-	vkFreeMemory(device, stagingBufferMemory, nullptr);
+	// read by the vertex input, the shaders and the BLAS builds
+	uploadBuffer(vertices, bufferSize, vertexBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_ACCESS_MEMORY_READ_BIT);
 }
 
-void createIndexBuffer(const std::vector<uint32_t> &indices, VkBuffer &indexBuffer, VkDeviceMemory &indexBufferMemory) {
-	const VkDeviceSize bufferSize = sizeof(indices[0]) * indices.size();
-
-	VkBuffer stagingBuffer;
-	VkDeviceMemory stagingBufferMemory;
-	createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-	             VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer,
-	             stagingBufferMemory);
-
-	void *data;
-	vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-	memcpy(data, indices.data(), (size_t)bufferSize);
-	vkUnmapMemory(device, stagingBufferMemory);
-
+void createIndexBuffer(const void *indices, VkDeviceSize bufferSize, VkBuffer &indexBuffer, VkDeviceMemory &indexBufferMemory) {
 	createBuffer(bufferSize,
 	             VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR |
 	             VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
 	             VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indexBuffer, indexBufferMemory);
 
-	copyBuffer(stagingBuffer, indexBuffer, bufferSize);
-
-	vkDestroyBuffer(device, stagingBuffer, nullptr);
-	vkFreeMemory(device, stagingBufferMemory, nullptr);
+	uploadBuffer(indices, bufferSize, indexBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_ACCESS_MEMORY_READ_BIT);
 }
 
 VkShaderModule createShaderModule(const std::vector<char> &code) {
@@ -289,6 +257,8 @@ void createDescriptorSetLayoutMotionVector(VkDescriptorSetLayout &descriptorSetL
 	uboLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
 	uboLayoutBinding.descriptorCount = 1;
 	uboLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+	if (USE_MESH_SHADER)
+		uboLayoutBinding.stageFlags |= VK_SHADER_STAGE_TASK_BIT_EXT | VK_SHADER_STAGE_MESH_BIT_EXT;
 	uboLayoutBinding.pImmutableSamplers = nullptr; // Optional
 
 
@@ -368,17 +338,17 @@ VkPipelineShaderStageCreateInfo loadShader(const std::string &fileName, VkShader
 	return vertShaderStageInfo;
 }
 
-void createGraphicsPipeline(const std::string &vertexPath,
-                            const std::string &fragPath,
-                            VkPipelineLayout &pipelineLayout,
-                            VkPipeline &graphicsPipeline,
-                            const VkRenderPass &renderPass,
-                            const VkSampleCountFlagBits &msaaSamples,
-                            const VkDescriptorSetLayout &descriptorSetLayout,
-                            const float &alphaMask) {
-	// vertex/Frag shader	
-	VkPipelineShaderStageCreateInfo shaderStages[] = {loadShader(vertexPath, VK_SHADER_STAGE_VERTEX_BIT), loadShader(fragPath, VK_SHADER_STAGE_FRAGMENT_BIT)};
-
+// fixed function states shared by the vertex and the mesh shader pipelines, the mesh shaders have no vertex input/input assembly
+static void createPipeline(const std::vector<VkPipelineShaderStageCreateInfo> &shaderStages,
+                           const VkPipelineVertexInputStateCreateInfo *vertexInputInfo,
+                           const VkPipelineInputAssemblyStateCreateInfo *inputAssembly,
+                           const std::vector<VkPushConstantRange> &pushConstantRanges,
+                           VkPipelineLayout &pipelineLayout,
+                           VkPipeline &graphicsPipeline,
+                           const VkRenderPass &renderPass,
+                           const VkSampleCountFlagBits &msaaSamples,
+                           const VkDescriptorSetLayout &descriptorSetLayout,
+                           const float &alphaMask) {
 	// dynamic states
 	std::vector<VkDynamicState> dynamicStates = {VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR};
 
@@ -387,22 +357,6 @@ void createGraphicsPipeline(const std::string &vertexPath,
 	dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
 	dynamicState.pDynamicStates = dynamicStates.data();
 
-	auto bindingDescription = Vertex::getBindingDescription();
-	auto attributeDescriptions = Vertex::getAttributeDescriptions();
-
-	// vertex
-	VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
-	vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-	vertexInputInfo.vertexBindingDescriptionCount = 1;
-	vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(attributeDescriptions.size());
-	vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
-	vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions.data();
-
-	VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
-	inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-	inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-	inputAssembly.primitiveRestartEnable = VK_FALSE;
-
 	VkPipelineViewportStateCreateInfo viewportState{};
 	viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
 	viewportState.viewportCount = 1;
@@ -465,14 +419,8 @@ void createGraphicsPipeline(const std::string &vertexPath,
 	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
 	pipelineLayoutInfo.setLayoutCount = 1;
 	pipelineLayoutInfo.pSetLayouts = &descriptorSetLayout;
-#ifdef DRAW_RASTERIZE
-	VkPushConstantRange pushConstantRange{};
-	pushConstantRange.size = sizeof(uint32_t);
-	pushConstantRange.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
-	pushConstantRange.offset = 0;
-	pipelineLayoutInfo.pushConstantRangeCount = 1;
-	pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
-#endif
+	pipelineLayoutInfo.pushConstantRangeCount = static_cast<uint32_t>(pushConstantRanges.size());
+	pipelineLayoutInfo.pPushConstantRanges = pushConstantRanges.data();
 
 	if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS) {
 		throw std::runtime_error("failed to create pipeline layout!");
@@ -480,10 +428,10 @@ void createGraphicsPipeline(const std::string &vertexPath,
 
 	VkGraphicsPipelineCreateInfo pipelineInfo{};
 	pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-	pipelineInfo.stageCount = 2;
-	pipelineInfo.pStages = shaderStages;
-	pipelineInfo.pVertexInputState = &vertexInputInfo;
-	pipelineInfo.pInputAssemblyState = &inputAssembly;
+	pipelineInfo.stageCount = static_cast<uint32_t>(shaderStages.size());
+	pipelineInfo.pStages = shaderStages.data();
+	pipelineInfo.pVertexInputState = vertexInputInfo;
+	pipelineInfo.pInputAssemblyState = inputAssembly;
 	pipelineInfo.pViewportState = &viewportState;
 	pipelineInfo.pRasterizationState = &rasterizer;
 	pipelineInfo.pMultisampleState = &multisampling;
@@ -500,8 +448,92 @@ void createGraphicsPipeline(const std::string &vertexPath,
 		throw std::runtime_error("failed to create graphics pipeline!");
 	}
 
-	vkDestroyShaderModule(device, shaderStages[0].module, nullptr);
-	vkDestroyShaderModule(device, shaderStages[1].module, nullptr);
+	for (const auto &shaderStage : shaderStages)
+		vkDestroyShaderModule(device, shaderStage.module, nullptr);
+}
+
+void createGraphicsPipeline(const std::string &vertexPath,
+                            const std::string &fragPath,
+                            VkPipelineLayout &pipelineLayout,
+                            VkPipeline &graphicsPipeline,
+                            const VkRenderPass &renderPass,
+                            const VkSampleCountFlagBits &msaaSamples,
+                            const VkDescriptorSetLayout &descriptorSetLayout,
+                            const float &alphaMask) {
+	// vertex/Frag shader	
+	std::vector<VkPipelineShaderStageCreateInfo> shaderStages = {loadShader(vertexPath, VK_SHADER_STAGE_VERTEX_BIT), loadShader(fragPath, VK_SHADER_STAGE_FRAGMENT_BIT)};
+
+	// per vertex and per instance inputs
+	std::array<VkVertexInputBindingDescription, 2> bindingDescriptions = {PackedVertex::getBindingDescription(), InstanceData::getBindingDescription()};
+	std::vector<VkVertexInputAttributeDescription> attributeDescriptions;
+	for (const auto &attribute : PackedVertex::getAttributeDescriptions())
+		attributeDescriptions.push_back(attribute);
+	for (const auto &attribute : InstanceData::getAttributeDescriptions())
+		attributeDescriptions.push_back(attribute);
+
+	// vertex
+	VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
+	vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+	vertexInputInfo.vertexBindingDescriptionCount = static_cast<uint32_t>(bindingDescriptions.size());
+	vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(attributeDescriptions.size());
+	vertexInputInfo.pVertexBindingDescriptions = bindingDescriptions.data();
+	vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions.data();
+
+	VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
+	inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+	inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+	inputAssembly.primitiveRestartEnable = VK_FALSE;
+
+	// the material is per instance
+	createPipeline(shaderStages, &vertexInputInfo, &inputAssembly, {}, pipelineLayout, graphicsPipeline, renderPass, msaaSamples, descriptorSetLayout, alphaMask);
+}
+
+void createMeshShaderPipeline(const std::string &taskPath,
+                              const std::string &meshPath,
+                              const std::string &fragPath,
+                              VkPipelineLayout &pipelineLayout,
+                              VkPipeline &graphicsPipeline,
+                              const VkRenderPass &renderPass,
+                              const VkSampleCountFlagBits &msaaSamples,
+                              const VkDescriptorSetLayout &descriptorSetLayout,
+                              const float &alphaMask) {
+	std::vector<VkPipelineShaderStageCreateInfo> shaderStages = {loadShader(taskPath, VK_SHADER_STAGE_TASK_BIT_EXT), loadShader(meshPath, VK_SHADER_STAGE_MESH_BIT_EXT),
+	                                                             loadShader(fragPath, VK_SHADER_STAGE_FRAGMENT_BIT)};
+
+	// the geometry is read from the scene buffers through the device addresses of the push constants
+	VkPushConstantRange pushConstantRange{};
+	pushConstantRange.size = sizeof(MeshletPushConstants);
+	pushConstantRange.stageFlags = VK_SHADER_STAGE_TASK_BIT_EXT | VK_SHADER_STAGE_MESH_BIT_EXT;
+	pushConstantRange.offset = 0;
+
+	createPipeline(shaderStages, nullptr, nullptr, {pushConstantRange}, pipelineLayout, graphicsPipeline, renderPass, msaaSamples, descriptorSetLayout, alphaMask);
+}
+
+void createIndirectGraphicsPipeline(const std::string &vertexPath,
+                                    const std::string &fragPath,
+                                    VkPipelineLayout &pipelineLayout,
+                                    VkPipeline &graphicsPipeline,
+                                    const VkRenderPass &renderPass,
+                                    const VkSampleCountFlagBits &msaaSamples,
+                                    const VkDescriptorSetLayout &descriptorSetLayout,
+                                    const float &alphaMask) {
+	std::vector<VkPipelineShaderStageCreateInfo> shaderStages = {loadShader(vertexPath, VK_SHADER_STAGE_VERTEX_BIT), loadShader(fragPath, VK_SHADER_STAGE_FRAGMENT_BIT)};
+
+	VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
+	vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+
+	VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
+	inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+	inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+	inputAssembly.primitiveRestartEnable = VK_FALSE;
+
+	VkPushConstantRange pushConstantRange{};
+	pushConstantRange.size = sizeof(IndirectPushConstants);
+	pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+	pushConstantRange.offset = 0;
+
+	createPipeline(shaderStages, &vertexInputInfo, &inputAssembly, {pushConstantRange}, pipelineLayout, graphicsPipeline, renderPass, msaaSamples, descriptorSetLayout,
+	               alphaMask);
 }
 
 VkFormat findSupportedFormat(const std::vector<VkFormat> &candidates, VkImageTiling tiling, VkFormatFeatureFlags features) {
@@ -539,7 +571,8 @@ void createRenderPass(VkRenderPass &renderPass, const VkFormat &colorImageFormat
 	depthAttachment.format = depthImageFormat;
 	depthAttachment.samples = msaaSamples;
 	depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-	depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+	// read after the pass by the depth pyramid and dlss
+	depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
 	depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
 	depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
 	depthAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
@@ -616,41 +649,78 @@ void createUniformBuffers(
 		             VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, uniformBuffers[i],
 		             uniformBuffersMemory[i]);
 
-		vkMapMemory(device, uniformBuffersMemory[i], 0, bufferSize, 0, &uniformBuffersMapped[i]);
+		uniformBuffersMapped[i] = getMappedPointer(uniformBuffers[i]);
+	}
+}
+
+void createInstanceBuffers(std::vector<VkBuffer> &instanceBuffers, std::vector<VkDeviceMemory> &instanceBuffersMemory, std::vector<void *> &instanceBuffersMapped, VkDeviceSize bufferSize) {
+	instanceBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+	instanceBuffersMemory.resize(MAX_FRAMES_IN_FLIGHT);
+	instanceBuffersMapped.resize(MAX_FRAMES_IN_FLIGHT);
+
+	for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+		// also read by the mesh shaders through its device address
+		createBuffer(bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+		             VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, instanceBuffers[i],
+		             instanceBuffersMemory[i]);
+
+		instanceBuffersMapped[i] = getMappedPointer(instanceBuffers[i]);
+	}
+}
+
+void createIndirectBuffers(std::vector<VkBuffer> &indirectBuffers, std::vector<VkDeviceMemory> &indirectBuffersMemory, std::vector<void *> &indirectBuffersMapped, VkDeviceSize bufferSize) {
+	indirectBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+	indirectBuffersMemory.resize(MAX_FRAMES_IN_FLIGHT);
+	indirectBuffersMapped.resize(MAX_FRAMES_IN_FLIGHT);
+
+	for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+		// also written by the culling through its device address
+		createBuffer(bufferSize, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+		             VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, indirectBuffers[i], indirectBuffersMemory[i]);
+
+		indirectBuffersMapped[i] = getMappedPointer(indirectBuffers[i]);
 	}
 }
 
-void updateUniformBuffer(uint32_t currentFrame, const objectGLTF &obj, const glm::mat4 &parent_world) {
+// the model matrices are per instance, the uniform buffer only has the camera
+void updateUniformBuffer(uint32_t currentFrame, const objectGLTF &obj) {
 	
 	//
 	UniformBufferObject ubo{};
-	ubo.proj = glm::perspective(glm::radians(45.0f), swapChainExtent.width / (float)swapChainExtent.height, 0.001f, 10000.f);
+	ubo.proj = glm::perspective(glm::radians(CAMERA_FOV), swapChainExtent.width / (float)swapChainExtent.height, 0.001f, 10000.f);
 	ubo.proj[1][1] *= -1;
 
-	ubo.model = obj.world * parent_world;
 	ubo.view = camWorld;
 	ubo.invView = glm::inverse(ubo.view);
 
 	memcpy(obj.uniformBuffersMapped[currentFrame], &ubo, sizeof(ubo));
 }
 
-void updateUniformBufferMotionVector(uint32_t currentFrame, objectGLTF &obj, const glm::mat4 &parent_world) {
+void updateUniformBufferMotionVector(uint32_t currentFrame, const objectGLTF &obj) {
 	UniformBufferObjectMotionVector ubo{};
 
 	auto JitterMatrix = glm::mat4(1);
 	JitterMatrix = glm::translate(JitterMatrix, glm::vec3(jitterCam.x, jitterCam.y, 0.0f));
-
-	auto proj = glm::perspective(glm::radians(45.0f), swapChainExtent.width / (float)swapChainExtent.height, 0.001f, 10000.f);
-	proj[1][1] *= -1;
-
-	ubo.modelViewProjectionMat = proj * camWorld * obj.world * parent_world;
-	ubo.prevModelViewProjectionMat = obj.PrevModelViewProjectionMat;
 	ubo.jitterMat = JitterMatrix;
-	obj.PrevModelViewProjectionMat = ubo.modelViewProjectionMat;
 
 	memcpy(obj.uniformBuffersMapped[currentFrame], &ubo, sizeof(ubo));
 }
 
+void updateInstanceData(InstanceData &instance, objectGLTF &obj, const glm::mat4 &world) {
+	instance.material = obj.mat;
+#ifdef DRAW_RASTERIZE
+	instance.transform = world;
+	instance.prevTransform = world;
+#else
+	auto proj = glm::perspective(glm::radians(CAMERA_FOV), swapChainExtent.width / (float)swapChainExtent.height, 0.001f, 10000.f);
+	proj[1][1] *= -1;
+
+	instance.transform = proj * camWorld * world;
+	instance.prevTransform = obj.PrevModelViewProjectionMat;
+	obj.PrevModelViewProjectionMat = instance.transform;
+#endif
+}
+
 void createUniformParamsBuffers(VkDeviceSize bufferSize, std::vector<VkBuffer> &uniformParamsBuffers, std::vector<VkDeviceMemory> &uniformParamsBuffersMemory, std::vector<void *> &uniformParamsBuffersMapped) {
 	uniformParamsBuffers.resize(MAX_FRAMES_IN_FLIGHT);
 	uniformParamsBuffersMemory.resize(MAX_FRAMES_IN_FLIGHT);
@@ -660,7 +730,7 @@ void createUniformParamsBuffers(VkDeviceSize bufferSize, std::vector<VkBuffer> &
 		createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, uniformParamsBuffers[i],
 		             uniformParamsBuffersMemory[i]);
 
-		vkMapMemory(device, uniformParamsBuffersMemory[i], 0, bufferSize, 0, &uniformParamsBuffersMapped[i]);
+		uniformParamsBuffersMapped[i] = getMappedPointer(uniformParamsBuffers[i]);
 	}
 }
 
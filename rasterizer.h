@@ -7,11 +7,11 @@
 
 #include "loaderGltf.h"
 #include "VulkanBuffer.h"
+#include "vertex_config.h"
 
 struct UBOParams;
 struct StorageImage;
 struct matGLTF;
-struct Vertex;
 
 VkPipelineShaderStageCreateInfo loadShader(const std::string &fileName, VkShaderStageFlagBits stage);
 
@@ -25,9 +25,31 @@ void createGraphicsPipeline(const std::string &vertexPath,
                             const VkSampleCountFlagBits &msaaSamples,
                             const VkDescriptorSetLayout &descriptorSetLayout,
                             const float &alphaMask);
+// same fixed function states as createGraphicsPipeline, the geometry comes from the task/mesh shaders
+void createMeshShaderPipeline(const std::string &taskPath,
+                              const std::string &meshPath,
+                              const std::string &fragPath,
+                              VkPipelineLayout &pipelineLayout,
+                              VkPipeline &graphicsPipeline,
+                              const VkRenderPass &renderPass,
+                              const VkSampleCountFlagBits &msaaSamples,
+                              const VkDescriptorSetLayout &descriptorSetLayout,
+                              const float &alphaMask);
+// same fixed function states as createGraphicsPipeline without vertex input, the vertex shader fetches the vertices and the instances (IndirectPushConstants)
+void createIndirectGraphicsPipeline(const std::string &vertexPath,
+                                    const std::string &fragPath,
+                                    VkPipelineLayout &pipelineLayout,
+                                    VkPipeline &graphicsPipeline,
+                                    const VkRenderPass &renderPass,
+                                    const VkSampleCountFlagBits &msaaSamples,
+                                    const VkDescriptorSetLayout &descriptorSetLayout,
+                                    const float &alphaMask);
 
-void createVertexBuffer(const std::vector<Vertex> &vertices, VkBuffer &vertexBuffer, VkDeviceMemory &vertexBufferMemory);
-void createIndexBuffer(const std::vector<uint32_t> &indices, VkBuffer &indexBuffer, VkDeviceMemory &indexBufferMemory);
+// through the upload engine, usable after waitUploads
+// vertices is an array of PackedVertex
+void createVertexBuffer(const void *vertices, VkDeviceSize bufferSize, VkBuffer &vertexBuffer, VkDeviceMemory &vertexBufferMemory);
+// raw index bytes, may mix 16 and 32 bits ranges
+void createIndexBuffer(const void *indices, VkDeviceSize bufferSize, VkBuffer &indexBuffer, VkDeviceMemory &indexBufferMemory);
 
 void createUniformBuffers(std::vector<VkBuffer> &uniformBuffers,
                           std::vector<VkDeviceMemory> &uniformBuffersMemory,
@@ -55,6 +77,12 @@ void createFramebuffers(const VkRenderPass &renderPass, std::vector<VkFramebuffe
 VkFormat findDepthFormat();
 void createRenderPass(VkRenderPass &renderPass, const VkFormat &colorImageFormat, const VkFormat &depthImageFormat, VkSampleCountFlagBits msaaSamples = VK_SAMPLE_COUNT_1_BIT);
 
-void updateUniformBuffer(uint32_t currentFrame, const objectGLTF &obj, const glm::mat4 &parent_world);
-void updateUniformBufferMotionVector(uint32_t currentFrame, objectGLTF &obj, const glm::mat4 &parent_world);
+// one instance buffer per frame in flight, persistently mapped
+void createInstanceBuffers(std::vector<VkBuffer> &instanceBuffers, std::vector<VkDeviceMemory> &instanceBuffersMemory, std::vector<void *> &instanceBuffersMapped, VkDeviceSize bufferSize);
+// one buffer of draw counts and VkDrawIndexedIndirectCommand per frame in flight, persistently mapped
+void createIndirectBuffers(std::vector<VkBuffer> &indirectBuffers, std::vector<VkDeviceMemory> &indirectBuffersMemory, std::vector<void *> &indirectBuffersMapped, VkDeviceSize bufferSize);
+
+void updateUniformBuffer(uint32_t currentFrame, const objectGLTF &obj);
+void updateUniformBufferMotionVector(uint32_t currentFrame, const objectGLTF &obj);
+void updateInstanceData(InstanceData &instance, objectGLTF &obj, const glm::mat4 &world);
 void updateUniformParamsBuffer(UBOParams &uboParams, std::vector<void *> &uniformParamsBuffersMapped, uint32_t currentFrame);
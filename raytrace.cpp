@@ -1,5 +1,6 @@
 #include "raytrace.h"
 
+#include <algorithm>
 #include <chrono>
 #include <map>
 
@@ -8,12 +9,15 @@
 #include "VulkanBuffer.h"
 
 #include <fmt/core.h>
+#include <spdlog/spdlog.h>
 
 #include "camera.h"
 #include "rasterizer.h"
 #include "scene.h"
 
 namespace vulkanite_raytrace {
+bool COMPACT_BLAS = true;
+
 // Function pointers for ray tracing related stuff
 PFN_vkGetBufferDeviceAddressKHR vkGetBufferDeviceAddressKHR;
 PFN_vkCreateAccelerationStructureKHR vkCreateAccelerationStructureKHR;
@@ -22,6 +26,8 @@ PFN_vkGetAccelerationStructureBuildSizesKHR vkGetAccelerationStructureBuildSizes
 PFN_vkGetAccelerationStructureDeviceAddressKHR vkGetAccelerationStructureDeviceAddressKHR;
 PFN_vkBuildAccelerationStructuresKHR vkBuildAccelerationStructuresKHR;
 PFN_vkCmdBuildAccelerationStructuresKHR vkCmdBuildAccelerationStructuresKHR;
+PFN_vkCmdWriteAccelerationStructuresPropertiesKHR vkCmdWriteAccelerationStructuresPropertiesKHR;
+PFN_vkCmdCopyAccelerationStructureKHR vkCmdCopyAccelerationStructureKHR;
 PFN_vkCmdTraceRaysKHR vkCmdTraceRaysKHR;
 PFN_vkGetRayTracingShaderGroupHandlesKHR vkGetRayTracingShaderGroupHandlesKHR;
 PFN_vkCreateRayTracingPipelinesKHR vkCreateRayTracingPipelinesKHR;
@@ -30,6 +36,8 @@ void InitRaytrace() {
 	// Get the function pointers required for ray tracing
 	vkGetBufferDeviceAddressKHR = reinterpret_cast<PFN_vkGetBufferDeviceAddressKHR>(vkGetDeviceProcAddr(device, "vkGetBufferDeviceAddressKHR"));
 	vkCmdBuildAccelerationStructuresKHR = reinterpret_cast<PFN_vkCmdBuildAccelerationStructuresKHR>(vkGetDeviceProcAddr(device, "vkCmdBuildAccelerationStructuresKHR"));
+	vkCmdWriteAccelerationStructuresPropertiesKHR = reinterpret_cast<PFN_vkCmdWriteAccelerationStructuresPropertiesKHR>(vkGetDeviceProcAddr(device, "vkCmdWriteAccelerationStructuresPropertiesKHR"));
+	vkCmdCopyAccelerationStructureKHR = reinterpret_cast<PFN_vkCmdCopyAccelerationStructureKHR>(vkGetDeviceProcAddr(device, "vkCmdCopyAccelerationStructureKHR"));
 	vkBuildAccelerationStructuresKHR = reinterpret_cast<PFN_vkBuildAccelerationStructuresKHR>(vkGetDeviceProcAddr(device, "vkBuildAccelerationStructuresKHR"));
 	vkCreateAccelerationStructureKHR = reinterpret_cast<PFN_vkCreateAccelerationStructureKHR>(vkGetDeviceProcAddr(device, "vkCreateAccelerationStructureKHR"));
 	vkDestroyAccelerationStructureKHR = reinterpret_cast<PFN_vkDestroyAccelerationStructureKHR>(vkGetDeviceProcAddr(device, "vkDestroyAccelerationStructureKHR"));
@@ -51,7 +59,7 @@ uint64_t getBufferDeviceAddress(VkBuffer buffer) {
 
 // Holds information for a ray tracing scratch buffer that is used as a temporary storage
 struct ScratchBuffer {
-	uint64_t deviceAddress = 0;
+	uint64_t deviceAddress = 0; // aligned on minAccelerationStructureScratchOffsetAlignment
 	VkBuffer handle = VK_NULL_HANDLE;
 	VkDeviceMemory memory = VK_NULL_HANDLE;
 };
@@ -72,6 +80,8 @@ public:
 
 std::map<uint32_t, AccelerationStructure> bottomLevelAS;
 std::vector<VkAccelerationStructureInstanceKHR> instances;
+// offset prim of the level of detail of each instance, the closest hit shader reads it with gl_InstanceID
+std::vector<uint32_t> instanceOffsetPrims;
 AccelerationStructure topLevelAS{};
 
 // Descriptor set pool
@@ -102,39 +112,29 @@ struct UniformData {
 
 Buffer ubo;
 
-ScratchBuffer createScratchBuffer(VkDeviceSize size) {
+// the load time scratch is transient (Linear pool), the one kept for the per frame updates is not (FreeList pool)
+ScratchBuffer createScratchBuffer(VkDeviceSize size, MemoryPoolType poolType) {
 	ScratchBuffer scratchBuffer{};
+	// the buffer is only aligned on its memory requirement, keep room to align the base address
+	const VkDeviceSize scratchAlignment = std::max<VkDeviceSize>(accelerationStructureProperties.minAccelerationStructureScratchOffsetAlignment, 1);
 	// Buffer and memory
 	VkBufferCreateInfo bufferCreateInfo{};
 	bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-	bufferCreateInfo.size = size;
+	bufferCreateInfo.size = size + scratchAlignment;
 	bufferCreateInfo.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
 	VK_CHECK_RESULT(vkCreateBuffer(device, &bufferCreateInfo, nullptr, &scratchBuffer.handle));
-	VkMemoryRequirements memoryRequirements{};
-	vkGetBufferMemoryRequirements(device, scratchBuffer.handle, &memoryRequirements);
-	VkMemoryAllocateFlagsInfo memoryAllocateFlagsInfo{};
-	memoryAllocateFlagsInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
-	memoryAllocateFlagsInfo.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT_KHR;
-	VkMemoryAllocateInfo memoryAllocateInfo = {};
-	memoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	memoryAllocateInfo.pNext = &memoryAllocateFlagsInfo;
-	memoryAllocateInfo.allocationSize = memoryRequirements.size;
-	memoryAllocateInfo.memoryTypeIndex = findMemoryType(memoryRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-	VK_CHECK_RESULT(vkAllocateMemory(device, &memoryAllocateInfo, nullptr, &scratchBuffer.memory));
-	VK_CHECK_RESULT(vkBindBufferMemory(device, scratchBuffer.handle, scratchBuffer.memory, 0));
+	VK_CHECK_RESULT(bindBufferMemory(scratchBuffer.handle, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, scratchBuffer.memory, poolType));
 	// Buffer device address
 	VkBufferDeviceAddressInfoKHR bufferDeviceAddresInfo{};
 	bufferDeviceAddresInfo.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO;
 	bufferDeviceAddresInfo.buffer = scratchBuffer.handle;
-	scratchBuffer.deviceAddress = vkGetBufferDeviceAddressKHR(device, &bufferDeviceAddresInfo);
+	scratchBuffer.deviceAddress = (vkGetBufferDeviceAddressKHR(device, &bufferDeviceAddresInfo) + scratchAlignment - 1) & ~(scratchAlignment - 1);
 	return scratchBuffer;
 }
 
 void deleteScratchBuffer(ScratchBuffer &scratchBuffer) {
-	if (scratchBuffer.memory != VK_NULL_HANDLE) {
-		vkFreeMemory(device, scratchBuffer.memory, nullptr);
-	}
 	if (scratchBuffer.handle != VK_NULL_HANDLE) {
+		freeBufferMemory(scratchBuffer.handle);
 		vkDestroyBuffer(device, scratchBuffer.handle, nullptr);
 	}
 }
@@ -146,18 +146,7 @@ void createAccelerationStructure(AccelerationStructure &accelerationStructure, V
 	bufferCreateInfo.size = buildSizeInfo.accelerationStructureSize;
 	bufferCreateInfo.usage = VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
 	VK_CHECK_RESULT(vkCreateBuffer(device, &bufferCreateInfo, nullptr, &accelerationStructure.buffer))
-	VkMemoryRequirements memoryRequirements{};
-	vkGetBufferMemoryRequirements(device, accelerationStructure.buffer, &memoryRequirements);
-	VkMemoryAllocateFlagsInfo memoryAllocateFlagsInfo{};
-	memoryAllocateFlagsInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
-	memoryAllocateFlagsInfo.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT_KHR;
-	VkMemoryAllocateInfo memoryAllocateInfo{};
-	memoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	memoryAllocateInfo.pNext = &memoryAllocateFlagsInfo;
-	memoryAllocateInfo.allocationSize = memoryRequirements.size;
-	memoryAllocateInfo.memoryTypeIndex = findMemoryType(memoryRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-	VK_CHECK_RESULT(vkAllocateMemory(device, &memoryAllocateInfo, nullptr, &accelerationStructure.memory))
-	VK_CHECK_RESULT(vkBindBufferMemory(device, accelerationStructure.buffer, accelerationStructure.memory, 0))
+	VK_CHECK_RESULT(bindBufferMemory(accelerationStructure.buffer, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, accelerationStructure.memory))
 	// Acceleration structure
 	VkAccelerationStructureCreateInfoKHR accelerationStructureCreate_info{};
 	accelerationStructureCreate_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
@@ -173,38 +162,57 @@ void createAccelerationStructure(AccelerationStructure &accelerationStructure, V
 }
 
 void deleteAccelerationStructure(AccelerationStructure &accelerationStructure) {
-	vkFreeMemory(device, accelerationStructure.memory, nullptr);
-	vkDestroyBuffer(device, accelerationStructure.buffer, nullptr);
 	vkDestroyAccelerationStructureKHR(device, accelerationStructure.handle, nullptr);
+	freeBufferMemory(accelerationStructure.buffer);
+	vkDestroyBuffer(device, accelerationStructure.buffer, nullptr);
 }
 
+// Geometry of a bottom level acceleration structure waiting for the batched build
+struct BottomLevelASBuildInput {
+	uint32_t id;
+	VkAccelerationStructureGeometryKHR geometry;
+	VkAccelerationStructureBuildRangeInfoKHR buildRange;
+	VkAccelerationStructureBuildSizesInfoKHR buildSizes;
+	VkDeviceSize scratchOffset;
+};
+
+std::vector<BottomLevelASBuildInput> pendingBottomLevelAS;
+
+VkBuildAccelerationStructureFlagsKHR getBottomLevelAccelerationStructureBuildFlags() {
+	return VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | (COMPACT_BLAS ? VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR : 0);
+}
+
+// upper bound of the scratch arena, several batches are recorded if the scene needs more
+constexpr VkDeviceSize MAX_BLAS_SCRATCH_ARENA_SIZE = 256 * 1024 * 1024;
+
 /*
-Create the bottom level acceleration structure contains the scene's actual geometry (vertices, triangles)
+Create the bottom level acceleration structure of one level of detail of a prim, it contains the scene's actual geometry (vertices, triangles)
 */
-void createBottomLevelAccelerationStructure(const objectGLTF &obj) {
-	// don't recreate if already done by another instance
-	if (bottomLevelAS.contains(obj.id))
-		return;
-
+static void createBottomLevelAccelerationStructure(const primMeshGLTF &prim, const primLodGLTF &lod) {
 	VkDeviceOrHostAddressConstKHR vertexBufferDeviceAddress{};
 	VkDeviceOrHostAddressConstKHR indexBufferDeviceAddress{};
 
-	vertexBufferDeviceAddress.deviceAddress = getBufferDeviceAddress(sceneGLTF.primsMeshCache[obj.primMesh]->vertexBuffer);
-	indexBufferDeviceAddress.deviceAddress = getBufferDeviceAddress(sceneGLTF.primsMeshCache[obj.primMesh]->indexBuffer);
+	// the prim geometry is a range of the scene buffers
+	vertexBufferDeviceAddress.deviceAddress = getBufferDeviceAddress(sceneGLTF.allVerticesBuffer) + prim.offsetVertex * sizeof(PackedVertex);
+	indexBufferDeviceAddress.deviceAddress =
+		getBufferDeviceAddress(sceneGLTF.allIndicesBuffer) + lod.offsetIndex * (prim.indexType == VK_INDEX_TYPE_UINT16 ? sizeof(uint16_t) : sizeof(uint32_t));
 
-	uint32_t numTriangles = static_cast<uint32_t>(sceneGLTF.primsMeshCache[obj.primMesh]->indices.size()) / 3;
-	uint32_t maxVertex = sceneGLTF.primsMeshCache[obj.primMesh]->vertices.size();
+	uint32_t numTriangles = lod.indexCount / 3;
+	uint32_t maxVertex = prim.vertexCount;
 
-	// Build
-	VkAccelerationStructureGeometryKHR accelerationStructureGeometry{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR};
+	BottomLevelASBuildInput buildInput{};
+	buildInput.id = lod.id;
+
+	VkAccelerationStructureGeometryKHR &accelerationStructureGeometry = buildInput.geometry;
+	accelerationStructureGeometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
 	accelerationStructureGeometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
 	accelerationStructureGeometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
 	accelerationStructureGeometry.geometry.triangles.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR;
 	accelerationStructureGeometry.geometry.triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
 	accelerationStructureGeometry.geometry.triangles.vertexData = vertexBufferDeviceAddress;
 	accelerationStructureGeometry.geometry.triangles.maxVertex = maxVertex;
-	accelerationStructureGeometry.geometry.triangles.vertexStride = sizeof(Vertex);
-	accelerationStructureGeometry.geometry.triangles.indexType = VK_INDEX_TYPE_UINT32;
+	accelerationStructureGeometry.geometry.triangles.vertexStride = sizeof(PackedVertex);
+	accelerationStructureGeometry.geometry.triangles.indexType = prim.indexType;
 	accelerationStructureGeometry.geometry.triangles.indexData = indexBufferDeviceAddress;
 	accelerationStructureGeometry.geometry.triangles.transformData.deviceAddress = 0;
 	accelerationStructureGeometry.geometry.triangles.transformData.hostAddress = nullptr;
@@ -212,42 +220,167 @@ void createBottomLevelAccelerationStructure(const objectGLTF &obj) {
 	// Get size info
 	VkAccelerationStructureBuildGeometryInfoKHR accelerationStructureBuildGeometryInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR};
 	accelerationStructureBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-	accelerationStructureBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+	accelerationStructureBuildGeometryInfo.flags = getBottomLevelAccelerationStructureBuildFlags();
 	accelerationStructureBuildGeometryInfo.geometryCount = 1;
 	accelerationStructureBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
 
-	VkAccelerationStructureBuildSizesInfoKHR accelerationStructureBuildSizesInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR};
+	buildInput.buildSizes.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
 	vkGetAccelerationStructureBuildSizesKHR(device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &accelerationStructureBuildGeometryInfo, &numTriangles,
-	                                        &accelerationStructureBuildSizesInfo);
+	                                        &buildInput.buildSizes);
 
-	createAccelerationStructure(bottomLevelAS[obj.id], VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, accelerationStructureBuildSizesInfo);
+	createAccelerationStructure(bottomLevelAS[lod.id], VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, buildInput.buildSizes);
 
-	// Create a small scratch buffer used during build of the bottom level acceleration structure
-	ScratchBuffer scratchBuffer = createScratchBuffer(accelerationStructureBuildSizesInfo.buildScratchSize);
+	buildInput.buildRange.primitiveCount = numTriangles;
+	buildInput.buildRange.primitiveOffset = 0;
+	buildInput.buildRange.firstVertex = 0;
+	buildInput.buildRange.transformOffset = 0;
 
-	VkAccelerationStructureBuildGeometryInfoKHR accelerationBuildGeometryInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR};
-	accelerationBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-	accelerationBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-	accelerationBuildGeometryInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-	accelerationBuildGeometryInfo.dstAccelerationStructure = bottomLevelAS[obj.id].handle;
-	accelerationBuildGeometryInfo.geometryCount = 1;
-	accelerationBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
-	accelerationBuildGeometryInfo.scratchData.deviceAddress = scratchBuffer.deviceAddress;
+	pendingBottomLevelAS.push_back(buildInput);
+}
 
-	VkAccelerationStructureBuildRangeInfoKHR accelerationStructureBuildRangeInfo{};
-	accelerationStructureBuildRangeInfo.primitiveCount = numTriangles;
-	accelerationStructureBuildRangeInfo.primitiveOffset = 0;
-	accelerationStructureBuildRangeInfo.firstVertex = 0;
-	accelerationStructureBuildRangeInfo.transformOffset = 0;
-	std::vector<VkAccelerationStructureBuildRangeInfoKHR*> accelerationBuildStructureRangeInfos = {&accelerationStructureBuildRangeInfo};
+/*
+Create the bottom level acceleration structures of the prim of the object, one per level of detail
+The build is deferred, call buildBottomLevelAccelerationStructures once all the objects are added
+*/
+void createBottomLevelAccelerationStructure(const objectGLTF &obj) {
+	const auto &prim = sceneGLTF.primsMeshCache[obj.primMesh];
+	// don't recreate if already done by another instance
+	if (bottomLevelAS.contains(prim->lods[0].id))
+		return;
+
+	for (uint32_t l = 0; l < prim->lodCount; ++l)
+		createBottomLevelAccelerationStructure(*prim, prim->lods[l]);
+}
+
+/*
+	Copy the freshly built bottom level acceleration structures into tightly sized ones, using the compacted sizes written in the query pool
+*/
+void compactBottomLevelAccelerationStructures(VkQueryPool queryPool) {
+	std::vector<VkDeviceSize> compactedSizes(pendingBottomLevelAS.size());
+	VK_CHECK_RESULT(vkGetQueryPoolResults(device, queryPool, 0, static_cast<uint32_t>(compactedSizes.size()), compactedSizes.size() * sizeof(VkDeviceSize), compactedSizes.data(),
+		sizeof(VkDeviceSize), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
 
-	// Build the acceleration structure on the device via a one-time command buffer submission
+	std::vector<AccelerationStructure> compactedAS(pendingBottomLevelAS.size());
+	VkDeviceSize sizeBefore = 0, sizeAfter = 0;
+
+	VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+	for (size_t i = 0; i < pendingBottomLevelAS.size(); ++i) {
+		VkAccelerationStructureBuildSizesInfoKHR compactedSizeInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR};
+		compactedSizeInfo.accelerationStructureSize = compactedSizes[i];
+		createAccelerationStructure(compactedAS[i], VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, compactedSizeInfo);
+
+		VkCopyAccelerationStructureInfoKHR copyInfo{VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR};
+		copyInfo.src = bottomLevelAS[pendingBottomLevelAS[i].id].handle;
+		copyInfo.dst = compactedAS[i].handle;
+		copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR;
+		vkCmdCopyAccelerationStructureKHR(commandBuffer, &copyInfo);
+
+		sizeBefore += pendingBottomLevelAS[i].buildSizes.accelerationStructureSize;
+		sizeAfter += compactedSizes[i];
+	}
+	endSingleTimeCommands(commandBuffer);
+
+	// swap in the compacted ones, the instances are created after so they get the new device addresses
+	for (size_t i = 0; i < pendingBottomLevelAS.size(); ++i) {
+		deleteAccelerationStructure(bottomLevelAS[pendingBottomLevelAS[i].id]);
+		bottomLevelAS[pendingBottomLevelAS[i].id] = compactedAS[i];
+	}
+
+	spdlog::info(fmt::format("Compacted {} BLAS: {} -> {} bytes, saved {} bytes", pendingBottomLevelAS.size(), sizeBefore, sizeAfter, sizeBefore - sizeAfter));
+}
+
+/*
+	Build all the pending bottom level acceleration structures
+	They are split in batches sharing one scratch arena, each batch is a single vkCmdBuildAccelerationStructuresKHR, everything in one submission
+*/
+void buildBottomLevelAccelerationStructures() {
+	if (pendingBottomLevelAS.empty())
+		return;
+
+	// sub-allocate the scratch of each build in the arena, start a new batch when the arena is full
+	const VkDeviceSize scratchAlignment = std::max<VkDeviceSize>(accelerationStructureProperties.minAccelerationStructureScratchOffsetAlignment, 1);
+	std::vector<std::pair<size_t, size_t>> batches; // first, count in pendingBottomLevelAS
+	VkDeviceSize arenaSize = 0, batchSize = 0;
+	for (size_t i = 0; i < pendingBottomLevelAS.size(); ++i) {
+		const VkDeviceSize scratchSize = (pendingBottomLevelAS[i].buildSizes.buildScratchSize + scratchAlignment - 1) & ~(scratchAlignment - 1);
+		if (batches.empty() || (batchSize > 0 && batchSize + scratchSize > MAX_BLAS_SCRATCH_ARENA_SIZE)) {
+			batches.emplace_back(i, 0);
+			batchSize = 0;
+		}
+		pendingBottomLevelAS[i].scratchOffset = batchSize;
+		batchSize += scratchSize;
+		batches.back().second++;
+		arenaSize = std::max(arenaSize, batchSize);
+	}
+
+	ScratchBuffer scratchBuffer = createScratchBuffer(arenaSize, MemoryPoolType::Linear);
+	const VkDeviceAddress scratchBaseAddress = scratchBuffer.deviceAddress;
+
+	std::vector<VkAccelerationStructureBuildGeometryInfoKHR> buildGeometryInfos(pendingBottomLevelAS.size());
+	std::vector<VkAccelerationStructureBuildRangeInfoKHR*> buildRangeInfos(pendingBottomLevelAS.size());
+	for (size_t i = 0; i < pendingBottomLevelAS.size(); ++i) {
+		auto &buildInput = pendingBottomLevelAS[i];
+		VkAccelerationStructureBuildGeometryInfoKHR &accelerationBuildGeometryInfo = buildGeometryInfos[i];
+		accelerationBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+		accelerationBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+		accelerationBuildGeometryInfo.flags = getBottomLevelAccelerationStructureBuildFlags();
+		accelerationBuildGeometryInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+		accelerationBuildGeometryInfo.dstAccelerationStructure = bottomLevelAS[buildInput.id].handle;
+		accelerationBuildGeometryInfo.geometryCount = 1;
+		accelerationBuildGeometryInfo.pGeometries = &buildInput.geometry;
+		accelerationBuildGeometryInfo.scratchData.deviceAddress = scratchBaseAddress + buildInput.scratchOffset;
+		buildRangeInfos[i] = &buildInput.buildRange;
+	}
+
+	// Build the acceleration structures on the device via a one-time command buffer submission
 	// Some implementations may support acceleration structure building on the host (VkPhysicalDeviceAccelerationStructureFeaturesKHR->accelerationStructureHostCommands), but we prefer device builds
 	VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-	vkCmdBuildAccelerationStructuresKHR(commandBuffer, 1, &accelerationBuildGeometryInfo, accelerationBuildStructureRangeInfos.data());
+	for (size_t b = 0; b < batches.size(); ++b) {
+		// the next batch reuses the scratch arena
+		if (b > 0) {
+			VkMemoryBarrier memoryBarrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+			memoryBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+			memoryBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+			vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &memoryBarrier, 0,
+			                     nullptr, 0, nullptr);
+		}
+		vkCmdBuildAccelerationStructuresKHR(commandBuffer, static_cast<uint32_t>(batches[b].second), &buildGeometryInfos[batches[b].first], &buildRangeInfos[batches[b].first]);
+	}
+
+	// query the compacted sizes in the same submission
+	VkQueryPool queryPool = VK_NULL_HANDLE;
+	std::vector<VkAccelerationStructureKHR> builtHandles;
+	if (COMPACT_BLAS) {
+		VkQueryPoolCreateInfo queryPoolCreateInfo{VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO};
+		queryPoolCreateInfo.queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR;
+		queryPoolCreateInfo.queryCount = static_cast<uint32_t>(pendingBottomLevelAS.size());
+		VK_CHECK_RESULT(vkCreateQueryPool(device, &queryPoolCreateInfo, nullptr, &queryPool));
+
+		for (const auto &buildInput : pendingBottomLevelAS)
+			builtHandles.push_back(bottomLevelAS[buildInput.id].handle);
+
+		VkMemoryBarrier memoryBarrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+		memoryBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+		memoryBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &memoryBarrier, 0,
+		                     nullptr, 0, nullptr);
+
+		vkCmdResetQueryPool(commandBuffer, queryPool, 0, queryPoolCreateInfo.queryCount);
+		vkCmdWriteAccelerationStructuresPropertiesKHR(commandBuffer, static_cast<uint32_t>(builtHandles.size()), builtHandles.data(),
+		                                              VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR, queryPool, 0);
+	}
 	endSingleTimeCommands(commandBuffer);
 
+	spdlog::info(fmt::format("Built {} BLAS in {} batch(es), scratch arena {} bytes", pendingBottomLevelAS.size(), batches.size(), arenaSize));
+
 	deleteScratchBuffer(scratchBuffer);
+
+	if (COMPACT_BLAS) {
+		compactBottomLevelAccelerationStructures(queryPool);
+		vkDestroyQueryPool(device, queryPool, nullptr);
+	}
+
+	pendingBottomLevelAS.clear();
 }
 
 /*
@@ -259,29 +392,34 @@ void createTopLevelAccelerationStructureInstance(objectGLTF &obj, const glm::mat
 		for (int j = 0; j < 4; j++)
 			instance.transform.matrix[i][j] = world[j][i];
 
-	instance.instanceCustomIndex = sceneGLTF.primsMeshCache[obj.primMesh]->id << 16 | obj.mat; // gl_InstanceCustomIndexEXT in the shader
+	// the level of detail has its own offset prim, the closest hit shader reads its index range
+	const auto &prim = sceneGLTF.primsMeshCache[obj.primMesh];
+	obj.lodRaytrace = selectPrimLod(*prim, world);
+	const primLodGLTF &lod = prim->lods[obj.lodRaytrace];
+	instance.instanceCustomIndex = obj.mat; // gl_InstanceCustomIndexEXT in the shader
 	instance.mask = 0xFF;
 	instance.instanceShaderBindingTableRecordOffset = 0; // We will use the same hit group for all objects
 	instance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
-	instance.accelerationStructureReference = bottomLevelAS[obj.id].deviceAddress;
+	instance.accelerationStructureReference = bottomLevelAS[lod.id].deviceAddress;
 
-	if (update)
+	if (update) {
 		instances[obj.idInstanceRaytrace] = instance;
-	else {
+		instanceOffsetPrims[obj.idInstanceRaytrace] = lod.id;
+	} else {
 		obj.idInstanceRaytrace = instances.size();
 		instances.push_back(instance);
+		instanceOffsetPrims.push_back(lod.id);
 	}
 }
-VkDeviceSize accelerationStructureBuildSizesInfoBuildScratchSize;
-
-void createTopLevelAccelerationStructure(bool update) {
-	// Buffer for instance data
-	Buffer instancesBuffer;
-	VK_CHECK_RESULT(
-		createBuffer(VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
-			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &instancesBuffer, sizeof(VkAccelerationStructureInstanceKHR)*instances.size(), instances.
-			data()))
-
+// Persistent resources for the top level acceleration structure updates
+// one instance buffer per frame in flight, so the CPU never writes into a buffer still read by a build in flight
+std::vector<Buffer> instancesBuffers;
+// the offset prims of the instances follow the same ring, a level of detail change is seen by the trace of its frame
+std::vector<Buffer> instanceOffsetPrimsBuffers;
+// the scratch buffer is shared, builds are serialized on the queue by the barrier in updateTopLevelAccelerationStructure
+ScratchBuffer topLevelASScratchBuffer{};
+
+VkAccelerationStructureGeometryKHR getTopLevelAccelerationStructureGeometry(const Buffer &instancesBuffer) {
 	VkDeviceOrHostAddressConstKHR instanceDataDeviceAddress{};
 	instanceDataDeviceAddress.deviceAddress = getBufferDeviceAddress(instancesBuffer.buffer);
 
@@ -291,38 +429,21 @@ void createTopLevelAccelerationStructure(bool update) {
 	accelerationStructureGeometry.geometry.instances.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
 	accelerationStructureGeometry.geometry.instances.arrayOfPointers = VK_FALSE;
 	accelerationStructureGeometry.geometry.instances.data = instanceDataDeviceAddress;
+	return accelerationStructureGeometry;
+}
 
-	if (!update) {
-		// Get size info
-		VkAccelerationStructureBuildGeometryInfoKHR accelerationStructureBuildGeometryInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR};
-		accelerationStructureBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-		accelerationStructureBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
-		accelerationStructureBuildGeometryInfo.geometryCount = 1;
-		accelerationStructureBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
-
-		uint32_t primitiveCount = static_cast<uint32_t>(instances.size());
-
-		VkAccelerationStructureBuildSizesInfoKHR accelerationStructureBuildSizesInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR};
-		vkGetAccelerationStructureBuildSizesKHR(device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &accelerationStructureBuildGeometryInfo, &primitiveCount,
-												&accelerationStructureBuildSizesInfo);
-
-		createAccelerationStructure(topLevelAS, VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR, accelerationStructureBuildSizesInfo);
-
-		accelerationStructureBuildSizesInfoBuildScratchSize = accelerationStructureBuildSizesInfo.buildScratchSize;
-	}
-
-	// Create a small scratch buffer used during build of the top level acceleration structure
-	ScratchBuffer scratchBuffer = createScratchBuffer(accelerationStructureBuildSizesInfoBuildScratchSize);
+void recordTopLevelAccelerationStructureBuild(VkCommandBuffer commandBuffer, const Buffer &instancesBuffer, bool update) {
+	VkAccelerationStructureGeometryKHR accelerationStructureGeometry = getTopLevelAccelerationStructureGeometry(instancesBuffer);
 
 	VkAccelerationStructureBuildGeometryInfoKHR accelerationBuildGeometryInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR};
 	accelerationBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
 	accelerationBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
 	accelerationBuildGeometryInfo.mode = update ? VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR : VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
 	accelerationBuildGeometryInfo.dstAccelerationStructure = topLevelAS.handle;
-	accelerationBuildGeometryInfo.srcAccelerationStructure = topLevelAS.handle;
+	accelerationBuildGeometryInfo.srcAccelerationStructure = update ? topLevelAS.handle : VK_NULL_HANDLE;
 	accelerationBuildGeometryInfo.geometryCount = 1;
 	accelerationBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
-	accelerationBuildGeometryInfo.scratchData.deviceAddress = scratchBuffer.deviceAddress;
+	accelerationBuildGeometryInfo.scratchData.deviceAddress = topLevelASScratchBuffer.deviceAddress;
 
 	VkAccelerationStructureBuildRangeInfoKHR accelerationStructureBuildRangeInfo{};
 	accelerationStructureBuildRangeInfo.primitiveCount = static_cast<uint32_t>(instances.size());
@@ -331,14 +452,76 @@ void createTopLevelAccelerationStructure(bool update) {
 	accelerationStructureBuildRangeInfo.transformOffset = 0;
 	std::vector<VkAccelerationStructureBuildRangeInfoKHR*> accelerationBuildStructureRangeInfos = {&accelerationStructureBuildRangeInfo};
 
-	// Build the acceleration structure on the device via a one-time command buffer submission
-	// Some implementations may support acceleration structure building on the host (VkPhysicalDeviceAccelerationStructureFeaturesKHR->accelerationStructureHostCommands), but we prefer device builds
-	VkCommandBuffer commandBuffer = beginSingleTimeCommands();
 	vkCmdBuildAccelerationStructuresKHR(commandBuffer, 1, &accelerationBuildGeometryInfo, accelerationBuildStructureRangeInfos.data());
+}
+
+void createTopLevelAccelerationStructure() {
+	// Ring of persistently mapped buffers for instance data
+	instancesBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+	for (auto &instancesBuffer : instancesBuffers) {
+		VK_CHECK_RESULT(
+			createBuffer(VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
+				VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &instancesBuffer, sizeof(VkAccelerationStructureInstanceKHR)*instances.size(), instances.
+				data()))
+		VK_CHECK_RESULT(instancesBuffer.map())
+	}
+	instanceOffsetPrimsBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+	for (auto &instanceOffsetPrimsBuffer : instanceOffsetPrimsBuffers) {
+		VK_CHECK_RESULT(createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		                             &instanceOffsetPrimsBuffer, sizeof(uint32_t) * instanceOffsetPrims.size(), instanceOffsetPrims.data()))
+		VK_CHECK_RESULT(instanceOffsetPrimsBuffer.map())
+	}
+
+	// Get size info
+	VkAccelerationStructureGeometryKHR accelerationStructureGeometry = getTopLevelAccelerationStructureGeometry(instancesBuffers[0]);
+
+	VkAccelerationStructureBuildGeometryInfoKHR accelerationStructureBuildGeometryInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR};
+	accelerationStructureBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+	accelerationStructureBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
+	accelerationStructureBuildGeometryInfo.geometryCount = 1;
+	accelerationStructureBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
+
+	uint32_t primitiveCount = static_cast<uint32_t>(instances.size());
+
+	VkAccelerationStructureBuildSizesInfoKHR accelerationStructureBuildSizesInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR};
+	vkGetAccelerationStructureBuildSizesKHR(device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &accelerationStructureBuildGeometryInfo, &primitiveCount,
+											&accelerationStructureBuildSizesInfo);
+
+	createAccelerationStructure(topLevelAS, VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR, accelerationStructureBuildSizesInfo);
+
+	// Scratch buffer kept alive for the per frame updates, large enough for the initial build too
+	topLevelASScratchBuffer = createScratchBuffer(std::max(accelerationStructureBuildSizesInfo.buildScratchSize, accelerationStructureBuildSizesInfo.updateScratchSize),
+	                                              MemoryPoolType::FreeList);
+
+	// Initial build on the device via a one-time command buffer submission, the updates are recorded in the frame command buffer
+	VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+	recordTopLevelAccelerationStructureBuild(commandBuffer, instancesBuffers[0], false);
 	endSingleTimeCommands(commandBuffer);
+}
 
-	deleteScratchBuffer(scratchBuffer);
-	instancesBuffer.destroy();
+/*
+	Record the refit of the top level acceleration structure with the current instances, before the trace
+*/
+void updateTopLevelAccelerationStructure(VkCommandBuffer commandBuffer, uint32_t frameIndex) {
+	// the fence of this frame has been waited, nothing on the GPU is reading this slot anymore
+	Buffer &instancesBuffer = instancesBuffers[frameIndex];
+	memcpy(instancesBuffer.mapped, instances.data(), sizeof(VkAccelerationStructureInstanceKHR) * instances.size());
+	memcpy(instanceOffsetPrimsBuffers[frameIndex].mapped, instanceOffsetPrims.data(), sizeof(uint32_t) * instanceOffsetPrims.size());
+
+	// wait for the trace and the build of the previous frame, they use the same acceleration structure and scratch buffer
+	VkMemoryBarrier memoryBarrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+	memoryBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+	memoryBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+	                     VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+
+	recordTopLevelAccelerationStructureBuild(commandBuffer, instancesBuffer, true);
+
+	// the trace must see the updated acceleration structure
+	memoryBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+	memoryBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, 0, 1, &memoryBarrier, 0, nullptr, 0,
+	                     nullptr);
 }
 
 uint32_t alignedSize(uint32_t value, uint32_t alignment) { return (value + alignment - 1) & ~(alignment - 1); }
@@ -426,7 +609,7 @@ void createDescriptorSets() {
 		{VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 1 * static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT)},
 		{VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1 * static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT)},
 		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1 * static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT)},
-		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 3 * static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT)},
+		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 4 * static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT)},
 		{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1 * static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT)},
 		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1 * static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT)},
 		{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1 * static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT)},
@@ -474,6 +657,7 @@ void createDescriptorSets() {
 			imageAllTexturesInfo.push_back(imageTextureMapInfo);
 		}
 		VkDescriptorBufferInfo materialsBufferDescriptor{sceneGLTF.materialsCacheBuffer.buffer, 0, VK_WHOLE_SIZE};
+		VkDescriptorBufferInfo instanceOffsetPrimsDescriptor{instanceOffsetPrimsBuffers[i].buffer, 0, VK_WHOLE_SIZE};
 
 		VkDescriptorImageInfo envmapMapInfo{sceneGLTF.envMap.textureSampler, sceneGLTF.envMap.textureImageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
 
@@ -496,6 +680,8 @@ void createDescriptorSets() {
 			writeDescriptorSet(descriptorSets[i], VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 7, &materialsBufferDescriptor),
 			// Binding 8: envmap image
 			writeDescriptorSet(descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 8, &envmapMapInfo),
+			// Binding 9: offset prim of the instances
+			writeDescriptorSet(descriptorSets[i], VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 9, &instanceOffsetPrimsDescriptor),
 		};
 		vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, VK_NULL_HANDLE);
 	}
@@ -569,6 +755,8 @@ void createRayTracingPipeline() {
 		descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 7),
 		// Binding 8: envmap Image
 		descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR | VK_SHADER_STAGE_MISS_BIT_KHR, 8),
+		// Binding 9: instance offset prims buffer
+		descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 9),
 	};
 
 	VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCI = descriptorSetLayoutCreateInfo(setLayoutBindings);
@@ -646,7 +834,7 @@ void updateUniformBuffersRaytrace(uint32_t frameIndex) {
 	auto JitterMatrix = glm::mat4(1);
 	JitterMatrix = glm::translate(JitterMatrix, glm::vec3(jitterCam.x, jitterCam.y,0.0f));
 
-	auto proj = glm::perspective(glm::radians(45.0f), static_cast<float>(swapChainExtent.width * DLSS_SCALE) / static_cast<float>(swapChainExtent.height * DLSS_SCALE), 0.001f, 10000.f);
+	auto proj = glm::perspective(glm::radians(CAMERA_FOV), static_cast<float>(swapChainExtent.width * DLSS_SCALE) / static_cast<float>(swapChainExtent.height * DLSS_SCALE), 0.001f, 10000.f);
 	proj[1][1] *= -1;
 	uniformData.projInverse = glm::inverse(proj * JitterMatrix );
 
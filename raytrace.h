@@ -5,11 +5,16 @@
 namespace vulkanite_raytrace {
 
 extern std::vector<VkAccelerationStructureInstanceKHR> instances;
+// compact the BLAS after the load time build (smaller memory footprint, slightly longer loading)
+extern bool COMPACT_BLAS;
 
+uint64_t getBufferDeviceAddress(VkBuffer buffer);
 void InitRaytrace();
 void createBottomLevelAccelerationStructure(const objectGLTF &obj);
+void buildBottomLevelAccelerationStructures();
 void createTopLevelAccelerationStructureInstance(objectGLTF &obj, const glm::mat4 &world, const bool &update);
-void createTopLevelAccelerationStructure(bool update);
+void createTopLevelAccelerationStructure();
+void updateTopLevelAccelerationStructure(VkCommandBuffer commandBuffer, uint32_t frameIndex);
 void createUniformBuffer();
 void createShaderBindingTables();
 void createDescriptorSets();
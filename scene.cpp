@@ -1,31 +1,81 @@
 #include "texture.h"
 #include "scene.h"
 
+#include <algorithm>
 #include <functional>
 #include <array>
+#include <numeric>
+#include <tuple>
 
 #include "dlss.h"
 #include "rasterizer.h"
 #include "raytrace.h"
+#include "camera.h"
+#include "culling.h"
 
-#include <cmrc/cmrc.hpp>
+#include "asset_file.h"
+#include "upload_engine.h"
 #include <glm/ext/matrix_transform.hpp>
-CMRC_DECLARE(gltf_rc);
+
+#include <spdlog/spdlog.h>
+#include <fmt/core.h>
 
 SceneVulkanite sceneGLTF;
 bool USE_DLSS = true;
+#ifdef DRAW_RASTERIZE
+// the forward pass keeps the vertex pipeline
+bool USE_MESH_SHADER = false;
+#else
+bool USE_MESH_SHADER = true;
+#endif
+static PFN_vkCmdDrawMeshTasksEXT vkCmdDrawMeshTasksEXT = nullptr;
+bool USE_INDIRECT_DRAW = true;
+static PFN_vkCmdDrawIndexedIndirectCountKHR vkCmdDrawIndexedIndirectCountKHR = nullptr;
+bool USE_LOD = true;
+// the coarsest level of detail whose error stays under this size on the screen is used
+constexpr float LOD_ERROR_PIXELS = 1.f;
+std::string MODEL_PATH = MODEL_GLTF_PATH;
+std::string ENVMAP_PATH = ENVMAP;
+// the draw keys have 24 bits for the material and the prim ids, checked when the scene is loaded
+constexpr uint32_t DRAW_KEY_ID_LIMIT = 1u << 24;
+
+// world transform and bounds of the drawable objects under obj, in the order of the scene graph
+static void collectBvhInstances(objectGLTF &obj, const glm::mat4 &parent_world, std::vector<BvhInstance> &instances) {
+	const glm::mat4 world = obj.world * parent_world;
+	if (const auto &prim = sceneGLTF.primsMeshCache[obj.primMesh]) {
+		BvhInstance instance{&obj, world};
+		transformBounds(prim->minBound, prim->maxBound, world, instance.minBound, instance.maxBound);
+		instances.push_back(instance);
+	}
+	for (auto &objChild : obj.children)
+		collectBvhInstances(objChild, world, instances);
+}
+
+// obj moved, the instances under it follow, refitInstanceBvh after the moves
+static void moveBvhInstances(objectGLTF &obj, const glm::mat4 &parent_world) {
+	const glm::mat4 world = obj.world * parent_world;
+	if (const auto &prim = sceneGLTF.primsMeshCache[obj.primMesh]) {
+		BvhInstance &instance = sceneGLTF.instanceBvh.instances[obj.idInstanceBvh];
+		instance.world = world;
+		transformBounds(prim->minBound, prim->maxBound, world, instance.minBound, instance.maxBound);
+	}
+	for (auto &objChild : obj.children)
+		moveBvhInstances(objChild, world);
+}
 
 void loadSceneGLTF() {
 	sceneGLTF.envMap.name = "envMap";
-	auto cmrcFS = cmrc::gltf_rc::get_filesystem();
-	auto envmapRC = cmrcFS.open(ENVMAP);
-
-	createTextureImage(reinterpret_cast<const unsigned char*>(envmapRC.cbegin()), envmapRC.size(), sceneGLTF.envMap.textureImage, sceneGLTF.envMap.textureImageMemory,
-	                   sceneGLTF.envMap.mipLevels, true);
+	{
+		AssetFile envmapFile(ENVMAP_PATH);
+		createTextureImage(envmapFile.data(), static_cast<int>(envmapFile.size()), sceneGLTF.envMap.textureImage, sceneGLTF.envMap.textureImageMemory,
+		                   sceneGLTF.envMap.mipLevels, true);
+	}
 	sceneGLTF.envMap.textureImageView = createTextureImageView(sceneGLTF.envMap.textureImage, sceneGLTF.envMap.mipLevels, VK_FORMAT_R32G32B32A32_SFLOAT);
 	createTextureSampler(sceneGLTF.envMap.textureSampler, sceneGLTF.envMap.mipLevels);
 
-	sceneGLTF.roots = loadSceneGltf(MODEL_GLTF_PATH);
+	sceneGLTF.roots = loadSceneGltf(MODEL_PATH);
+	// the textures and the geometry are uploaded asynchronously, ready before the BLAS builds and the first frame
+	waitUploads();
 }
 
 void initSceneGLTF() {
@@ -64,7 +114,22 @@ void initSceneGLTF() {
 	createDescriptorSetLayoutMotionVector(sceneGLTF.descriptorSetLayout);
 	createGraphicsPipeline("spv/shaderMotionVector.vert.spv", "spv/shaderMotionVector.frag.spv", sceneGLTF.pipelineLayout, sceneGLTF.graphicsPipeline, sceneGLTF.renderPass, VK_SAMPLE_COUNT_1_BIT, sceneGLTF.descriptorSetLayout, false);
 	createGraphicsPipeline("spv/shaderMotionVector.vert.spv", "spv/shaderMotionVector.frag.spv", sceneGLTF.pipelineLayoutAlpha, sceneGLTF.graphicsPipelineAlpha, sceneGLTF.renderPass, VK_SAMPLE_COUNT_1_BIT, sceneGLTF.descriptorSetLayout, true);
+	if (USE_MESH_SHADER) {
+		vkCmdDrawMeshTasksEXT = reinterpret_cast<PFN_vkCmdDrawMeshTasksEXT>(vkGetDeviceProcAddr(device, "vkCmdDrawMeshTasksEXT"));
+		createMeshShaderPipeline("spv/meshletMotionVector.task.spv", "spv/meshletMotionVector.mesh.spv", "spv/shaderMotionVector.frag.spv", sceneGLTF.meshPipelineLayout,
+		                         sceneGLTF.meshPipeline, sceneGLTF.renderPass, VK_SAMPLE_COUNT_1_BIT, sceneGLTF.descriptorSetLayout, false);
+		createMeshShaderPipeline("spv/meshletMotionVector.task.spv", "spv/meshletMotionVector.mesh.spv", "spv/shaderMotionVector.frag.spv", sceneGLTF.meshPipelineLayoutAlpha,
+		                         sceneGLTF.meshPipelineAlpha, sceneGLTF.renderPass, VK_SAMPLE_COUNT_1_BIT, sceneGLTF.descriptorSetLayout, true);
+	}
+	if (USE_INDIRECT_DRAW) {
+		createIndirectGraphicsPipeline("spv/shaderMotionVectorIndirect.vert.spv", "spv/shaderMotionVector.frag.spv", sceneGLTF.indirectPipelineLayout, sceneGLTF.indirectPipeline,
+		                               sceneGLTF.renderPass, VK_SAMPLE_COUNT_1_BIT, sceneGLTF.descriptorSetLayout, false);
+		createIndirectGraphicsPipeline("spv/shaderMotionVectorIndirect.vert.spv", "spv/shaderMotionVector.frag.spv", sceneGLTF.indirectPipelineLayoutAlpha,
+		                               sceneGLTF.indirectPipelineAlpha, sceneGLTF.renderPass, VK_SAMPLE_COUNT_1_BIT, sceneGLTF.descriptorSetLayout, true);
+	}
 #endif
+	if (USE_INDIRECT_DRAW)
+		vkCmdDrawIndexedIndirectCountKHR = reinterpret_cast<PFN_vkCmdDrawIndexedIndirectCountKHR>(vkGetDeviceProcAddr(device, "vkCmdDrawIndexedIndirectCountKHR"));
 
 #ifdef DRAW_RASTERIZE
 	createUniformParamsBuffers(sizeof(UBOParams), sceneGLTF.uniformParamsBuffers, sceneGLTF.uniformParamsBuffersMemory, sceneGLTF.uniformParamsBuffersMapped);
@@ -74,6 +139,23 @@ void initSceneGLTF() {
 
 	// load gltf
 	loadSceneGLTF();
+	// ids above the limit would merge different draws with the same key
+	if (sceneGLTF.materialsCache.size() > DRAW_KEY_ID_LIMIT || (!sceneGLTF.primsMeshCache.empty() && sceneGLTF.primsMeshCache.rbegin()->first >= DRAW_KEY_ID_LIMIT))
+		throw std::runtime_error("too many materials or prims for the draw keys!");
+	createSceneInstanceBuffers();
+	if (USE_INSTANCE_BVH) {
+		std::vector<BvhInstance> instances;
+		for (auto &obj : sceneGLTF.roots)
+			collectBvhInstances(obj, glm::mat4(1), instances);
+		buildInstanceBvh(sceneGLTF.instanceBvh, std::move(instances));
+		spdlog::info(fmt::format("Instance BVH: {} instances, {} nodes", sceneGLTF.instanceBvh.instances.size(), sceneGLTF.instanceBvh.nodes.size()));
+	}
+	// the culling writes the commands of the indirect draws
+	if (!USE_INDIRECT_DRAW)
+		USE_GPU_CULLING = false;
+	if (USE_GPU_CULLING)
+		createCullingResources({extentScale.width, extentScale.height}, sceneGLTF.storageImagesDepth, findDepthFormat());
+	spdlog::info(fmt::format("GPU culling: {}", USE_GPU_CULLING ? "on" : "off"));
 
 #if !defined DRAW_RASTERIZE
 	// setup raytrace
@@ -81,7 +163,7 @@ void initSceneGLTF() {
 
 	vulkanite_raytrace::InitRaytrace();
 
-	// make blas
+	// gather all the blas, then build them in batches
 	std::function<void(const objectGLTF &)> makeBLASf;
 	makeBLASf = [&](const objectGLTF &obj) {
 		if (sceneGLTF.primsMeshCache[obj.primMesh])
@@ -91,6 +173,7 @@ void initSceneGLTF() {
 	};
 	for (const auto &o : sceneGLTF.roots)
 		makeBLASf(o);
+	vulkanite_raytrace::buildBottomLevelAccelerationStructures();
 
 	// make las
 	std::function<void(objectGLTF &, const glm::mat4 &)> makeTLASf;
@@ -103,7 +186,7 @@ void initSceneGLTF() {
 	for (auto &o : sceneGLTF.roots)
 		makeTLASf(o, glm::mat4(1));
 
-	vulkanite_raytrace::createTopLevelAccelerationStructure(false);
+	vulkanite_raytrace::createTopLevelAccelerationStructure();
 
 	vulkanite_raytrace::createUniformBuffer();
 	vulkanite_raytrace::createRayTracingPipeline();
@@ -111,76 +194,407 @@ void initSceneGLTF() {
 	vulkanite_raytrace::createDescriptorSets();
 
 #endif
+	logMemoryAllocatorStats();
 }
 
 void updateSceneGLTF(float deltaTime) {
-	// move in circle one pion
-
-	static auto startTime = std::chrono::high_resolution_clock::now();
-	auto currentTime = std::chrono::high_resolution_clock::now();
-	float timer = std::chrono::duration<float, std::chrono::seconds::period>(currentTime - startTime).count() * 70.f;
-
-	glm::mat4 movingMat = glm::mat4(1.0f);
-	sceneGLTF.roots[5].world = glm::translate(movingMat, glm::vec3(cos(glm::radians(timer)) * 0.1f, 0.014927f, sin(glm::radians(timer)) * 0.1f));
+	// move in circle one pion, only in the chess scene
+	const bool isChess = sceneGLTF.roots.size() > 5;
+	if (isChess) {
+		static auto startTime = std::chrono::high_resolution_clock::now();
+		auto currentTime = std::chrono::high_resolution_clock::now();
+		float timer = std::chrono::duration<float, std::chrono::seconds::period>(currentTime - startTime).count() * 70.f;
+
+		glm::mat4 movingMat = glm::mat4(1.0f);
+		sceneGLTF.roots[5].world = glm::translate(movingMat, glm::vec3(cos(glm::radians(timer)) * 0.1f, 0.014927f, sin(glm::radians(timer)) * 0.1f));
+		if (USE_INSTANCE_BVH) {
+			moveBvhInstances(sceneGLTF.roots[5], glm::mat4(1));
+			refitInstanceBvh(sceneGLTF.instanceBvh);
+		}
+	}
 		
 #if !defined DRAW_RASTERIZE
-	// update raytrace
-	std::function<void(objectGLTF &, const glm::mat4 &)> updateTLASf;
-	updateTLASf = [&](objectGLTF &obj, const glm::mat4 &parent_world) {
-		if (sceneGLTF.primsMeshCache[obj.primMesh])
-			vulkanite_raytrace::createTopLevelAccelerationStructureInstance(obj, obj.world * parent_world, true);
+	// update raytrace instances, the acceleration structure is refit in recordCommandBuffer
+	// the moved instances are rewritten, the others only when the camera changes their level of detail
+	std::function<void(objectGLTF &, const glm::mat4 &, bool)> updateTLASf;
+	updateTLASf = [&](objectGLTF &obj, const glm::mat4 &parent_world, bool moved) {
+		const glm::mat4 world = obj.world * parent_world;
+		const auto &prim = sceneGLTF.primsMeshCache[obj.primMesh];
+		if (prim && (moved || selectPrimLod(*prim, world) != obj.lodRaytrace))
+			vulkanite_raytrace::createTopLevelAccelerationStructureInstance(obj, world, true);
 		for (auto &objChild : obj.children)
-			updateTLASf(objChild, obj.world * parent_world);
+			updateTLASf(objChild, world, moved);
 	};
-	for (auto &o : sceneGLTF.roots[5].children)
-		updateTLASf(o, sceneGLTF.roots[5].world);
-
-	vulkanite_raytrace::createTopLevelAccelerationStructure(true);
+	if (isChess) {
+		for (auto &o : sceneGLTF.roots[5].children)
+			updateTLASf(o, sceneGLTF.roots[5].world, true);
+	}
+	static glm::mat4 lodCamWorld{0.f};
+	if (USE_LOD && lodCamWorld != camWorld) {
+		lodCamWorld = camWorld;
+		for (auto &o : sceneGLTF.roots)
+			updateTLASf(o, glm::mat4(1), false);
+	}
 #endif
 
 }
 
-void drawModelGLTF(VkCommandBuffer commandBuffer, uint32_t currentFrame, objectGLTF &obj, const glm::mat4 &parent_world, const bool &isRenderingAlphaPass) {
-	if (sceneGLTF.primsMeshCache[obj.primMesh] && ((sceneGLTF.materialsCache[obj.mat].alphaMask == 0.f && !isRenderingAlphaPass) || (
-		                                               sceneGLTF.materialsCache[obj.mat].alphaMask != 0.f && isRenderingAlphaPass))) {
-#ifdef DRAW_RASTERIZE
-		updateUniformBuffer(currentFrame, obj, parent_world);
-#else
-		if (USE_DLSS)
-			updateUniformBufferMotionVector(currentFrame, obj, parent_world);
-#endif
+uint32_t selectPrimLod(const primMeshGLTF &prim, const glm::mat4 &world) {
+	if (!USE_LOD || prim.lodCount <= 1)
+		return 0;
+
+	// bounding sphere of the prim in world space, the errors are relative to the largest side of the bounding box
+	const float scale = std::max(std::max(glm::length(glm::vec3(world[0])), glm::length(glm::vec3(world[1]))), glm::length(glm::vec3(world[2])));
+	const glm::vec3 size = prim.maxBound - prim.minBound;
+	const float extent = std::max(std::max(size.x, size.y), size.z) * scale;
+	const float radius = glm::length(size) * 0.5f * scale;
+	const glm::vec3 center = glm::vec3(world * glm::vec4((prim.minBound + prim.maxBound) * 0.5f, 1.f));
+	const glm::vec3 cameraPosition = glm::vec3(glm::inverse(camWorld)[3]);
+	const float distance = glm::distance(cameraPosition, center) - radius;
+	if (distance <= 0.f)
+		return 0;
+
+	// the passes render at the DLSS scale, same vertical fov as their projection
+	const float renderHeight = static_cast<float>(swapChainExtent.height) * DLSS_SCALE;
+	const float pixelsPerUnit = renderHeight / (2.f * std::tan(glm::radians(CAMERA_FOV) * 0.5f) * distance);
+	uint32_t lod = 0;
+	while (lod + 1 < prim.lodCount && prim.lods[lod + 1].error * extent * pixelsPerUnit <= LOD_ERROR_PIXELS)
+		++lod;
+	return lod;
+}
+
+// the pipelines of the raster passes, in drawing order: opaque before alpha
+enum DrawPipeline : uint32_t { DRAW_PIPELINE_MESHLET, DRAW_PIPELINE_VERTEX, DRAW_PIPELINE_MESHLET_ALPHA, DRAW_PIPELINE_VERTEX_ALPHA };
+
+// sorted by pipeline, index type, material, prim then lod: the state changes are grouped and the equal keys form one instanced draw
+static uint64_t makeDrawKey(uint32_t pipeline, bool index32, uint32_t mat, uint32_t primMesh, uint32_t lod) {
+	return (uint64_t(pipeline) << 57) | (uint64_t(index32) << 56) | (uint64_t(mat & (DRAW_KEY_ID_LIMIT - 1)) << 32) | (uint64_t(primMesh & (DRAW_KEY_ID_LIMIT - 1)) << 8) |
+	       (lod & 0xFF);
+}
+
+// groups of the indirect commands, one index type each
+enum IndirectGroup : uint32_t { INDIRECT_GROUP_OPAQUE_16, INDIRECT_GROUP_OPAQUE_32, INDIRECT_GROUP_ALPHA_16, INDIRECT_GROUP_ALPHA_32, INDIRECT_GROUP_COUNT };
+// the indirect buffer starts with the draw count of each group, then the commands
+constexpr VkDeviceSize INDIRECT_COMMANDS_OFFSET = INDIRECT_GROUP_COUNT * sizeof(uint32_t);
+
+static uint32_t indirectGroup(uint32_t pipeline, VkIndexType indexType) {
+	return (pipeline == DRAW_PIPELINE_VERTEX_ALPHA ? INDIRECT_GROUP_ALPHA_16 : INDIRECT_GROUP_OPAQUE_16) + (indexType == VK_INDEX_TYPE_UINT32 ? 1 : 0);
+}
+
+// after the commands drawn come the inputs of the culling: the commands with their instances to count, the boxes of the instances,
+// then the list of the visible instances read by the vertex shaders
+struct IndirectLayout {
+	VkDeviceSize cullCommands, cullInstances, visibleInstances, size;
+};
+
+static IndirectLayout indirectLayout(uint32_t capacity) {
+	auto align = [](VkDeviceSize offset) { return (offset + 15) & ~VkDeviceSize(15); };
+	capacity = std::max<uint32_t>(capacity, 1);
+	IndirectLayout layout;
+	layout.cullCommands = align(INDIRECT_COMMANDS_OFFSET + capacity * sizeof(VkDrawIndexedIndirectCommand));
+	layout.cullInstances = align(layout.cullCommands + capacity * sizeof(VkDrawIndexedIndirectCommand));
+	layout.visibleInstances = align(layout.cullInstances + capacity * sizeof(CullInstance));
+	layout.size = layout.visibleInstances + capacity * sizeof(uint32_t);
+	return layout;
+}
+
+struct DrawItem {
+	uint64_t key;
+	objectGLTF *obj;
+	glm::mat4 world;
+	// world space box, tested by the GPU culling
+	glm::vec3 minBound, maxBound;
+};
+// rebuilt each frame, keeps its capacity
+static std::vector<DrawItem> drawList;
+
+// the items with the same key, drawn in one call
+struct DrawBatch {
+	uint32_t pipeline;
+	uint32_t primMesh;
+	uint32_t lod;
+	uint32_t firstInstance;
+	uint32_t instanceCount;
+};
+// written by prepareSceneGLTF, drawn by drawSceneGLTF
+static std::vector<DrawBatch> drawBatches;
+static objectGLTF *uniformObj = nullptr;
+// the commands of a group follow the ones of the previous group, indirectGroupEnd is past the last one
+static std::array<uint32_t, INDIRECT_GROUP_COUNT> indirectGroupEnd{};
+
+static void addDrawItem(objectGLTF &obj, const primMeshGLTF &prim, const glm::mat4 &world, const glm::vec3 &minBound, const glm::vec3 &maxBound, bool drawMeshlets) {
+	const uint32_t lod = selectPrimLod(prim, world);
+	const bool isAlpha = sceneGLTF.materialsCache[obj.mat].alphaMask != 0.f;
+	// the meshlets are only built for the full resolution
+	const bool meshlets = drawMeshlets && prim.meshletCount && lod == 0;
+	const uint32_t pipeline = isAlpha ? (meshlets ? DRAW_PIPELINE_MESHLET_ALPHA : DRAW_PIPELINE_VERTEX_ALPHA) : (meshlets ? DRAW_PIPELINE_MESHLET : DRAW_PIPELINE_VERTEX);
+	drawList.push_back({makeDrawKey(pipeline, prim.indexType == VK_INDEX_TYPE_UINT32, obj.mat, obj.primMesh, lod), &obj, world, minBound, maxBound});
+}
+
+// every drawable object, without the BVH
+static void gatherDrawList(objectGLTF &obj, const glm::mat4 &parent_world, bool drawMeshlets) {
+	if (const auto &prim = sceneGLTF.primsMeshCache[obj.primMesh]) {
+		const glm::mat4 world = obj.world * parent_world;
+		glm::vec3 minBound, maxBound;
+		transformBounds(prim->minBound, prim->maxBound, world, minBound, maxBound);
+		addDrawItem(obj, *prim, world, minBound, maxBound, drawMeshlets);
+	}
+
+	for (auto &objChild : obj.children)
+		gatherDrawList(objChild, obj.world * parent_world, drawMeshlets);
+}
 
-		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-		                  sceneGLTF.materialsCache[obj.mat].alphaMask ? sceneGLTF.graphicsPipelineAlpha : sceneGLTF.graphicsPipeline);
+static uint32_t countDrawableObjects(const objectGLTF &obj) {
+	uint32_t count = sceneGLTF.primsMeshCache[obj.primMesh] ? 1 : 0;
+	for (const auto &objChild : obj.children)
+		count += countDrawableObjects(objChild);
+	return count;
+}
 
-		VkBuffer vertexBuffers[] = {sceneGLTF.primsMeshCache[obj.primMesh]->vertexBuffer};
-		VkDeviceSize offsets[] = {0};
-		vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
+void createSceneInstanceBuffers() {
+	sceneGLTF.instanceCapacity = 0;
+	for (const auto &obj : sceneGLTF.roots)
+		sceneGLTF.instanceCapacity += countDrawableObjects(obj);
+	createInstanceBuffers(sceneGLTF.instanceBuffers, sceneGLTF.instanceBuffersMemory, sceneGLTF.instanceBuffersMapped,
+	                      std::max<uint32_t>(sceneGLTF.instanceCapacity, 1) * sizeof(InstanceData));
+	// at most one command per instance
+	if (USE_INDIRECT_DRAW)
+		createIndirectBuffers(sceneGLTF.indirectBuffers, sceneGLTF.indirectBuffersMemory, sceneGLTF.indirectBuffersMapped, indirectLayout(sceneGLTF.instanceCapacity).size);
+}
 
-		vkCmdBindIndexBuffer(commandBuffer, sceneGLTF.primsMeshCache[obj.primMesh]->indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+// same projection as the instance transforms of the passes
+static glm::mat4 cameraViewProj() {
+	auto proj = glm::perspective(glm::radians(CAMERA_FOV), swapChainExtent.width / (float)swapChainExtent.height, 0.001f, 10000.f);
+	proj[1][1] *= -1;
+	return proj * camWorld;
+}
 
-		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-		                        sceneGLTF.materialsCache[obj.mat].alphaMask ? sceneGLTF.pipelineLayoutAlpha : sceneGLTF.pipelineLayout, 0, 1, &obj.descriptorSets[currentFrame], 0,
-		                        nullptr);
+// the vertex pipeline batches become the commands of the indirect buffer
+// with the GPU culling their instance counts start at 0 and the culling pass writes the commands drawn and their counts
+static void writeIndirectCommands(VkCommandBuffer commandBuffer, uint32_t currentFrame) {
+	const IndirectLayout layout = indirectLayout(sceneGLTF.instanceCapacity);
+	auto *indirect = static_cast<unsigned char *>(sceneGLTF.indirectBuffersMapped[currentFrame]);
+	auto *drawCounts = reinterpret_cast<uint32_t *>(indirect);
+	auto *drawCommands = reinterpret_cast<VkDrawIndexedIndirectCommand *>(indirect + INDIRECT_COMMANDS_OFFSET);
+	auto *cullCommands = reinterpret_cast<VkDrawIndexedIndirectCommand *>(indirect + layout.cullCommands);
+	auto *cullInstances = reinterpret_cast<CullInstance *>(indirect + layout.cullInstances);
+	auto *visibleInstances = reinterpret_cast<uint32_t *>(indirect + layout.visibleInstances);
+
+	uint32_t commandCount = 0, cullCount = 0;
+	indirectGroupEnd.fill(0);
+	for (const auto &batch : drawBatches) {
+		if (batch.pipeline == DRAW_PIPELINE_MESHLET || batch.pipeline == DRAW_PIPELINE_MESHLET_ALPHA)
+			continue;
+		const auto &prim = sceneGLTF.primsMeshCache[batch.primMesh];
+		const VkDrawIndexedIndirectCommand command{prim->lods[batch.lod].indexCount, batch.instanceCount, prim->lods[batch.lod].offsetIndex,
+		                                           static_cast<int32_t>(prim->offsetVertex), batch.firstInstance};
+		if (USE_GPU_CULLING) {
+			cullCommands[commandCount] = command;
+			cullCommands[commandCount].instanceCount = 0;
+			for (uint32_t i = 0; i < batch.instanceCount; ++i) {
+				const DrawItem &item = drawList[batch.firstInstance + i];
+				cullInstances[cullCount++] = {{item.minBound.x, item.minBound.y, item.minBound.z}, commandCount, {item.maxBound.x, item.maxBound.y, item.maxBound.z},
+				                              batch.firstInstance + i};
+			}
+		} else {
+			drawCommands[commandCount] = command;
+			std::iota(visibleInstances + batch.firstInstance, visibleInstances + batch.firstInstance + batch.instanceCount, batch.firstInstance);
+		}
+		indirectGroupEnd[indirectGroup(batch.pipeline, prim->indexType)] = ++commandCount;
+	}
+	// an empty group ends where the previous one does
+	for (uint32_t group = 1; group < INDIRECT_GROUP_COUNT; ++group)
+		indirectGroupEnd[group] = std::max(indirectGroupEnd[group], indirectGroupEnd[group - 1]);
+	for (uint32_t group = 0; group < INDIRECT_GROUP_COUNT; ++group)
+		drawCounts[group] = USE_GPU_CULLING ? 0 : indirectGroupEnd[group] - (group == 0 ? 0 : indirectGroupEnd[group - 1]);
+	if (!USE_GPU_CULLING || commandCount == 0)
+		return;
+
+	const VkDeviceAddress indirectAddress = vulkanite_raytrace::getBufferDeviceAddress(sceneGLTF.indirectBuffers[currentFrame]);
+
+	CullPushConstants cull{};
+	cull.viewProj = cameraViewProj();
+	cull.cullInstances = indirectAddress + layout.cullInstances;
+	cull.commands = indirectAddress + layout.cullCommands;
+	cull.visibleInstances = indirectAddress + layout.visibleInstances;
+	cull.count = cullCount;
+
+	CompactPushConstants compact{};
+	compact.commands = indirectAddress + layout.cullCommands;
+	compact.drawCommands = indirectAddress + INDIRECT_COMMANDS_OFFSET;
+	compact.drawCounts = indirectAddress;
+	compact.count = commandCount;
+	std::copy(indirectGroupEnd.begin(), indirectGroupEnd.end(), compact.groupEnd);
+
+	recordCulling(commandBuffer, cull, compact);
+}
 
+void prepareSceneGLTF(VkCommandBuffer commandBuffer, uint32_t currentFrame) {
+	const bool drawMeshlets = USE_MESH_SHADER && sceneGLTF.meshletsBuffer.buffer;
+
+	drawList.clear();
+	drawBatches.clear();
+	uniformObj = nullptr;
+	if (USE_INSTANCE_BVH) {
+		// only the instances in the frustum
+		static std::vector<uint32_t> visibleInstances;
+		static uint64_t frame = 0;
+		++frame;
+		visibleInstances.clear();
+		const glm::mat4 viewProj = cameraViewProj();
+		cullInstanceBvh(sceneGLTF.instanceBvh, viewProj, visibleInstances);
+		for (uint32_t i : visibleInstances) {
+			BvhInstance &instance = sceneGLTF.instanceBvh.instances[i];
+			// the previous transform of an instance back in the frustum is stale, no motion for its first frame
+			if (instance.visibleFrame + 1 != frame)
+				instance.obj->PrevModelViewProjectionMat = viewProj * instance.world;
+			instance.visibleFrame = frame;
+			addDrawItem(*instance.obj, *sceneGLTF.primsMeshCache[instance.obj->primMesh], instance.world, instance.minBound, instance.maxBound, drawMeshlets);
+		}
+	} else {
+		for (auto &obj : sceneGLTF.roots)
+			gatherDrawList(obj, glm::mat4(1), drawMeshlets);
+	}
+	if (drawList.empty())
+		return;
+	std::sort(drawList.begin(), drawList.end(), [](const DrawItem &a, const DrawItem &b) { return a.key < b.key; });
+
+	// the uniform buffer is the same for all the objects, the set of the first one is bound for the whole pass
+	uniformObj = drawList.front().obj;
 #ifdef DRAW_RASTERIZE
-		vkCmdPushConstants(commandBuffer, sceneGLTF.pipelineLayout, VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(uint32_t), &obj.mat);
+	updateUniformBuffer(currentFrame, *uniformObj);
+#else
+	updateUniformBufferMotionVector(currentFrame, *uniformObj);
 #endif
 
-		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(sceneGLTF.primsMeshCache[obj.primMesh]->indices.size()), 1, 0, 0, 0);
+	// the instances of the frame in the instance buffer, in the order of the list
+	auto *instances = static_cast<InstanceData *>(sceneGLTF.instanceBuffersMapped[currentFrame]);
+	for (size_t begin = 0, end; begin < drawList.size(); begin = end) {
+		const uint64_t key = drawList[begin].key;
+		for (end = begin + 1; end < drawList.size() && drawList[end].key == key;)
+			++end;
+		const DrawBatch batch{static_cast<uint32_t>(key >> 57), drawList[begin].obj->primMesh, static_cast<uint32_t>(key & 0xFF), static_cast<uint32_t>(begin),
+		                      static_cast<uint32_t>(end - begin)};
+		for (uint32_t i = 0; i < batch.instanceCount; ++i)
+			updateInstanceData(instances[batch.firstInstance + i], *drawList[begin + i].obj, drawList[begin + i].world);
+		drawBatches.push_back(batch);
 	}
 
-	for (auto &objChild : obj.children)
-		drawModelGLTF(commandBuffer, currentFrame, objChild, obj.world * parent_world, isRenderingAlphaPass);
+	if (USE_INDIRECT_DRAW)
+		writeIndirectCommands(commandBuffer, currentFrame);
 }
 
 void drawSceneGLTF(VkCommandBuffer commandBuffer, uint32_t currentFrame) {
-	// draw opaque
-	for (auto &obj : sceneGLTF.roots)
-		drawModelGLTF(commandBuffer, currentFrame, obj, glm::mat4(1), false);
-	// draw alpha
-	for (auto &obj : sceneGLTF.roots)
-		drawModelGLTF(commandBuffer, currentFrame, obj, glm::mat4(1), true);
+	if (drawBatches.empty())
+		return;
+
+	// the prims with meshlets are drawn by the task/mesh shaders, one task workgroup per 32 meshlets and instance
+	MeshletPushConstants meshletPushConstants{};
+	const bool drawMeshlets = USE_MESH_SHADER && sceneGLTF.meshletsBuffer.buffer;
+
+	// all the prims are in the same vertex/index buffers, the instances of the frame in the instance buffer
+	if (!USE_INDIRECT_DRAW) {
+		VkBuffer vertexBuffers[] = {sceneGLTF.allVerticesBuffer, sceneGLTF.instanceBuffers[currentFrame]};
+		VkDeviceSize offsets[] = {0, 0};
+		vkCmdBindVertexBuffers(commandBuffer, 0, 2, vertexBuffers, offsets);
+	}
+	if (drawMeshlets) {
+		meshletPushConstants.meshlets = vulkanite_raytrace::getBufferDeviceAddress(sceneGLTF.meshletsBuffer.buffer);
+		meshletPushConstants.meshletVertices = vulkanite_raytrace::getBufferDeviceAddress(sceneGLTF.meshletVerticesBuffer.buffer);
+		meshletPushConstants.meshletTriangles = vulkanite_raytrace::getBufferDeviceAddress(sceneGLTF.meshletTrianglesBuffer.buffer);
+		meshletPushConstants.vertices = vulkanite_raytrace::getBufferDeviceAddress(sceneGLTF.allVerticesBuffer);
+		meshletPushConstants.instances = vulkanite_raytrace::getBufferDeviceAddress(sceneGLTF.instanceBuffers[currentFrame]);
+	}
+	IndirectPushConstants indirectPushConstants{};
+	if (USE_INDIRECT_DRAW) {
+		indirectPushConstants.vertices = vulkanite_raytrace::getBufferDeviceAddress(sceneGLTF.allVerticesBuffer);
+		indirectPushConstants.instances = vulkanite_raytrace::getBufferDeviceAddress(sceneGLTF.instanceBuffers[currentFrame]);
+		indirectPushConstants.visibleInstances =
+			vulkanite_raytrace::getBufferDeviceAddress(sceneGLTF.indirectBuffers[currentFrame]) + indirectLayout(sceneGLTF.instanceCapacity).visibleInstances;
+	}
+
+	// state bound on the command buffer, only the changes are recorded
+	VkPipeline boundPipeline = VK_NULL_HANDLE;
+	VkPipelineLayout boundLayout = VK_NULL_HANDLE;
+	// index type bound on the command buffer, prims have 16 or 32 bits indices in the same buffer
+	VkIndexType boundIndexType = VK_INDEX_TYPE_MAX_ENUM;
+	[[maybe_unused]] uint32_t stateChanges = 0, drawCalls = 0;
+	auto bindState = [&](VkPipeline pipeline, VkPipelineLayout layout) {
+		if (pipeline != boundPipeline) {
+			vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+			boundPipeline = pipeline;
+			++stateChanges;
+		}
+		if (layout != boundLayout) {
+			vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 0, 1, &uniformObj->descriptorSets[currentFrame], 0, nullptr);
+			if (layout == sceneGLTF.indirectPipelineLayout || layout == sceneGLTF.indirectPipelineLayoutAlpha)
+				vkCmdPushConstants(commandBuffer, layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(IndirectPushConstants), &indirectPushConstants);
+			boundLayout = layout;
+			++stateChanges;
+		}
+	};
+	auto bindIndexType = [&](VkIndexType indexType) {
+		if (indexType != boundIndexType) {
+			vkCmdBindIndexBuffer(commandBuffer, sceneGLTF.allIndicesBuffer, 0, indexType);
+			boundIndexType = indexType;
+			++stateChanges;
+		}
+	};
+
+	// one vkCmdDrawIndexedIndirectCount per group, the counts are in the indirect buffer
+	uint32_t drawnGroup = INDIRECT_GROUP_COUNT;
+	auto drawIndirectGroup = [&](uint32_t group) {
+		const bool isAlpha = group >= INDIRECT_GROUP_ALPHA_16;
+		const uint32_t groupFirst = group == 0 ? 0 : indirectGroupEnd[group - 1];
+		bindState(isAlpha ? sceneGLTF.indirectPipelineAlpha : sceneGLTF.indirectPipeline, isAlpha ? sceneGLTF.indirectPipelineLayoutAlpha : sceneGLTF.indirectPipelineLayout);
+		bindIndexType(group % 2 ? VK_INDEX_TYPE_UINT32 : VK_INDEX_TYPE_UINT16);
+		vkCmdDrawIndexedIndirectCountKHR(commandBuffer, sceneGLTF.indirectBuffers[currentFrame], INDIRECT_COMMANDS_OFFSET + groupFirst * sizeof(VkDrawIndexedIndirectCommand),
+		                                 sceneGLTF.indirectBuffers[currentFrame], group * sizeof(uint32_t), indirectGroupEnd[group] - groupFirst,
+		                                 sizeof(VkDrawIndexedIndirectCommand));
+		++drawCalls;
+	};
+
+	for (const auto &batch : drawBatches) {
+		const bool isAlpha = batch.pipeline == DRAW_PIPELINE_MESHLET_ALPHA || batch.pipeline == DRAW_PIPELINE_VERTEX_ALPHA;
+		const bool meshlets = batch.pipeline == DRAW_PIPELINE_MESHLET || batch.pipeline == DRAW_PIPELINE_MESHLET_ALPHA;
+		const auto &prim = sceneGLTF.primsMeshCache[batch.primMesh];
+
+		if (meshlets) {
+			const VkPipelineLayout layout = isAlpha ? sceneGLTF.meshPipelineLayoutAlpha : sceneGLTF.meshPipelineLayout;
+			bindState(isAlpha ? sceneGLTF.meshPipelineAlpha : sceneGLTF.meshPipeline, layout);
+
+			meshletPushConstants.offsetMeshlet = prim->offsetMeshlet;
+			meshletPushConstants.meshletCount = prim->meshletCount;
+			meshletPushConstants.offsetVertex = prim->offsetVertex;
+			meshletPushConstants.firstInstance = batch.firstInstance;
+			vkCmdPushConstants(commandBuffer, layout, VK_SHADER_STAGE_TASK_BIT_EXT | VK_SHADER_STAGE_MESH_BIT_EXT, 0, sizeof(MeshletPushConstants), &meshletPushConstants);
+
+			vkCmdDrawMeshTasksEXT(commandBuffer, (prim->meshletCount + 31) / 32, batch.instanceCount, 1);
+			++drawCalls;
+		} else if (USE_INDIRECT_DRAW) {
+			// the whole group at its first batch
+			const uint32_t group = indirectGroup(batch.pipeline, prim->indexType);
+			if (group != drawnGroup) {
+				drawIndirectGroup(group);
+				drawnGroup = group;
+			}
+		} else {
+			bindState(isAlpha ? sceneGLTF.graphicsPipelineAlpha : sceneGLTF.graphicsPipeline, isAlpha ? sceneGLTF.pipelineLayoutAlpha : sceneGLTF.pipelineLayout);
+			bindIndexType(prim->indexType);
+			vkCmdDrawIndexed(commandBuffer, prim->lods[batch.lod].indexCount, batch.instanceCount, prim->lods[batch.lod].offsetIndex, static_cast<int32_t>(prim->offsetVertex),
+			                 batch.firstInstance);
+			++drawCalls;
+		}
+	}
+
+#ifdef DEBUG
+	// the list changes with the camera, only logged by the debug builds
+	static size_t loggedDrawCount = 0;
+	if (drawList.size() != loggedDrawCount) {
+		spdlog::debug(fmt::format("Draw list: {} objects, {} draw calls, {} state changes", drawList.size(), drawCalls, stateChanges));
+		loggedDrawCount = drawList.size();
+	}
+#endif
 }
 
 void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t currentFrame) {
@@ -193,6 +607,14 @@ void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t currentFrame) {
 		throw std::runtime_error("failed to begin recording command buffer!");
 	}
 
+#if !defined DRAW_RASTERIZE
+	// refit the TLAS first, it can overlap with the motion vector pass
+	vulkanite_raytrace::updateTopLevelAccelerationStructure(commandBuffer, currentFrame);
+#endif
+
+	// draw list and instances of the frame, the culling is recorded before the pass
+	prepareSceneGLTF(commandBuffer, currentFrame);
+
 	// rasterize motion vector/depth pass
 	std::array<VkClearValue, 2> clearValues{};
 	clearValues[0].color = {{0.0f, 0.0f, 0.0f, 1.0f}};
@@ -227,6 +649,10 @@ void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t currentFrame) {
 
 	vkCmdEndRenderPass(commandBuffer);
 
+	// the depth of this frame occludes the instances of the next one
+	if (USE_GPU_CULLING)
+		recordDepthPyramid(commandBuffer, currentFrame);
+
 #if !defined DRAW_RASTERIZE
 	// raytrace
 	vulkanite_raytrace::buildCommandBuffers(commandBuffer, currentFrame);
@@ -298,6 +724,14 @@ void destroyScene() {
 	vkDestroyPipelineLayout(device, sceneGLTF.pipelineLayout, nullptr);
 	vkDestroyPipeline(device, sceneGLTF.graphicsPipelineAlpha, nullptr);
 	vkDestroyPipelineLayout(device, sceneGLTF.pipelineLayoutAlpha, nullptr);
+	vkDestroyPipeline(device, sceneGLTF.meshPipeline, nullptr);
+	vkDestroyPipelineLayout(device, sceneGLTF.meshPipelineLayout, nullptr);
+	vkDestroyPipeline(device, sceneGLTF.meshPipelineAlpha, nullptr);
+	vkDestroyPipelineLayout(device, sceneGLTF.meshPipelineLayoutAlpha, nullptr);
+	vkDestroyPipeline(device, sceneGLTF.indirectPipeline, nullptr);
+	vkDestroyPipelineLayout(device, sceneGLTF.indirectPipelineLayout, nullptr);
+	vkDestroyPipeline(device, sceneGLTF.indirectPipelineAlpha, nullptr);
+	vkDestroyPipelineLayout(device, sceneGLTF.indirectPipelineLayoutAlpha, nullptr);
 
 	vkDestroyRenderPass(device, sceneGLTF.renderPass, nullptr);
 
@@ -317,27 +751,39 @@ void destroyScene() {
 void deleteModel() {
 	std::function<void(objectGLTF &)> f;
 
-	f = [=](objectGLTF &obj) {
+	f = [&](objectGLTF &obj) {
 		if (sceneGLTF.primsMeshCache[obj.primMesh]) {
 			for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-				if (i < obj.uniformBuffers.size())
+				if (i < obj.uniformBuffers.size()) {
+					freeBufferMemory(obj.uniformBuffers[i]);
 					vkDestroyBuffer(device, obj.uniformBuffers[i], nullptr);
-				if (i < obj.uniformBuffersMemory.size())
-					vkFreeMemory(device, obj.uniformBuffersMemory[i], nullptr);
+				}
 			}
-
-			// TODO delete from the cache
-			// vkDestroyBuffer(device, sceneGLTF.primsMeshCache[obj.primMesh]->indexBuffer, nullptr);
-			// vkFreeMemory(device, sceneGLTF.primsMeshCache[obj.primMesh]->indexBufferMemory, nullptr);
-
-			// vkDestroyBuffer(device, sceneGLTF.primsMeshCache[obj.primMesh]->vertexBuffer, nullptr);
-			// vkFreeMemory(device, sceneGLTF.primsMeshCache[obj.primMesh]->vertexBufferMemory, nullptr);
 		}
-		for (const auto &objChild : obj.children)
-			f(obj);
+		for (auto &objChild : obj.children)
+			f(objChild);
 	};
 
 	for (auto o : sceneGLTF.roots) {
 		f(o);
 	}
+
+	for (size_t i = 0; i < sceneGLTF.instanceBuffers.size(); i++) {
+		freeBufferMemory(sceneGLTF.instanceBuffers[i]);
+		vkDestroyBuffer(device, sceneGLTF.instanceBuffers[i], nullptr);
+	}
+	for (size_t i = 0; i < sceneGLTF.indirectBuffers.size(); i++) {
+		freeBufferMemory(sceneGLTF.indirectBuffers[i]);
+		vkDestroyBuffer(device, sceneGLTF.indirectBuffers[i], nullptr);
+	}
+
+	// scene geometry
+	freeBufferMemory(sceneGLTF.allVerticesBuffer);
+	vkDestroyBuffer(device, sceneGLTF.allVerticesBuffer, nullptr);
+	freeBufferMemory(sceneGLTF.allIndicesBuffer);
+	vkDestroyBuffer(device, sceneGLTF.allIndicesBuffer, nullptr);
+	sceneGLTF.offsetPrimsBuffer.destroy();
+	sceneGLTF.meshletsBuffer.destroy();
+	sceneGLTF.meshletVerticesBuffer.destroy();
+	sceneGLTF.meshletTrianglesBuffer.destroy();
 }
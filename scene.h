@@ -3,6 +3,7 @@
 #include <map>
 
 #include "loaderGltf.h"
+#include "instance_bvh.h"
 #include "VulkanBuffer.h"
 
 //#define DRAW_RASTERIZE
@@ -10,7 +11,6 @@
 struct StorageImage;
 
 struct UniformBufferObject {
-	glm::mat4 model;
 	glm::mat4 view;
 	glm::mat4 invView;
 	glm::mat4 proj;
@@ -26,7 +26,7 @@ struct UBOParams {
 };
 
 struct UniformBufferObjectMotionVector {
-	glm::mat4 modelViewProjectionMat, prevModelViewProjectionMat, jitterMat;
+	glm::mat4 jitterMat;
 };
 
 struct SceneVulkanite {
@@ -34,10 +34,30 @@ struct SceneVulkanite {
 
 	std::vector<objectGLTF> roots;
 
+	// geometry of all the prims, used by the rasterizer, the BLAS and the closest hit shader
 	VkBuffer allVerticesBuffer;
+	VkDeviceMemory allVerticesBufferMemory;
 	VkBuffer allIndicesBuffer;
+	VkDeviceMemory allIndicesBufferMemory;
 	Buffer offsetPrimsBuffer;
 	Buffer materialsCacheBuffer;
+	// meshlets of all the prims, only with the mesh shader path
+	Buffer meshletsBuffer;
+	Buffer meshletVerticesBuffer;
+	Buffer meshletTrianglesBuffer;
+
+	// per instance data of the raster draws, objects sharing a prim and a material are drawn in one instanced call
+	std::vector<VkBuffer> instanceBuffers;
+	std::vector<VkDeviceMemory> instanceBuffersMemory;
+	std::vector<void *> instanceBuffersMapped;
+	uint32_t instanceCapacity{0};
+	// draw counts and commands of the indirect draws with the inputs of the culling, one buffer per frame in flight
+	std::vector<VkBuffer> indirectBuffers;
+	std::vector<VkDeviceMemory> indirectBuffersMemory;
+	std::vector<void *> indirectBuffersMapped;
+
+	// the drawable objects in a BVH, the raster draw list is culled with it
+	InstanceBvh instanceBvh;
 
 	std::map<uint32_t, std::shared_ptr<textureGLTF>> textureCache;
 	std::map<uint32_t, std::shared_ptr<primMeshGLTF>> primsMeshCache;
@@ -53,6 +73,12 @@ struct SceneVulkanite {
 	VkDescriptorSetLayout descriptorSetLayout;
 	VkPipelineLayout pipelineLayout, pipelineLayoutAlpha;
 	VkPipeline graphicsPipeline, graphicsPipelineAlpha;
+	// task/mesh shader variant of the motion vector pipelines, the meshlets are culled on the GPU
+	VkPipelineLayout meshPipelineLayout{VK_NULL_HANDLE}, meshPipelineLayoutAlpha{VK_NULL_HANDLE};
+	VkPipeline meshPipeline{VK_NULL_HANDLE}, meshPipelineAlpha{VK_NULL_HANDLE};
+	// vertex pulling variant of the vertex pipelines, drawn with vkCmdDrawIndexedIndirectCount
+	VkPipelineLayout indirectPipelineLayout{VK_NULL_HANDLE}, indirectPipelineLayoutAlpha{VK_NULL_HANDLE};
+	VkPipeline indirectPipeline{VK_NULL_HANDLE}, indirectPipelineAlpha{VK_NULL_HANDLE};
 	
 #ifdef DRAW_RASTERIZE
 	std::vector<StorageImage> storageImagesRasterize;
@@ -69,10 +95,27 @@ struct SceneVulkanite {
 
 extern SceneVulkanite sceneGLTF;
 extern bool USE_DLSS;
+// draw the motion vector pass with the task/mesh shaders, reset at the device creation if VK_EXT_mesh_shader is not supported
+extern bool USE_MESH_SHADER;
+// draw the vertex pipeline batches from an indirect buffer with vertex pulling, reset at the device creation if VK_KHR_draw_indirect_count is not supported
+extern bool USE_INDIRECT_DRAW;
+// per instance level of detail, picked from the projected simplification error
+extern bool USE_LOD;
+// assets loaded at startup, they default to the ones set in the CMakeLists and can be overridden on the command line
+// a path is read from the disk (memory-mapped) if the file exists, from the resources embedded in the executable otherwise
+extern std::string MODEL_PATH;
+extern std::string ENVMAP_PATH;
 
 void loadSceneGLTF();
+// level of detail of the prim for an instance at world, same choice for the raster and the raytrace
+uint32_t selectPrimLod(const primMeshGLTF &prim, const glm::mat4 &world);
+// instance buffers sized for every drawable object of the loaded scene
+void createSceneInstanceBuffers();
 void initSceneGLTF();
 void updateSceneGLTF(float deltaTime);
+// sorted draw list, instance data and indirect commands of the frame, records the culling pass, outside the render pass
+void prepareSceneGLTF(VkCommandBuffer commandBuffer, uint32_t currentFrame);
+// the batches of prepareSceneGLTF, inside the render pass
 void drawSceneGLTF(VkCommandBuffer commandBuffer, uint32_t currentFrame);
 void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex);
 void destroyScene();
@@ -0,0 +1,31 @@
+// shared declarations of the culling compute shaders, layouts match culling.h
+
+#extension GL_EXT_buffer_reference : require
+#extension GL_EXT_scalar_block_layout : require
+
+// culling.h CULL_FRUSTUM/CULL_OCCLUSION
+#define CULL_FRUSTUM 1
+#define CULL_OCCLUSION 2
+// scene.cpp IndirectGroup
+#define INDIRECT_GROUP_COUNT 4
+
+// world space box of an instance and the command drawing it
+struct CullInstance {
+	vec3 minBound;
+	uint command;
+	vec3 maxBound;
+	uint instance;
+};
+
+// VkDrawIndexedIndirectCommand
+struct DrawCommand {
+	uint indexCount;
+	uint instanceCount;
+	uint firstIndex;
+	int vertexOffset;
+	uint firstInstance;
+};
+
+layout(buffer_reference, scalar, buffer_reference_align = 16) readonly buffer CullInstances { CullInstance c[]; };
+layout(buffer_reference, scalar, buffer_reference_align = 4) buffer DrawCommands { DrawCommand d[]; };
+layout(buffer_reference, scalar, buffer_reference_align = 4) buffer Uints { uint u[]; };
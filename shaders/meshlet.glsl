@@ -0,0 +1,52 @@
+// shared declarations of the meshlet task/mesh shaders, layouts match vertex_config.h and loaderGltf.h
+
+#extension GL_EXT_buffer_reference : require
+#extension GL_EXT_scalar_block_layout : require
+
+// meshlets handled by one task workgroup
+#define MESHLETS_PER_TASK 32
+// loaderGltf.h MESHLET_MAX_VERTICES/MESHLET_MAX_TRIANGLES
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_TRIANGLES 124
+
+struct Meshlet {
+	uint vertexOffset;
+	uint triangleOffset;
+	uint vertexCount;
+	uint triangleCount;
+	vec4 sphere; // center, radius
+	vec4 cone; // axis, cutoff
+};
+
+struct InstanceData {
+	mat4 transform;
+	mat4 prevTransform;
+	uint material;
+	uint padding0, padding1, padding2;
+};
+
+layout(buffer_reference, scalar, buffer_reference_align = 16) readonly buffer Meshlets { Meshlet m[]; };
+layout(buffer_reference, scalar, buffer_reference_align = 4) readonly buffer Uints { uint u[]; };
+layout(buffer_reference, scalar, buffer_reference_align = 16) readonly buffer Instances { InstanceData i[]; };
+
+layout(push_constant, scalar) uniform MeshletPushConstants {
+	Meshlets meshlets;
+	Uints meshletVertices;
+	Uints meshletTriangles;
+	Uints vertices; // PackedVertex, 8 uints, position first
+	Instances instances;
+	uint offsetMeshlet;
+	uint meshletCount;
+	uint offsetVertex;
+	uint firstInstance;
+} pc;
+
+layout(binding = 0) uniform UniformBufferObject {
+	mat4 uJitterMat;
+} ubo;
+
+// meshlets surviving the culling of the task workgroup
+struct TaskPayload {
+	uint meshletIndices[MESHLETS_PER_TASK];
+	uint instance;
+};
@@ -0,0 +1,102 @@
+// single pass downsampler shared by the mipmap compute shaders, MIP_FORMAT is the storage format of the texture
+// each workgroup reduces a 64x64 tile of the base level to the 6 next levels, the last workgroup to finish
+// reduces the 64x64 texels of level 6 to the levels 7 to 12, textures up to 4096x4096 in one dispatch
+
+#define MAX_MIP_LEVELS 13
+#define TILE_SIZE 64
+
+layout(local_size_x = 256) in;
+
+layout(set = 0, binding = 0, MIP_FORMAT) uniform coherent image2D mips[MAX_MIP_LEVELS];
+layout(set = 0, binding = 1) coherent buffer Counters { uint counters[]; };
+
+layout(push_constant) uniform MipmapPushConstants {
+	ivec2 size; // base level
+	uint mipLevels;
+	uint srgb; // the texels are sRGB encoded, they are averaged in linear
+	uint counterIndex;
+} pc;
+
+shared vec4 tile[16][16];
+shared bool isLastGroup;
+
+vec4 toLinear(vec4 c) {
+	if (pc.srgb == 0)
+		return c;
+	bvec3 low = lessThanEqual(c.rgb, vec3(0.04045));
+	return vec4(mix(pow((c.rgb + 0.055) / 1.055, vec3(2.4)), c.rgb / 12.92, low), c.a);
+}
+
+vec4 toStored(vec4 c) {
+	if (pc.srgb == 0)
+		return c;
+	bvec3 low = lessThanEqual(c.rgb, vec3(0.0031308));
+	return vec4(mix(1.055 * pow(c.rgb, vec3(1.0 / 2.4)) - 0.055, c.rgb * 12.92, low), c.a);
+}
+
+ivec2 levelSize(uint level) {
+	return max(pc.size >> level, ivec2(1));
+}
+
+// linear average of the 2x2 texels of srcLevel at p, clamped to the level
+vec4 loadQuad(uint srcLevel, ivec2 p) {
+	ivec2 last = levelSize(srcLevel) - 1;
+	return 0.25 * (toLinear(imageLoad(mips[srcLevel], min(p, last))) + toLinear(imageLoad(mips[srcLevel], min(p + ivec2(1, 0), last))) +
+	               toLinear(imageLoad(mips[srcLevel], min(p + ivec2(0, 1), last))) + toLinear(imageLoad(mips[srcLevel], min(p + ivec2(1, 1), last))));
+}
+
+void store(uint level, ivec2 p, vec4 c) {
+	if (level < pc.mipLevels && all(lessThan(p, levelSize(level))))
+		imageStore(mips[level], p, toStored(c));
+}
+
+// reduce the 64x64 texels of srcLevel at tileId to the 6 next levels
+void downsampleTile(uint srcLevel, ivec2 tileId) {
+	uint t = gl_LocalInvocationIndex;
+	ivec2 local = ivec2(t % 16, t / 16);
+
+	// 2x2 texels of the first level per thread, they make one texel of the second without sharing
+	ivec2 base = tileId * (TILE_SIZE / 2) + local * 2;
+	vec4 sum = vec4(0.0);
+	for (int i = 0; i < 4; ++i) {
+		ivec2 p = base + ivec2(i & 1, i >> 1);
+		vec4 c = loadQuad(srcLevel, p * 2);
+		store(srcLevel + 1, p, c);
+		sum += c;
+	}
+	vec4 c = 0.25 * sum;
+	store(srcLevel + 2, tileId * (TILE_SIZE / 4) + local, c);
+	tile[local.y][local.x] = c;
+
+	// the next levels in shared memory, a quarter of the threads each time
+	for (uint level = 3, width = 8; level <= 6; ++level, width /= 2) {
+		barrier();
+		if (t < width * width) {
+			ivec2 p = ivec2(t % width, t / width);
+			c = 0.25 * (tile[p.y * 2][p.x * 2] + tile[p.y * 2][p.x * 2 + 1] + tile[p.y * 2 + 1][p.x * 2] + tile[p.y * 2 + 1][p.x * 2 + 1]);
+		}
+		barrier();
+		if (t < width * width) {
+			ivec2 p = ivec2(t % width, t / width);
+			tile[p.y][p.x] = c;
+			store(srcLevel + level, tileId * int(width) + p, c);
+		}
+	}
+}
+
+void main() {
+	downsampleTile(0, ivec2(gl_WorkGroupID.xy));
+	if (pc.mipLevels <= 7)
+		return;
+
+	// the last workgroup sees the level 6 of all the others
+	memoryBarrierImage();
+	barrier();
+	if (gl_LocalInvocationIndex == 0)
+		isLastGroup = atomicAdd(counters[pc.counterIndex], 1) == gl_NumWorkGroups.x * gl_NumWorkGroups.y - 1;
+	barrier();
+	if (!isLastGroup)
+		return;
+	memoryBarrierImage();
+	downsampleTile(6, ivec2(0));
+}
@@ -8,9 +8,9 @@ layout(location = 2) in vec2 fragTexCoord1;
 layout(location = 3) in vec3 fragNorm;
 layout(location = 4) in vec3 fragWorldPos;
 layout(location = 5) in vec4 fragTangent;
+layout(location = 6) flat in uint fragMaterial; // per instance
 
 layout(binding = 0) uniform UniformBufferObject {
-    mat4 model;
     mat4 view;
     mat4 invView;
     mat4 proj;
@@ -56,10 +56,6 @@ struct Material{
 
 layout(binding = 4) buffer MaterialMap {Material v[]; } materialsMap;
 
-layout (push_constant) uniform MaterialID {
-int id;
-} materialID;
-
 layout(location = 0) out vec4 outColor;
 
 
@@ -502,7 +498,7 @@ vec3 pbrComputeDiffuse(vec3 normal, vec3 diffColor, float occlusion)
 
 // Entry point of the forward pipeline default uber shader (Phong and PBR)
 void main() {
-	Material mat = materialsMap.v[materialID.id];
+	Material mat = materialsMap.v[fragMaterial];
 
 	vec4 albedo_color = texture(texturesMap[mat.albedoTex], mat.colorTextureSet == 0 ? fragTexCoord0 : fragTexCoord1 );
 	//albedo_color.xyz = albedo_color.xyz * mat.baseColorFactor.xyz;
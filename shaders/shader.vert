@@ -1,11 +1,13 @@
 #version 450
 
 layout(location = 0) in vec3 inPosition;
-layout(location = 1) in vec3 inNorm;
-layout(location = 2) in vec4 inTangent;
-layout(location = 3) in vec3 inColor;
+layout(location = 1) in vec2 inNorm; // octahedral
+layout(location = 2) in vec2 inTangent; // octahedral
+layout(location = 3) in vec4 inColor; // alpha is the bitangent sign
 layout(location = 4) in vec2 inTexCoord0;
 layout(location = 5) in vec2 inTexCoord1;
+layout(location = 6) in mat4 inModel; // per instance
+layout(location = 14) in uint inMaterial;
 
 layout(location = 0) out vec3 fragColor;
 layout(location = 1) out vec2 fragTexCoord0;
@@ -13,20 +15,28 @@ layout(location = 2) out vec2 fragTexCoord1;
 layout(location = 3) out vec3 fragNorm;
 layout(location = 4) out vec3 fragWorldPos;
 layout(location = 5) out vec4 fragTangent;
+layout(location = 6) flat out uint fragMaterial;
 
 layout(binding = 0) uniform UniformBufferObject {
-    mat4 model;
     mat4 view;
     mat4 invView;
     mat4 proj;
 } ubo;
 
+vec3 octDecode(vec2 e) {
+    vec3 v = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if (v.z < 0.0)
+        v.xy = (1.0 - abs(v.yx)) * vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+    return normalize(v);
+}
+
 void main() {
-    gl_Position = ubo.proj * ubo.view * ubo.model * vec4(inPosition, 1.0);
-    fragWorldPos = (ubo.model * vec4(inPosition, 1.0)).xyz;
-    fragColor = inColor;
+    gl_Position = ubo.proj * ubo.view * inModel * vec4(inPosition, 1.0);
+    fragWorldPos = (inModel * vec4(inPosition, 1.0)).xyz;
+    fragColor = inColor.rgb;
     fragTexCoord0 = inTexCoord0;
     fragTexCoord1 = inTexCoord1;
-    fragNorm = (ubo.model * vec4(inNorm, 0)).xyz;
-    fragTangent = vec4((ubo.model * vec4(inTangent.xyz, 0)).xyz, inTangent.w);
+    fragNorm = (inModel * vec4(octDecode(inNorm), 0)).xyz;
+    fragTangent = vec4((inModel * vec4(octDecode(inTangent), 0)).xyz, inColor.a * 2.0 - 1.0);
+    fragMaterial = inMaterial;
 }
\ No newline at end of file
@@ -0,0 +1,48 @@
+#version 460
+#extension GL_GOOGLE_include_directive : require
+
+// shader.vert with the vertices pulled from the scene buffer, for the indirect draws
+
+#include "vertexPulling.glsl"
+
+layout(location = 0) out vec3 fragColor;
+layout(location = 1) out vec2 fragTexCoord0;
+layout(location = 2) out vec2 fragTexCoord1;
+layout(location = 3) out vec3 fragNorm;
+layout(location = 4) out vec3 fragWorldPos;
+layout(location = 5) out vec4 fragTangent;
+layout(location = 6) flat out uint fragMaterial;
+
+layout(binding = 0) uniform UniformBufferObject {
+	mat4 view;
+	mat4 invView;
+	mat4 proj;
+} ubo;
+
+vec3 octDecode(vec2 e) {
+	vec3 v = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	if (v.z < 0.0)
+		v.xy = (1.0 - abs(v.yx)) * vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+	return normalize(v);
+}
+
+void main() {
+	InstanceData instance = fetchInstance();
+	mat4 model = instance.transform;
+
+	// PackedVertex: position, octahedral snorm16 normal and tangent, unorm8 color, half uvs
+	uint v = uint(gl_VertexIndex) * 8;
+	vec3 position = fetchPosition(uint(gl_VertexIndex));
+	vec2 norm = unpackSnorm2x16(pc.vertices.u[v + 3]);
+	vec2 tangent = unpackSnorm2x16(pc.vertices.u[v + 4]);
+	vec4 color = unpackUnorm4x8(pc.vertices.u[v + 5]);
+
+	gl_Position = ubo.proj * ubo.view * model * vec4(position, 1.0);
+	fragWorldPos = (model * vec4(position, 1.0)).xyz;
+	fragColor = color.rgb;
+	fragTexCoord0 = unpackHalf2x16(pc.vertices.u[v + 6]);
+	fragTexCoord1 = unpackHalf2x16(pc.vertices.u[v + 7]);
+	fragNorm = (model * vec4(octDecode(norm), 0)).xyz;
+	fragTangent = vec4((model * vec4(octDecode(tangent), 0)).xyz, color.a * 2.0 - 1.0);
+	fragMaterial = instance.material;
+}
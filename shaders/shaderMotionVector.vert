@@ -1,24 +1,24 @@
 #version 450
 
 layout(location = 0) in vec3 inPosition;
-layout(location = 1) in vec3 inNorm;
-layout(location = 2) in vec4 inTangent;
-layout(location = 3) in vec3 inColor;
+layout(location = 1) in vec2 inNorm; // octahedral
+layout(location = 2) in vec2 inTangent; // octahedral
+layout(location = 3) in vec4 inColor; // alpha is the bitangent sign
 layout(location = 4) in vec2 inTexCoord0;
 layout(location = 5) in vec2 inTexCoord1;
+layout(location = 6) in mat4 inModelViewProjectionMat; // per instance
+layout(location = 10) in mat4 inPrevModelViewProjectionMat;
 
 layout(location = 0) out vec4 vPosition;
 layout(location = 1) out vec4 vPrevPosition;
 
 layout(binding = 0) uniform UniformBufferObject {
-    mat4 uModelViewProjectionMat;
-    mat4 uPrevModelViewProjectionMat;
     mat4 uJitterMat;
 } ubo;
 
 void main() {
-    vPosition = ubo.uModelViewProjectionMat * ubo.uJitterMat * vec4(inPosition, 1.0);
-    vPrevPosition = ubo.uPrevModelViewProjectionMat * ubo.uJitterMat * vec4(inPosition, 1.0);
+    vPosition = inModelViewProjectionMat * ubo.uJitterMat * vec4(inPosition, 1.0);
+    vPrevPosition = inPrevModelViewProjectionMat * ubo.uJitterMat * vec4(inPosition, 1.0);
 
     gl_Position = vPosition;
 }
\ No newline at end of file
@@ -0,0 +1,23 @@
+#version 460
+#extension GL_GOOGLE_include_directive : require
+
+// shaderMotionVector.vert with the vertices pulled from the scene buffer, for the indirect draws
+
+#include "vertexPulling.glsl"
+
+layout(location = 0) out vec4 vPosition;
+layout(location = 1) out vec4 vPrevPosition;
+
+layout(binding = 0) uniform UniformBufferObject {
+	mat4 uJitterMat;
+} ubo;
+
+void main() {
+	InstanceData instance = fetchInstance();
+	vec4 position = ubo.uJitterMat * vec4(fetchPosition(uint(gl_VertexIndex)), 1.0);
+
+	vPosition = instance.transform * position;
+	vPrevPosition = instance.prevTransform * position;
+
+	gl_Position = vPosition;
+}
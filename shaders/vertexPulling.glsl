@@ -0,0 +1,31 @@
+// shared declarations of the indirect draw vertex shaders, layouts match vertex_config.h
+// the vertices and the instances are read by index: gl_VertexIndex includes the vertexOffset of the draw command, gl_InstanceIndex its firstInstance
+// the instances go through visibleInstances, the list written by the culling pass (identity without it)
+
+#extension GL_EXT_buffer_reference : require
+#extension GL_EXT_scalar_block_layout : require
+
+struct InstanceData {
+	mat4 transform;
+	mat4 prevTransform;
+	uint material;
+	uint padding0, padding1, padding2;
+};
+
+layout(buffer_reference, scalar, buffer_reference_align = 4) readonly buffer Uints { uint u[]; };
+layout(buffer_reference, scalar, buffer_reference_align = 16) readonly buffer Instances { InstanceData i[]; };
+
+layout(push_constant, scalar) uniform IndirectPushConstants {
+	Uints vertices; // PackedVertex, 8 uints, position first
+	Instances instances;
+	Uints visibleInstances;
+} pc;
+
+InstanceData fetchInstance() {
+	return pc.instances.i[pc.visibleInstances.u[gl_InstanceIndex]];
+}
+
+vec3 fetchPosition(uint vertex) {
+	uint v = vertex * 8;
+	return vec3(uintBitsToFloat(pc.vertices.u[v]), uintBitsToFloat(pc.vertices.u[v + 1]), uintBitsToFloat(pc.vertices.u[v + 2]));
+}
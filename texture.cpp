@@ -1,10 +1,15 @@
 #include "texture.h"
 #include "core_utils.h"
+#include "rasterizer.h"
+#include "upload_engine.h"
 
 #include <string>
 #include <stdexcept>
 #include <cmath>
+#include <algorithm>
+#include <array>
 #include <fmt/core.h>
+#include <spdlog/spdlog.h>
 #include <filesystem>
 namespace fs = std::filesystem;
 
@@ -12,7 +17,277 @@ namespace fs = std::filesystem;
 #include <stb_image.h>
 
 
-void generateMipmaps(VkImage image, VkFormat imageFormat, int32_t texWidth, int32_t texHeight, uint32_t mipLevels) {
+// the uploads of many textures are recorded in one submission of the upload engine, their data staged in its ring
+// the batch is submitted at its end, or when the ring is full, without waiting
+bool USE_COMPUTE_MIPMAPS = true;
+
+// mipmap.glsl, one dispatch builds up to 13 levels
+static const uint32_t MIPMAP_MAX_LEVELS = 13;
+static const uint32_t MIPMAP_TILE_SIZE = 64;
+
+struct MipmapPushConstants {
+	int32_t width, height;
+	uint32_t mipLevels;
+	uint32_t srgb;
+	uint32_t counterIndex;
+};
+
+// a texture whose levels are built by the compute downsampler when its batch is submitted
+struct MipmapJob {
+	VkImage image;
+	VkFormat format;
+	int32_t width, height;
+	uint32_t mipLevels;
+	bool srgb;
+	std::vector<VkImageView> views;
+};
+
+static VkDescriptorSetLayout mipmapDescriptorSetLayout = VK_NULL_HANDLE;
+static VkPipelineLayout mipmapPipelineLayout = VK_NULL_HANDLE;
+static VkPipeline mipmapPipelineRgba8 = VK_NULL_HANDLE;
+static VkPipeline mipmapPipelineRgba32f = VK_NULL_HANDLE;
+
+struct TextureUploadBatch {
+	uint32_t depth{0};
+	uint32_t textureCount{0};
+	uint32_t submitCount{0};
+	std::vector<MipmapJob> mipmapJobs;
+};
+static TextureUploadBatch uploadBatch;
+
+static VkPipeline createMipmapPipeline(const std::string &shaderPath) {
+	VkComputePipelineCreateInfo pipelineInfo{};
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	pipelineInfo.stage = loadShader(shaderPath, VK_SHADER_STAGE_COMPUTE_BIT);
+	pipelineInfo.layout = mipmapPipelineLayout;
+
+	VkPipeline pipeline;
+	VK_CHECK_RESULT(vkCreateComputePipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &pipeline));
+	vkDestroyShaderModule(device, pipelineInfo.stage.module, nullptr);
+	return pipeline;
+}
+
+static void createMipmapPipelines() {
+	std::array<VkDescriptorSetLayoutBinding, 2> bindings{};
+	bindings[0].binding = 0;
+	bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+	bindings[0].descriptorCount = MIPMAP_MAX_LEVELS;
+	bindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	bindings[1].binding = 1;
+	bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	bindings[1].descriptorCount = 1;
+	bindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+	VkDescriptorSetLayoutCreateInfo layoutInfo{};
+	layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	layoutInfo.bindingCount = static_cast<uint32_t>(bindings.size());
+	layoutInfo.pBindings = bindings.data();
+	VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &mipmapDescriptorSetLayout));
+
+	VkPushConstantRange pushConstantRange{VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(MipmapPushConstants)};
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.setLayoutCount = 1;
+	pipelineLayoutInfo.pSetLayouts = &mipmapDescriptorSetLayout;
+	pipelineLayoutInfo.pushConstantRangeCount = 1;
+	pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+	VK_CHECK_RESULT(vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &mipmapPipelineLayout));
+
+	mipmapPipelineRgba8 = createMipmapPipeline("spv/mipmapRgba8.comp.spv");
+	mipmapPipelineRgba32f = createMipmapPipeline("spv/mipmapRgba32f.comp.spv");
+}
+
+void destroyMipmapPipelines() {
+	if (mipmapPipelineLayout == VK_NULL_HANDLE)
+		return;
+	vkDestroyPipeline(device, mipmapPipelineRgba8, nullptr);
+	vkDestroyPipeline(device, mipmapPipelineRgba32f, nullptr);
+	vkDestroyPipelineLayout(device, mipmapPipelineLayout, nullptr);
+	vkDestroyDescriptorSetLayout(device, mipmapDescriptorSetLayout, nullptr);
+	mipmapPipelineLayout = VK_NULL_HANDLE;
+}
+
+// the formats of the shaders, written as storage images, the bigger textures keep the blits
+static bool canComputeMipmaps(VkFormat format, int32_t texWidth, int32_t texHeight) {
+	if (!USE_COMPUTE_MIPMAPS || (format != VK_FORMAT_R8G8B8A8_UNORM && format != VK_FORMAT_R32G32B32A32_SFLOAT))
+		return false;
+	if (static_cast<uint32_t>(std::max(texWidth, texHeight)) > MIPMAP_TILE_SIZE * MIPMAP_TILE_SIZE)
+		return false;
+	VkFormatProperties properties;
+	vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &properties);
+	return properties.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT;
+}
+
+// one dispatch per texture, then one barrier for the whole batch, the textures are acquired in GENERAL with their base level uploaded
+static void recordMipmapJobs(VkCommandBuffer commandBuffer) {
+	auto &jobs = uploadBatch.mipmapJobs;
+	if (jobs.empty())
+		return;
+	if (mipmapPipelineLayout == VK_NULL_HANDLE)
+		createMipmapPipelines();
+
+	const uint32_t jobCount = static_cast<uint32_t>(jobs.size());
+	std::array<VkDescriptorPoolSize, 2> poolSizes{{{VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, jobCount * MIPMAP_MAX_LEVELS}, {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, jobCount}}};
+	VkDescriptorPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	poolInfo.maxSets = jobCount;
+	poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
+	poolInfo.pPoolSizes = poolSizes.data();
+	VkDescriptorPool descriptorPool;
+	VK_CHECK_RESULT(vkCreateDescriptorPool(device, &poolInfo, nullptr, &descriptorPool));
+
+	// one counter per texture for its last workgroup
+	VkBuffer counters;
+	VkDeviceMemory countersMemory;
+	createBuffer(jobCount * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, counters,
+	             countersMemory);
+	vkCmdFillBuffer(commandBuffer, counters, 0, VK_WHOLE_SIZE, 0);
+
+	VkBufferMemoryBarrier counterBarrier{};
+	counterBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	counterBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	counterBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	counterBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	counterBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	counterBarrier.buffer = counters;
+	counterBarrier.size = VK_WHOLE_SIZE;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 1, &counterBarrier, 0, nullptr);
+
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, mipmapPipelineRgba8);
+	VkPipeline boundPipeline = mipmapPipelineRgba8;
+	for (uint32_t j = 0; j < jobCount; ++j) {
+		auto &job = jobs[j];
+
+		// a view per level, the slots past the last level repeat it and are never written
+		for (uint32_t level = 0; level < job.mipLevels; ++level) {
+			VkImageViewCreateInfo viewInfo{};
+			viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+			viewInfo.image = job.image;
+			viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+			viewInfo.format = job.format;
+			viewInfo.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, level, 1, 0, 1};
+			VkImageView view;
+			VK_CHECK_RESULT(vkCreateImageView(device, &viewInfo, nullptr, &view));
+			job.views.push_back(view);
+		}
+		std::array<VkDescriptorImageInfo, MIPMAP_MAX_LEVELS> imageInfos;
+		for (uint32_t level = 0; level < MIPMAP_MAX_LEVELS; ++level)
+			imageInfos[level] = {VK_NULL_HANDLE, job.views[std::min(level, job.mipLevels - 1)], VK_IMAGE_LAYOUT_GENERAL};
+		VkDescriptorBufferInfo counterInfo{counters, 0, VK_WHOLE_SIZE};
+
+		VkDescriptorSetAllocateInfo allocInfo{};
+		allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+		allocInfo.descriptorPool = descriptorPool;
+		allocInfo.descriptorSetCount = 1;
+		allocInfo.pSetLayouts = &mipmapDescriptorSetLayout;
+		VkDescriptorSet descriptorSet;
+		VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocInfo, &descriptorSet));
+
+		std::array<VkWriteDescriptorSet, 2> descriptorWrites{};
+		descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		descriptorWrites[0].dstSet = descriptorSet;
+		descriptorWrites[0].dstBinding = 0;
+		descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+		descriptorWrites[0].descriptorCount = MIPMAP_MAX_LEVELS;
+		descriptorWrites[0].pImageInfo = imageInfos.data();
+		descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		descriptorWrites[1].dstSet = descriptorSet;
+		descriptorWrites[1].dstBinding = 1;
+		descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		descriptorWrites[1].descriptorCount = 1;
+		descriptorWrites[1].pBufferInfo = &counterInfo;
+		vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, nullptr);
+
+		const VkPipeline pipeline = job.format == VK_FORMAT_R32G32B32A32_SFLOAT ? mipmapPipelineRgba32f : mipmapPipelineRgba8;
+		if (pipeline != boundPipeline) {
+			vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+			boundPipeline = pipeline;
+		}
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, mipmapPipelineLayout, 0, 1, &descriptorSet, 0, nullptr);
+		const MipmapPushConstants constants{job.width, job.height, job.mipLevels, job.srgb ? 1u : 0u, j};
+		vkCmdPushConstants(commandBuffer, mipmapPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+		vkCmdDispatch(commandBuffer, (job.width + MIPMAP_TILE_SIZE - 1) / MIPMAP_TILE_SIZE, (job.height + MIPMAP_TILE_SIZE - 1) / MIPMAP_TILE_SIZE, 1);
+	}
+
+	std::vector<VkImageMemoryBarrier> barriers;
+	for (const auto &job : jobs) {
+		VkImageMemoryBarrier barrier{};
+		barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+		barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		barrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+		barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.image = job.image;
+		barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, job.mipLevels, 0, 1};
+		barriers.push_back(barrier);
+	}
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr,
+	                     static_cast<uint32_t>(barriers.size()), barriers.data());
+
+	// the views, descriptors and counters live until the dispatches are done
+	std::vector<VkImageView> views;
+	for (const auto &job : jobs)
+		views.insert(views.end(), job.views.begin(), job.views.end());
+	releaseAfterUploads([views, descriptorPool, counters]() {
+		for (auto view : views)
+			vkDestroyImageView(device, view, nullptr);
+		vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+		freeBufferMemory(counters);
+		vkDestroyBuffer(device, counters, nullptr);
+	});
+	jobs.clear();
+}
+
+// the mipmap dispatches are recorded last on the graphics side, nothing waits
+static void submitTextureUploads() {
+	recordMipmapJobs(uploadGraphicsCommands());
+	submitUploads();
+	uploadBatch.submitCount++;
+}
+
+void beginTextureUploads() {
+	if (uploadBatch.depth++ > 0)
+		return;
+	uploadBatch.textureCount = 0;
+	uploadBatch.submitCount = 0;
+}
+
+void endTextureUploads() {
+	if (--uploadBatch.depth > 0)
+		return;
+	submitTextureUploads();
+	if (uploadBatch.textureCount > 1)
+		spdlog::debug(fmt::format("Texture uploads: {} textures in {} submits", uploadBatch.textureCount, uploadBatch.submitCount));
+}
+
+// copy data in the staging ring, the recorded uploads are submitted first when it is full
+static UploadStaging stageTextureData(const void *data, VkDeviceSize size) {
+	UploadStaging staging = stageUpload(data, size);
+	if (staging.buffer == VK_NULL_HANDLE) {
+		submitTextureUploads();
+		staging = stageUpload(data, size);
+	}
+	return staging;
+}
+
+// before the copies, on the transfer queue
+static void recordTransferDstTransition(VkCommandBuffer commandBuffer, VkImage image, uint32_t mipLevels) {
+	VkImageMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = image;
+	barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, mipLevels, 0, 1};
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+}
+
+static void recordMipmaps(VkCommandBuffer commandBuffer, VkImage image, VkFormat imageFormat, int32_t texWidth, int32_t texHeight, uint32_t mipLevels) {
 	// Check if image format supports linear blitting
 	VkFormatProperties formatProperties;
 	vkGetPhysicalDeviceFormatProperties(physicalDevice, imageFormat, &formatProperties);
@@ -20,8 +295,6 @@ void generateMipmaps(VkImage image, VkFormat imageFormat, int32_t texWidth, int3
 		throw std::runtime_error("texture image format does not support linear blitting!");
 	}
 
-	VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
 	VkImageMemoryBarrier barrier{};
 	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
 	barrier.image = image;
@@ -95,7 +368,11 @@ void generateMipmaps(VkImage image, VkFormat imageFormat, int32_t texWidth, int3
 	                     0, nullptr, //
 	                     0, nullptr, //
 	                     1, &barrier);
+}
 
+void generateMipmaps(VkImage image, VkFormat imageFormat, int32_t texWidth, int32_t texHeight, uint32_t mipLevels) {
+	VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+	recordMipmaps(commandBuffer, image, imageFormat, texWidth, texHeight, mipLevels);
 	endSingleTimeCommands(commandBuffer);
 }
 
@@ -144,34 +421,90 @@ void createTextureImage(void *pixels,
                         VkImage &textureImage,
                         VkDeviceMemory &textureImageMemory,
                         uint32_t &mipLevels,
-                        VkFormat format) {
-	VkBuffer stagingBuffer;
-	VkDeviceMemory stagingBufferMemory;
-	createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-	             VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer,
-	             stagingBufferMemory);
-
-	void *data;
-	vkMapMemory(device, stagingBufferMemory, 0, imageSize, 0, &data);
-	memcpy(data, pixels, static_cast<size_t>(imageSize));
-	vkUnmapMemory(device, stagingBufferMemory);
+                        VkFormat format,
+                        bool srgb) {
+	beginTextureUploads();
+	const UploadStaging staging = stageTextureData(pixels, imageSize);
 
 	mipLevels = static_cast<uint32_t>(std::floor(std::log2(std::max(texWidth, texHeight)))) + 1;
+	const bool computeMipmaps = mipLevels > 1 && canComputeMipmaps(format, texWidth, texHeight);
 
 	createImage(texWidth, texHeight, mipLevels, VK_SAMPLE_COUNT_1_BIT, format, VK_IMAGE_TILING_OPTIMAL,
-	            VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+	            VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | (computeMipmaps ? VK_IMAGE_USAGE_STORAGE_BIT : 0),
+	            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage, textureImageMemory);
+
+	VkCommandBuffer transferCommands = uploadTransferCommands();
+	recordTransferDstTransition(transferCommands, textureImage, mipLevels);
+
+	VkBufferImageCopy region{};
+	region.bufferOffset = staging.offset;
+	region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+	region.imageExtent = {static_cast<uint32_t>(texWidth), static_cast<uint32_t>(texHeight), 1};
+	vkCmdCopyBufferToImage(transferCommands, staging.buffer, textureImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+	// the mips are built on the graphics queue
+	if (computeMipmaps) {
+		transferImageOwnership(textureImage, mipLevels, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		                       VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+		uploadBatch.mipmapJobs.push_back({textureImage, format, texWidth, texHeight, mipLevels, srgb, {}});
+	} else {
+		transferImageOwnership(textureImage, mipLevels, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_PIPELINE_STAGE_TRANSFER_BIT,
+		                       VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT);
+		recordMipmaps(uploadGraphicsCommands(), textureImage, format, texWidth, texHeight, mipLevels);
+	}
+
+	uploadBatch.textureCount++;
+	endTextureUploads();
+}
+
+void createTextureImage(const void *data,
+                        const std::vector<TextureLevel> &levels,
+                        const int &texWidth,
+                        const int &texHeight,
+                        VkImage &textureImage,
+                        VkDeviceMemory &textureImageMemory,
+                        uint32_t &mipLevels,
+                        VkFormat format) {
+	// the levels are ranges of data, the whole range is staged once
+	VkDeviceSize dataSize = 0;
+	for (const auto &level : levels)
+		dataSize = std::max(dataSize, level.offset + level.size);
+
+	beginTextureUploads();
+	const UploadStaging staging = stageTextureData(data, dataSize);
+
+	mipLevels = static_cast<uint32_t>(levels.size());
+	createImage(texWidth, texHeight, mipLevels, VK_SAMPLE_COUNT_1_BIT, format, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
 	            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage, textureImageMemory);
 
-	transitionImageLayout(textureImage, format, VK_IMAGE_LAYOUT_UNDEFINED,
-	                      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipLevels);
+	VkCommandBuffer transferCommands = uploadTransferCommands();
+	recordTransferDstTransition(transferCommands, textureImage, mipLevels);
+
+	// one region per level, the extent of the small levels can be smaller than a block
+	std::vector<VkBufferImageCopy> regions(levels.size());
+	for (uint32_t i = 0; i < mipLevels; ++i) {
+		VkBufferImageCopy &region = regions[i];
+		region.bufferOffset = staging.offset + levels[i].offset;
+		region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		region.imageSubresource.mipLevel = i;
+		region.imageSubresource.baseArrayLayer = 0;
+		region.imageSubresource.layerCount = 1;
+		region.imageExtent = {std::max(1u, static_cast<uint32_t>(texWidth) >> i), std::max(1u, static_cast<uint32_t>(texHeight) >> i), 1};
+	}
+	vkCmdCopyBufferToImage(transferCommands, staging.buffer, textureImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, static_cast<uint32_t>(regions.size()), regions.data());
 
-	copyBufferToImage(stagingBuffer, textureImage, static_cast<uint32_t>(texWidth),
-	                  static_cast<uint32_t>(texHeight));
+	transferImageOwnership(textureImage, mipLevels, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+	                       VK_ACCESS_SHADER_READ_BIT);
 
-	generateMipmaps(textureImage, format, texWidth, texHeight, mipLevels);
+	uploadBatch.textureCount++;
+	endTextureUploads();
+}
 
-	vkDestroyBuffer(device, stagingBuffer, nullptr);
-	vkFreeMemory(device, stagingBufferMemory, nullptr);
+bool isTextureFormatSupported(VkFormat format) {
+	VkFormatProperties properties;
+	vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &properties);
+	const VkFormatFeatureFlags features = VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT | VK_FORMAT_FEATURE_TRANSFER_DST_BIT;
+	return (properties.optimalTilingFeatures & features) == features;
 }
 
 VkImageView createTextureImageView(const VkImage textureImage, const uint32_t mipLevels, VkFormat format) {
@@ -216,8 +549,8 @@ void createStorageImage(std::vector<StorageImage> &storageImages, VkFormat forma
 		// Release resources if image is to be recreated
 		if (storageImages[i].image != VK_NULL_HANDLE) {
 			vkDestroyImageView(device, storageImages[i].view, nullptr);
+			freeImageMemory(storageImages[i].image);
 			vkDestroyImage(device, storageImages[i].image, nullptr);
-			vkFreeMemory(device, storageImages[i].memory, nullptr);
 			storageImages[i] = {};
 		}
 
@@ -236,13 +569,7 @@ void createStorageImage(std::vector<StorageImage> &storageImages, VkFormat forma
 		image.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
 		VK_CHECK_RESULT(vkCreateImage(device, &image, nullptr, &storageImages[i].image));
 
-		VkMemoryRequirements memReqs;
-		vkGetImageMemoryRequirements(device, storageImages[i].image, &memReqs);
-		VkMemoryAllocateInfo memoryAllocateInfo{VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO};
-		memoryAllocateInfo.allocationSize = memReqs.size;
-		memoryAllocateInfo.memoryTypeIndex = findMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-		VK_CHECK_RESULT(vkAllocateMemory(device, &memoryAllocateInfo, nullptr, &storageImages[i].memory));
-		VK_CHECK_RESULT(vkBindImageMemory(device, storageImages[i].image, storageImages[i].memory, 0));
+		VK_CHECK_RESULT(bindImageMemory(storageImages[i].image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, storageImages[i].memory));
 
 		VkImageViewCreateInfo colorImageView{VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO};
 		colorImageView.viewType = VK_IMAGE_VIEW_TYPE_2D;
@@ -264,7 +591,7 @@ void createStorageImage(std::vector<StorageImage> &storageImages, VkFormat forma
 void deleteStorageImage(std::vector<StorageImage> &storageImages) {
 	for (auto &storageImage : storageImages) {
 		vkDestroyImageView(device, storageImage.view, nullptr);
+		freeImageMemory(storageImage.image);
 		vkDestroyImage(device, storageImage.image, nullptr);
-		vkFreeMemory(device, storageImage.memory, nullptr);
 	}
 }
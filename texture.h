@@ -12,6 +12,14 @@ struct StorageImage {
 	VkFormat format;
 };
 
+// the createTextureImage calls between begin and end are recorded in one submission of the upload engine, submitted by endTextureUploads
+// (or when the staging ring is full) without waiting, the textures can be sampled after waitUploads
+void beginTextureUploads();
+void endTextureUploads();
+// the rgba8/rgba32f mips are built by a compute downsampler when the batch is submitted (all the levels in one dispatch, sRGB textures
+// averaged in linear), the other formats and the textures over 4096 texels use the blits
+extern bool USE_COMPUTE_MIPMAPS;
+void destroyMipmapPipelines();
 void generateMipmaps(VkImage image, VkFormat imageFormat, int32_t texWidth, int32_t texHeight, uint32_t mipLevels);
 void createTextureImage(const unsigned char *bytes, int size, VkImage &textureImage, VkDeviceMemory &textureImageMemory, uint32_t &mipLevels, bool useFloat=false);
 void createTextureImage(const std::string &texturePath, VkImage &textureImage, VkDeviceMemory &textureImageMemory, uint32_t &mipLevels);
@@ -22,7 +30,24 @@ void createTextureImage(void *pixels,
                         VkImage &textureImage,
                         VkDeviceMemory &textureImageMemory,
                         uint32_t &mipLevels,
+                        VkFormat format,
+                        bool srgb = false);
+// one level of an image already in its GPU format, a range of the data of the texture
+struct TextureLevel {
+	VkDeviceSize offset;
+	VkDeviceSize size;
+};
+// the levels are uploaded as they are, in one copy, without mip generation, for the stored mip chains and the block compressed formats that can't be blitted
+void createTextureImage(const void *data,
+                        const std::vector<TextureLevel> &levels,
+                        const int &texWidth,
+                        const int &texHeight,
+                        VkImage &textureImage,
+                        VkDeviceMemory &textureImageMemory,
+                        uint32_t &mipLevels,
                         VkFormat format);
+// sampled with linear filtering and a transfer destination in optimal tiling
+bool isTextureFormatSupported(VkFormat format);
 VkImageView createTextureImageView(const VkImage textureImage, const uint32_t mipLevels, VkFormat format);
 void createTextureSampler(VkSampler &textureSampler, const uint32_t mipLevels);
 
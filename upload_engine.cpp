@@ -0,0 +1,312 @@
+#include "upload_engine.h"
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+#include <fmt/core.h>
+#include <spdlog/spdlog.h>
+
+#include "core_utils.h"
+
+bool USE_TRANSFER_QUEUE = true;
+
+constexpr VkDeviceSize STAGING_RING_SIZE = 64 * 1024 * 1024;
+constexpr VkDeviceSize STAGING_ALIGNMENT = 16;
+
+// a range of the ring used by a submission, value 0 while it is recorded
+struct StagingSpan {
+	VkDeviceSize offset, size;
+	uint64_t value;
+};
+
+struct PendingRelease {
+	uint64_t value;
+	std::function<void()> release;
+};
+
+struct UploadEngine {
+	uint32_t graphicsFamily{0}, transferFamily{0};
+	VkQueue graphicsQueue{VK_NULL_HANDLE}, transferQueue{VK_NULL_HANDLE};
+	VkCommandPool graphicsPool{VK_NULL_HANDLE}, transferPool{VK_NULL_HANDLE};
+	VkSemaphore timeline{VK_NULL_HANDLE};
+	uint64_t lastValue{0};
+
+	VkBuffer ring{VK_NULL_HANDLE};
+	VkDeviceMemory ringMemory{VK_NULL_HANDLE};
+	unsigned char *ringMapped{nullptr};
+	VkDeviceSize head{0};
+	std::deque<StagingSpan> spans;
+
+	// current submission
+	VkCommandBuffer transferCommands{VK_NULL_HANDLE}, graphicsCommands{VK_NULL_HANDLE};
+	std::vector<PendingRelease> releases;
+};
+static UploadEngine engine;
+
+static VkCommandPool createPool(uint32_t family) {
+	VkCommandPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+	poolInfo.queueFamilyIndex = family;
+	VkCommandPool pool;
+	VK_CHECK_RESULT(vkCreateCommandPool(device, &poolInfo, nullptr, &pool));
+	return pool;
+}
+
+static VkCommandBuffer beginCommands(VkCommandPool pool) {
+	VkCommandBufferAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	allocInfo.commandPool = pool;
+	allocInfo.commandBufferCount = 1;
+	VkCommandBuffer commandBuffer;
+	VK_CHECK_RESULT(vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer));
+
+	VkCommandBufferBeginInfo beginInfo{};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	VK_CHECK_RESULT(vkBeginCommandBuffer(commandBuffer, &beginInfo));
+	return commandBuffer;
+}
+
+void createUploadEngine(uint32_t graphicsFamily, VkQueue graphicsQueue, uint32_t transferFamily, VkQueue transferQueue) {
+	engine.graphicsFamily = graphicsFamily;
+	engine.graphicsQueue = graphicsQueue;
+	engine.transferFamily = transferFamily;
+	engine.transferQueue = transferQueue;
+	engine.graphicsPool = createPool(graphicsFamily);
+	if (transferQueue != VK_NULL_HANDLE)
+		engine.transferPool = createPool(transferFamily);
+
+	VkSemaphoreTypeCreateInfo typeInfo{VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO};
+	typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+	typeInfo.initialValue = 0;
+	VkSemaphoreCreateInfo semaphoreInfo{VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO};
+	semaphoreInfo.pNext = &typeInfo;
+	VK_CHECK_RESULT(vkCreateSemaphore(device, &semaphoreInfo, nullptr, &engine.timeline));
+
+	createBuffer(STAGING_RING_SIZE, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, engine.ring,
+	             engine.ringMemory);
+	engine.ringMapped = static_cast<unsigned char *>(getMappedPointer(engine.ring));
+
+	if (transferQueue != VK_NULL_HANDLE)
+		spdlog::info(fmt::format("Transfer queue: family {}", transferFamily));
+	else
+		spdlog::info("Transfer queue: off, uploads on the graphics queue");
+}
+
+bool hasTransferQueue() {
+	return engine.transferQueue != VK_NULL_HANDLE;
+}
+
+// run the releases and free the ring spans of the completed submissions
+static void collectUploads() {
+	uint64_t completed;
+	VK_CHECK_RESULT(vkGetSemaphoreCounterValue(device, engine.timeline, &completed));
+	while (!engine.spans.empty() && engine.spans.front().value != 0 && engine.spans.front().value <= completed)
+		engine.spans.pop_front();
+	auto done = std::stable_partition(engine.releases.begin(), engine.releases.end(),
+	                                  [completed](const PendingRelease &pending) { return pending.value == 0 || pending.value > completed; });
+	std::vector<PendingRelease> released(std::make_move_iterator(done), std::make_move_iterator(engine.releases.end()));
+	engine.releases.erase(done, engine.releases.end());
+	for (auto &pending : released)
+		pending.release();
+}
+
+void waitUploads(uint64_t value) {
+	value = std::min(value, engine.lastValue);
+	if (value > 0) {
+		VkSemaphoreWaitInfo waitInfo{VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO};
+		waitInfo.semaphoreCount = 1;
+		waitInfo.pSemaphores = &engine.timeline;
+		waitInfo.pValues = &value;
+		VK_CHECK_RESULT(vkWaitSemaphores(device, &waitInfo, UINT64_MAX));
+	}
+	collectUploads();
+}
+
+void destroyUploadEngine() {
+	if (engine.timeline == VK_NULL_HANDLE)
+		return;
+	submitUploads();
+	waitUploads();
+	freeBufferMemory(engine.ring);
+	vkDestroyBuffer(device, engine.ring, nullptr);
+	vkDestroySemaphore(device, engine.timeline, nullptr);
+	vkDestroyCommandPool(device, engine.graphicsPool, nullptr);
+	if (engine.transferPool != VK_NULL_HANDLE)
+		vkDestroyCommandPool(device, engine.transferPool, nullptr);
+	engine = {};
+}
+
+VkCommandBuffer uploadGraphicsCommands() {
+	if (engine.graphicsCommands == VK_NULL_HANDLE)
+		engine.graphicsCommands = beginCommands(engine.graphicsPool);
+	return engine.graphicsCommands;
+}
+
+VkCommandBuffer uploadTransferCommands() {
+	if (engine.transferQueue == VK_NULL_HANDLE)
+		return uploadGraphicsCommands();
+	if (engine.transferCommands == VK_NULL_HANDLE)
+		engine.transferCommands = beginCommands(engine.transferPool);
+	return engine.transferCommands;
+}
+
+void releaseAfterUploads(std::function<void()> release) {
+	engine.releases.push_back({0, std::move(release)});
+}
+
+UploadStaging stageUpload(const void *data, VkDeviceSize size) {
+	collectUploads();
+
+	if (size > STAGING_RING_SIZE / 2) {
+		UploadStaging staging;
+		VkDeviceMemory memory;
+		// freed once the upload is complete, the linear pool is for this short lived staging
+		createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, staging.buffer, memory,
+		             MemoryPoolType::Linear);
+		memcpy(getMappedPointer(staging.buffer), data, static_cast<size_t>(size));
+		releaseAfterUploads([buffer = staging.buffer]() {
+			freeBufferMemory(buffer);
+			vkDestroyBuffer(device, buffer, nullptr);
+		});
+		return staging;
+	}
+
+	for (;;) {
+		VkDeviceSize offset = (engine.head + STAGING_ALIGNMENT - 1) & ~(STAGING_ALIGNMENT - 1);
+		if (offset + size > STAGING_RING_SIZE)
+			offset = 0;
+		// the spans are in submission order, the oldest one in the way is waited
+		auto used = std::find_if(engine.spans.begin(), engine.spans.end(),
+		                         [&](const StagingSpan &span) { return offset < span.offset + span.size && span.offset < offset + size; });
+		if (used == engine.spans.end()) {
+			engine.spans.push_back({offset, size, 0});
+			engine.head = offset + size;
+			memcpy(engine.ringMapped + offset, data, static_cast<size_t>(size));
+			return {engine.ring, offset};
+		}
+		if (used->value == 0)
+			return {};
+		waitUploads(used->value);
+	}
+}
+
+static void recordOwnershipBarrier(VkImageMemoryBarrier *imageBarrier, VkBufferMemoryBarrier *bufferBarrier, VkPipelineStageFlags dstStage, VkAccessFlags dstAccess) {
+	VkAccessFlags &srcAccessMask = imageBarrier ? imageBarrier->srcAccessMask : bufferBarrier->srcAccessMask;
+	VkAccessFlags &dstAccessMask = imageBarrier ? imageBarrier->dstAccessMask : bufferBarrier->dstAccessMask;
+	uint32_t &srcQueueFamilyIndex = imageBarrier ? imageBarrier->srcQueueFamilyIndex : bufferBarrier->srcQueueFamilyIndex;
+	uint32_t &dstQueueFamilyIndex = imageBarrier ? imageBarrier->dstQueueFamilyIndex : bufferBarrier->dstQueueFamilyIndex;
+	const uint32_t imageBarrierCount = imageBarrier ? 1 : 0;
+	const uint32_t bufferBarrierCount = bufferBarrier ? 1 : 0;
+
+	if (engine.transferQueue == VK_NULL_HANDLE) {
+		srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		dstAccessMask = dstAccess;
+		srcQueueFamilyIndex = dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		vkCmdPipelineBarrier(uploadGraphicsCommands(), VK_PIPELINE_STAGE_TRANSFER_BIT, dstStage, 0, 0, nullptr, bufferBarrierCount, bufferBarrier, imageBarrierCount,
+		                     imageBarrier);
+		return;
+	}
+
+	// the release makes the writes available, the acquire visible, the semaphore between the submissions orders them
+	srcQueueFamilyIndex = engine.transferFamily;
+	dstQueueFamilyIndex = engine.graphicsFamily;
+	srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	dstAccessMask = 0;
+	vkCmdPipelineBarrier(uploadTransferCommands(), VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, bufferBarrierCount, bufferBarrier,
+	                     imageBarrierCount, imageBarrier);
+	srcAccessMask = 0;
+	dstAccessMask = dstAccess;
+	vkCmdPipelineBarrier(uploadGraphicsCommands(), VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, dstStage, 0, 0, nullptr, bufferBarrierCount, bufferBarrier, imageBarrierCount,
+	                     imageBarrier);
+}
+
+void transferBufferOwnership(VkBuffer buffer, VkPipelineStageFlags dstStage, VkAccessFlags dstAccess) {
+	VkBufferMemoryBarrier barrier{VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER};
+	barrier.buffer = buffer;
+	barrier.size = VK_WHOLE_SIZE;
+	recordOwnershipBarrier(nullptr, &barrier, dstStage, dstAccess);
+}
+
+void transferImageOwnership(VkImage image, uint32_t mipLevels, VkImageLayout oldLayout, VkImageLayout newLayout, VkPipelineStageFlags dstStage, VkAccessFlags dstAccess) {
+	VkImageMemoryBarrier barrier{VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER};
+	barrier.oldLayout = oldLayout;
+	barrier.newLayout = newLayout;
+	barrier.image = image;
+	barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, mipLevels, 0, 1};
+	recordOwnershipBarrier(&barrier, nullptr, dstStage, dstAccess);
+}
+
+static void submit(VkQueue queue, VkCommandBuffer commandBuffer, uint64_t waitValue, uint64_t signalValue) {
+	VK_CHECK_RESULT(vkEndCommandBuffer(commandBuffer));
+
+	VkTimelineSemaphoreSubmitInfo timelineInfo{VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO};
+	timelineInfo.waitSemaphoreValueCount = waitValue ? 1 : 0;
+	timelineInfo.pWaitSemaphoreValues = &waitValue;
+	timelineInfo.signalSemaphoreValueCount = 1;
+	timelineInfo.pSignalSemaphoreValues = &signalValue;
+
+	const VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+	VkSubmitInfo submitInfo{VK_STRUCTURE_TYPE_SUBMIT_INFO};
+	submitInfo.pNext = &timelineInfo;
+	submitInfo.waitSemaphoreCount = waitValue ? 1 : 0;
+	submitInfo.pWaitSemaphores = &engine.timeline;
+	submitInfo.pWaitDstStageMask = &waitStage;
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &commandBuffer;
+	submitInfo.signalSemaphoreCount = 1;
+	submitInfo.pSignalSemaphores = &engine.timeline;
+	VK_CHECK_RESULT(vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE));
+}
+
+uint64_t submitUploads() {
+	if (engine.transferCommands == VK_NULL_HANDLE && engine.graphicsCommands == VK_NULL_HANDLE)
+		return engine.lastValue;
+
+	// the copies signal a first value, the graphics commands wait it and signal the value of the submission
+	// both queues signal the same timeline, the copies wait the previous graphics value so the signals stay in order
+	if (engine.transferCommands != VK_NULL_HANDLE) {
+		const uint64_t previousValue = engine.lastValue;
+		submit(engine.transferQueue, engine.transferCommands, previousValue, ++engine.lastValue);
+		uploadGraphicsCommands();
+	}
+	const uint64_t transferValue = engine.transferCommands != VK_NULL_HANDLE ? engine.lastValue : 0;
+	submit(engine.graphicsQueue, engine.graphicsCommands, transferValue, ++engine.lastValue);
+
+	const uint64_t value = engine.lastValue;
+	for (auto &span : engine.spans)
+		if (span.value == 0)
+			span.value = value;
+	for (auto &pending : engine.releases)
+		if (pending.value == 0)
+			pending.value = value;
+	engine.releases.push_back({value, [transferCommands = engine.transferCommands, graphicsCommands = engine.graphicsCommands]() {
+		                           if (transferCommands != VK_NULL_HANDLE)
+			                           vkFreeCommandBuffers(device, engine.transferPool, 1, &transferCommands);
+		                           vkFreeCommandBuffers(device, engine.graphicsPool, 1, &graphicsCommands);
+	                           }});
+	engine.transferCommands = VK_NULL_HANDLE;
+	engine.graphicsCommands = VK_NULL_HANDLE;
+	return value;
+}
+
+void uploadBuffer(const void *data, VkDeviceSize size, VkBuffer dstBuffer, VkPipelineStageFlags dstStage, VkAccessFlags dstAccess) {
+	const auto *bytes = static_cast<const unsigned char *>(data);
+	for (VkDeviceSize offset = 0; offset < size;) {
+		const VkDeviceSize chunkSize = std::min(size - offset, STAGING_RING_SIZE / 4);
+		UploadStaging staging = stageUpload(bytes + offset, chunkSize);
+		if (staging.buffer == VK_NULL_HANDLE) {
+			submitUploads();
+			continue;
+		}
+		VkBufferCopy copyRegion{staging.offset, offset, chunkSize};
+		vkCmdCopyBuffer(uploadTransferCommands(), staging.buffer, dstBuffer, 1, &copyRegion);
+		offset += chunkSize;
+	}
+	transferBufferOwnership(dstBuffer, dstStage, dstAccess);
+	submitUploads();
+}
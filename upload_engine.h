@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <vulkan/vulkan_core.h>
+
+// Uploads to the device local buffers and images, recorded on a dedicated transfer queue when the device has one
+// the data is staged in a persistently mapped ring, every submission signals a timeline semaphore value, nothing waits the queues idle
+// the resources written on the transfer queue are released to the graphics queue, the graphics side acquires them after the copies
+
+extern bool USE_TRANSFER_QUEUE;
+
+// transferQueue is VK_NULL_HANDLE without a dedicated transfer family, the graphics queue does everything
+void createUploadEngine(uint32_t graphicsFamily, VkQueue graphicsQueue, uint32_t transferFamily, VkQueue transferQueue);
+// waits the submitted uploads
+void destroyUploadEngine();
+bool hasTransferQueue();
+
+// command buffers of the current submission, the copies go to the transfer commands, the commands using the uploaded data to the graphics ones
+// (the same command buffer without transfer queue)
+VkCommandBuffer uploadTransferCommands();
+VkCommandBuffer uploadGraphicsCommands();
+
+struct UploadStaging {
+	VkBuffer buffer{VK_NULL_HANDLE};
+	VkDeviceSize offset{0};
+};
+// copy data in the staging ring, waiting for the old submissions when it is full
+// buffer is null when the space is held by the commands not submitted yet, submit and stage again
+// the data bigger than half the ring gets its own staging buffer, released with the submission
+UploadStaging stageUpload(const void *data, VkDeviceSize size);
+
+// queue family ownership transfer of a resource written by the transfer commands, with the layout change of an image
+// a plain barrier when the queue is shared
+void transferBufferOwnership(VkBuffer buffer, VkPipelineStageFlags dstStage, VkAccessFlags dstAccess);
+void transferImageOwnership(VkImage image, uint32_t mipLevels, VkImageLayout oldLayout, VkImageLayout newLayout, VkPipelineStageFlags dstStage, VkAccessFlags dstAccess);
+
+// called once the current submission is complete (the transient objects used by its commands)
+void releaseAfterUploads(std::function<void()> release);
+
+// submit the recorded commands, returns the timeline value reached once they are complete
+uint64_t submitUploads();
+// UINT64_MAX waits all the submitted uploads
+void waitUploads(uint64_t value = UINT64_MAX);
+
+// copy data to the start of dstBuffer through the ring in chunks, submitted without wait
+void uploadBuffer(const void *data, VkDeviceSize size, VkBuffer dstBuffer, VkPipelineStageFlags dstStage, VkAccessFlags dstAccess);
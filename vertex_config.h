@@ -7,6 +7,7 @@
 #define GLM_FORCE_DEFAULT_ALIGNED_GENTYPES
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/packing.hpp>
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/hash.hpp>
 
@@ -67,11 +68,161 @@ struct Vertex {
 	}
 };
 
+// octahedral mapping of a unit vector to [-1, 1]^2
+inline glm::vec2 octEncode(glm::vec3 n) {
+	const float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+	if (l1 == 0.f)
+		return glm::vec2(0);
+	n /= l1;
+	glm::vec2 p(n.x, n.y);
+	if (n.z < 0.f)
+		p = (1.f - glm::abs(glm::vec2(n.y, n.x))) * glm::vec2(n.x >= 0.f ? 1.f : -1.f, n.y >= 0.f ? 1.f : -1.f);
+	return p;
+}
+
+// GPU vertex, 32 bytes instead of the 80 of Vertex
+// pos stays in float, it's the BLAS vertex format
+// normal and tangent are octahedral snorm16, uvs are half, color is unorm8 and its alpha holds the bitangent sign (tangent.w)
+// the layout is mirrored in closesthit.rchit
+struct PackedVertex {
+	float pos[3];
+	uint32_t norm;
+	uint32_t tangent;
+	uint32_t color;
+	uint32_t texCoord0;
+	uint32_t texCoord1;
+
+	static PackedVertex pack(const Vertex &v) {
+		PackedVertex p;
+		p.pos[0] = v.pos.x;
+		p.pos[1] = v.pos.y;
+		p.pos[2] = v.pos.z;
+		p.norm = glm::packSnorm2x16(octEncode(v.norm));
+		p.tangent = glm::packSnorm2x16(octEncode(glm::vec3(v.tangent)));
+		p.color = glm::packUnorm4x8(glm::vec4(glm::clamp(v.color, 0.f, 1.f), v.tangent.w < 0.f ? 0.f : 1.f));
+		p.texCoord0 = glm::packHalf2x16(v.texCoord0);
+		p.texCoord1 = glm::packHalf2x16(v.texCoord1);
+		return p;
+	}
+
+	static VkVertexInputBindingDescription getBindingDescription() {
+		VkVertexInputBindingDescription bindingDescription{};
+		bindingDescription.binding = 0;
+		bindingDescription.stride = sizeof(PackedVertex);
+		bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+		return bindingDescription;
+	}
+
+	static std::array<VkVertexInputAttributeDescription, 6> getAttributeDescriptions() {
+		std::array<VkVertexInputAttributeDescription, 6> attributeDescriptions{};
+		attributeDescriptions[0].binding = 0;
+		attributeDescriptions[0].location = 0;
+		attributeDescriptions[0].format = VK_FORMAT_R32G32B32_SFLOAT;
+		attributeDescriptions[0].offset = offsetof(PackedVertex, pos);
+
+		attributeDescriptions[1].binding = 0;
+		attributeDescriptions[1].location = 1;
+		attributeDescriptions[1].format = VK_FORMAT_R16G16_SNORM;
+		attributeDescriptions[1].offset = offsetof(PackedVertex, norm);
+
+		attributeDescriptions[2].binding = 0;
+		attributeDescriptions[2].location = 2;
+		attributeDescriptions[2].format = VK_FORMAT_R16G16_SNORM;
+		attributeDescriptions[2].offset = offsetof(PackedVertex, tangent);
+
+		attributeDescriptions[3].binding = 0;
+		attributeDescriptions[3].location = 3;
+		attributeDescriptions[3].format = VK_FORMAT_R8G8B8A8_UNORM;
+		attributeDescriptions[3].offset = offsetof(PackedVertex, color);
+
+		attributeDescriptions[4].binding = 0;
+		attributeDescriptions[4].location = 4;
+		attributeDescriptions[4].format = VK_FORMAT_R16G16_SFLOAT;
+		attributeDescriptions[4].offset = offsetof(PackedVertex, texCoord0);
+
+		attributeDescriptions[5].binding = 0;
+		attributeDescriptions[5].location = 5;
+		attributeDescriptions[5].format = VK_FORMAT_R16G16_SFLOAT;
+		attributeDescriptions[5].offset = offsetof(PackedVertex, texCoord1);
+
+		return attributeDescriptions;
+	}
+};
+static_assert(sizeof(PackedVertex) == 32, "PackedVertex must match the Vertex struct of closesthit.rchit");
+
+// per instance vertex input of the instanced raster draws (binding 1, locations 6 to 14), read from the instance buffer by the indirect draws
+// rasterizer: transform is the model matrix, motion vector: transform and prevTransform are the model view projection of this frame and the previous one
+// the padding keeps the 16 bytes alignment of the matrices in the scalar layout of the shaders
+struct InstanceData {
+	glm::mat4 transform;
+	glm::mat4 prevTransform;
+	uint32_t material;
+	uint32_t padding[3];
+
+	static VkVertexInputBindingDescription getBindingDescription() {
+		VkVertexInputBindingDescription bindingDescription{};
+		bindingDescription.binding = 1;
+		bindingDescription.stride = sizeof(InstanceData);
+		bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+
+		return bindingDescription;
+	}
+
+	// a mat4 input takes 4 locations, one per column
+	static std::array<VkVertexInputAttributeDescription, 9> getAttributeDescriptions() {
+		std::array<VkVertexInputAttributeDescription, 9> attributeDescriptions{};
+		for (uint32_t i = 0; i < 8; ++i) {
+			attributeDescriptions[i].binding = 1;
+			attributeDescriptions[i].location = 6 + i;
+			attributeDescriptions[i].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+			attributeDescriptions[i].offset = (i < 4 ? offsetof(InstanceData, transform) : offsetof(InstanceData, prevTransform)) + (i % 4) * sizeof(glm::vec4);
+		}
+		attributeDescriptions[8].binding = 1;
+		attributeDescriptions[8].location = 14;
+		attributeDescriptions[8].format = VK_FORMAT_R32_UINT;
+		attributeDescriptions[8].offset = offsetof(InstanceData, material);
+		return attributeDescriptions;
+	}
+};
+static_assert(sizeof(InstanceData) == 144, "InstanceData must match the InstanceData struct of meshlet.glsl and vertexPulling.glsl");
+
+// push constants of the meshlet task/mesh shaders (shaders/meshlet.glsl), one draw per prim and batch of instances
+struct MeshletPushConstants {
+	VkDeviceAddress meshlets;
+	VkDeviceAddress meshletVertices;
+	VkDeviceAddress meshletTriangles;
+	VkDeviceAddress vertices;
+	VkDeviceAddress instances;
+	uint32_t offsetMeshlet;
+	uint32_t meshletCount;
+	uint32_t offsetVertex;
+	uint32_t firstInstance;
+};
+static_assert(sizeof(MeshletPushConstants) == 56, "MeshletPushConstants must match the push constants of meshlet.glsl");
+
+// push constants of the indirect draw vertex shaders (shaders/vertexPulling.glsl), the vertices and the instances are fetched by index
+// the instance index goes through visibleInstances, written by the culling
+struct IndirectPushConstants {
+	VkDeviceAddress vertices;
+	VkDeviceAddress instances;
+	VkDeviceAddress visibleInstances;
+};
+static_assert(sizeof(IndirectPushConstants) == 24, "IndirectPushConstants must match the push constants of vertexPulling.glsl");
+
 namespace std {
+// all the attributes, consistent with operator== for the vertex welding
 template <>
 struct hash<Vertex> {
 	size_t operator()(Vertex const &vertex) const {
-		return ((hash<glm::vec3>()(vertex.pos) ^ (hash<glm::vec3>()(vertex.color) << 1)) >> 1) ^ (hash<glm::vec2>()(vertex.texCoord0) << 1);
+		size_t seed = 0;
+		glm::detail::hash_combine(seed, hash<glm::vec3>()(vertex.pos));
+		glm::detail::hash_combine(seed, hash<glm::vec3>()(vertex.norm));
+		glm::detail::hash_combine(seed, hash<glm::vec4>()(vertex.tangent));
+		glm::detail::hash_combine(seed, hash<glm::vec3>()(vertex.color));
+		glm::detail::hash_combine(seed, hash<glm::vec2>()(vertex.texCoord0));
+		glm::detail::hash_combine(seed, hash<glm::vec2>()(vertex.texCoord1));
+		return seed;
 	}
 };
 } // namespace std